@@ -0,0 +1,132 @@
+/*
+ * bytecode.c - Bytecode file reading
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bytecode.h"
+
+bool
+u6a_bc_read_header(struct u6a_bc_header* restrict header, FILE* restrict input_stream) {
+    int ch;
+    do {
+        ch = fgetc(input_stream);
+        if (UNLIKELY(ch == EOF)) {
+            return false;
+        }
+    } while (ch != U6A_MAGIC);
+    if (UNLIKELY(ch != ungetc(ch, input_stream))) {
+        return false;
+    }
+    if (UNLIKELY(1 != fread(&header->file, U6A_BC_FILE_HEADER_SIZE, 1, input_stream))) {
+        return false;
+    }
+    header->prog.flags = 0;
+    if (LIKELY(header->file.prog_header_size >= U6A_BC_FILE_HEADER_SIZE)) {
+        uint32_t read_size = header->file.prog_header_size;
+        if (read_size > U6A_BC_PROG_HEADER_SIZE) {
+            read_size = U6A_BC_PROG_HEADER_SIZE;
+        }
+        if (UNLIKELY(1 != fread(&header->prog, read_size, 1, input_stream))) {
+            return false;
+        }
+        // Skip fields unknown to this version
+        for (uint32_t idx = read_size; idx < header->file.prog_header_size; ++idx) {
+            if (UNLIKELY(fgetc(input_stream) == EOF)) {
+                return false;
+            }
+        }
+        if (header->file.ver_major != U6A_VER_MAJOR || header->file.ver_minor != U6A_VER_MINOR) {
+            header->prog.flags = 0;
+        }
+    }
+    return true;
+}
+
+static inline bool
+dense_read_varint(const uint8_t** ptr, const uint8_t* end, uint32_t* value) {
+    *value = 0;
+    for (uint32_t shift = 0; shift < 35; shift += 7) {
+        if (UNLIKELY(*ptr == end)) {
+            return false;
+        }
+        uint8_t byte = *(*ptr)++;
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool
+dense_read_token(const uint8_t** ptr, const uint8_t* end, struct u6a_token* token) {
+    if (UNLIKELY(*ptr == end)) {
+        return false;
+    }
+    token->fn = *(*ptr)++;
+    if (token->fn & U6A_VM_FN_CHAR) {
+        if (UNLIKELY(*ptr == end)) {
+            return false;
+        }
+        token->ch = *(*ptr)++;
+    }
+    return true;
+}
+
+uint32_t
+u6a_bc_dense_decode(const uint8_t* ptr, uint32_t size, struct u6a_vm_ins* text) {
+    const uint8_t* end = ptr + size;
+    struct u6a_vm_ins* ins = text;
+    while (ptr < end) {
+        *ins = (struct u6a_vm_ins) { .opcode = *ptr++ };
+        switch (ins->opcode) {
+            case u6a_vo_app:
+                if (UNLIKELY(!dense_read_token(&ptr, end, &ins->operand.fn.first))) {
+                    return UINT32_MAX;
+                }
+                if (UNLIKELY(!dense_read_token(&ptr, end, &ins->operand.fn.second))) {
+                    return UINT32_MAX;
+                }
+                break;
+            case u6a_vo_lc:
+                if (UNLIKELY(ptr == end)) {
+                    return UINT32_MAX;
+                }
+                ins->opcode_ex = *ptr++;
+                if (UNLIKELY(!dense_read_varint(&ptr, end, &ins->operand.offset))) {
+                    return UINT32_MAX;
+                }
+                break;
+            case u6a_vo_sa:
+            case u6a_vo_del:
+                if (UNLIKELY(!dense_read_varint(&ptr, end, &ins->operand.offset))) {
+                    return UINT32_MAX;
+                }
+                break;
+            case u6a_vo_la:
+            case u6a_vo_xch:
+                break;
+            default:
+                // Length of an unknown instruction cannot be told
+                return UINT32_MAX;
+        }
+        ++ins;
+    }
+    return ins - text;
+}
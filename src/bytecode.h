@@ -0,0 +1,52 @@
+/*
+ * bytecode.h - Bytecode file reading definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_BYTECODE_H_
+#define U6A_BYTECODE_H_
+
+#include "common.h"
+#include "defs.h"
+#include "vm_defs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define U6A_BC_CHECK_VER(file_header)                                                                     \
+    ( (file_header).ver_major == U6A_VER_MAJOR                                                            \
+      && ( (file_header).ver_minor == U6A_VER_MINOR || (file_header).ver_minor == U6A_BC_VER_MINOR_NO_FLAGS ) )
+
+/*
+ * Read the header of a bytecode file, skipping anything before the magic byte (e.g. a prefix string).
+ * Fields of the program header are left in network byte order. Flags are only taken from files of this version,
+ * as those of other versions may mean something else, and are otherwise left zero.
+ */
+bool
+u6a_bc_read_header(struct u6a_bc_header* restrict header, FILE* restrict input_stream);
+
+/*
+ * Decode a densely encoded .text section of `size` bytes into `text`, which should have room for `size`
+ * instructions. Returns the number of instructions, or UINT32_MAX if malformed.
+ */
+uint32_t
+u6a_bc_dense_decode(const uint8_t* ptr, uint32_t size, struct u6a_vm_ins* text);
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ * cache.c - Compile cache
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+#include "logging.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#define SOURCE_INIT_SIZE ( 64 * 1024 )
+#define COPY_BUF_SIZE    ( 64 * 1024 )
+
+#define ROTR(word, bits) ( (word) >> (bits) | (word) << ( 32 - (bits) ) )
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t len;
+    uint8_t  block[64];
+    uint32_t block_len;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const char* err_cache = "cache error";
+static const char* info_cache = "cache";
+
+static void
+sha256_init(struct sha256* ctx) {
+    static const uint32_t init_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, init_state, sizeof(init_state));
+    ctx->len = 0;
+    ctx->block_len = 0;
+}
+
+static void
+sha256_compress(struct sha256* ctx, const uint8_t* block) {
+    uint32_t w[64];
+    for (int idx = 0; idx < 16; ++idx) {
+        w[idx] = (uint32_t)block[idx * 4] << 24 | (uint32_t)block[idx * 4 + 1] << 16
+               | (uint32_t)block[idx * 4 + 2] << 8 | block[idx * 4 + 3];
+    }
+    for (int idx = 16; idx < 64; ++idx) {
+        const uint32_t s0 = ROTR(w[idx - 15], 7) ^ ROTR(w[idx - 15], 18) ^ w[idx - 15] >> 3;
+        const uint32_t s1 = ROTR(w[idx - 2], 17) ^ ROTR(w[idx - 2], 19) ^ w[idx - 2] >> 10;
+        w[idx] = w[idx - 16] + s0 + w[idx - 7] + s1;
+    }
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int idx = 0; idx < 64; ++idx) {
+        const uint32_t t1 = h + ( ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25) ) + ( ( e & f ) ^ ( ~e & g ) )
+                          + sha256_k[idx] + w[idx];
+        const uint32_t t2 = ( ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+static void
+sha256_update(struct sha256* ctx, const void* data, size_t len) {
+    const uint8_t* bytes = data;
+    ctx->len += len;
+    if (ctx->block_len) {
+        const size_t fill = 64 - ctx->block_len < len ? 64 - ctx->block_len : len;
+        memcpy(ctx->block + ctx->block_len, bytes, fill);
+        ctx->block_len += fill;
+        bytes += fill;
+        len -= fill;
+        if (ctx->block_len < 64) {
+            return;
+        }
+        sha256_compress(ctx, ctx->block);
+        ctx->block_len = 0;
+    }
+    for (; len >= 64; bytes += 64, len -= 64) {
+        sha256_compress(ctx, bytes);
+    }
+    memcpy(ctx->block, bytes, len);
+    ctx->block_len = len;
+}
+
+static void
+sha256_final(struct sha256* ctx, char* hex) {
+    const uint64_t bits = ctx->len * 8;
+    uint8_t padding[72] = { 0x80 };
+    const size_t padding_len = ( ctx->block_len < 56 ? 56 : 120 ) - ctx->block_len;
+    for (int idx = 0; idx < 8; ++idx) {
+        padding[padding_len + idx] = bits >> ( 56 - idx * 8 );
+    }
+    sha256_update(ctx, padding, padding_len + 8);
+    for (int idx = 0; idx < 32; ++idx) {
+        sprintf(hex + idx * 2, "%02x", (ctx->state[idx / 4] >> ( 24 - idx % 4 * 8 )) & 0xff);
+    }
+}
+
+static bool
+read_source(FILE* input_stream, char** source, size_t* source_len) {
+    size_t cap = SOURCE_INIT_SIZE, len = 0, read_len;
+    char* buffer = malloc(cap);
+    if (UNLIKELY(buffer == NULL)) {
+        u6a_err_bad_alloc(err_cache, cap);
+        return false;
+    }
+    while (( read_len = fread(buffer + len, sizeof(char), cap - len, input_stream) )) {
+        len += read_len;
+        if (len < cap) {
+            continue;
+        }
+        char* new_buffer = realloc(buffer, cap * 2);
+        if (UNLIKELY(new_buffer == NULL)) {
+            u6a_err_bad_alloc(err_cache, cap * 2);
+            free(buffer);
+            return false;
+        }
+        buffer = new_buffer;
+        cap *= 2;
+    }
+    if (UNLIKELY(ferror(input_stream))) {
+        u6a_err_custom(err_cache, "failed to read source code");
+        free(buffer);
+        return false;
+    }
+    *source = buffer;
+    *source_len = len;
+    return true;
+}
+
+// Append the whole content of `from` to `to`
+static bool
+copy_stream(FILE* from, FILE* to, const char* to_name) {
+#ifdef FICLONE
+    // Cached output and the output file may share their extents, if supported by the file system.
+    // Cloning replaces the whole file, so it is only done to an empty regular file, e.g. not to what stdout is.
+    struct stat to_stat;
+    if (fflush(to) == 0 && fstat(fileno(to), &to_stat) == 0 && S_ISREG(to_stat.st_mode) && to_stat.st_size == 0
+        && ioctl(fileno(to), FICLONE, fileno(from)) == 0)
+    {
+        return true;
+    }
+#endif
+    char buffer[COPY_BUF_SIZE];
+    size_t read_len;
+    rewind(from);
+    while (( read_len = fread(buffer, sizeof(char), COPY_BUF_SIZE, from) )) {
+        if (UNLIKELY(read_len != fwrite(buffer, sizeof(char), read_len, to))) {
+            u6a_err_write_failed(err_cache, read_len, to_name);
+            return false;
+        }
+    }
+    if (UNLIKELY(ferror(from))) {
+        u6a_err_custom(err_cache, "failed to read cached output");
+        return false;
+    }
+    return true;
+}
+
+bool
+u6a_cache_lookup(const char* dir, FILE* input_stream, char** source, size_t* source_len,
+                 const struct u6a_codegen_options* options, const char* prefix, struct u6a_cache_entry* entry)
+{
+    if (UNLIKELY(!read_source(input_stream, source, source_len))) {
+        return false;
+    }
+    // Everything which affects the output, with fields terminated by '\0'
+    struct sha256 ctx;
+    char header[64], key[U6A_CACHE_KEY_LEN + 1];
+    const int header_len = snprintf(header, sizeof(header), "u6ac %d.%d.%d %d%d%d%d%d", U6A_VER_MAJOR, U6A_VER_MINOR,
+        U6A_VER_PATCH, options->optimize_const, options->dump_mnemonics, options->dense_text, options->module,
+        prefix != NULL);
+    sha256_init(&ctx);
+    sha256_update(&ctx, header, header_len + 1);
+    if (prefix) {
+        sha256_update(&ctx, prefix, strlen(prefix) + 1);
+    }
+    sha256_update(&ctx, *source, *source_len);
+    sha256_final(&ctx, key);
+    // Entries are spread over subdirectories named after the first two digits of their keys
+    const size_t path_len = strlen(dir) + U6A_CACHE_KEY_LEN + 2;
+    if (UNLIKELY(path_len > PATH_MAX - 1)) {
+        u6a_err_path_too_long(err_cache, PATH_MAX - 1, path_len);
+        free(*source);
+        *source = NULL;
+        return false;
+    }
+    snprintf(entry->path, PATH_MAX, "%s/%.2s/%s", dir, key, key + 2);
+    entry->temp_path[0] = '\0';
+    entry->temp_stream = NULL;
+    return true;
+}
+
+enum u6a_cache_status
+u6a_cache_fetch(struct u6a_cache_entry* entry, FILE* output_stream, const char* output_name) {
+    FILE* cached = fopen(entry->path, "rb");
+    if (cached == NULL) {
+        return u6a_cs_miss;
+    }
+    const bool ok = copy_stream(cached, output_stream, output_name);
+    fclose(cached);
+    return ok ? u6a_cs_hit : u6a_cs_error;
+}
+
+FILE*
+u6a_cache_source_stream(char* source, size_t source_len) {
+#ifdef HAVE_FMEMOPEN
+    if (source_len) {
+        return fmemopen(source, source_len, "r");
+    }
+#endif
+    FILE* stream = tmpfile();
+    if (stream && UNLIKELY(source_len != fwrite(source, sizeof(char), source_len, stream))) {
+        fclose(stream);
+        return NULL;
+    }
+    if (stream) {
+        rewind(stream);
+    }
+    return stream;
+}
+
+FILE*
+u6a_cache_begin(struct u6a_cache_entry* entry) {
+    // Only the innermost two directories are created if missing
+    char* subdir_end = strrchr(entry->path, '/');
+    *subdir_end = '\0';
+    char* dir_end = strrchr(entry->path, '/');
+    *dir_end = '\0';
+    bool ok = mkdir(entry->path, 0777) == 0 || errno == EEXIST;
+    *dir_end = '/';
+    ok = ok && ( mkdir(entry->path, 0777) == 0 || errno == EEXIST );
+    // Shorter than the path of the entry
+    const size_t subdir_len = subdir_end - entry->path;
+    memcpy(entry->temp_path, entry->path, subdir_len);
+    strcpy(entry->temp_path + subdir_len, "/.tmp.XXXXXX");
+    *subdir_end = '/';
+    // Each writer has a file of its own, so that concurrent writers of the same entry never interfere
+    const int fd = ok ? mkstemp(entry->temp_path) : -1;
+    if (UNLIKELY(fd < 0)) {
+        u6a_info_verbose(info_cache, "cannot write to %s, output not cached", entry->path);
+        entry->temp_path[0] = '\0';
+        return NULL;
+    }
+    fchmod(fd, 0644);
+    entry->temp_stream = fdopen(fd, "w+b");
+    if (UNLIKELY(entry->temp_stream == NULL)) {
+        close(fd);
+        u6a_cache_abort(entry);
+    }
+    return entry->temp_stream;
+}
+
+bool
+u6a_cache_commit(struct u6a_cache_entry* entry, FILE* output_stream, const char* output_name) {
+    FILE* temp_stream = entry->temp_stream;
+    entry->temp_stream = NULL;
+    if (UNLIKELY(fflush(temp_stream) != 0 || ferror(temp_stream))) {
+        u6a_err_write_failed(err_cache, 0, entry->temp_path);
+        fclose(temp_stream);
+        u6a_cache_abort(entry);
+        return false;
+    }
+    const bool ok = copy_stream(temp_stream, output_stream, output_name);
+    fclose(temp_stream);
+    // Renaming is atomic, so that readers never see an entry partially written
+    if (UNLIKELY(!ok || rename(entry->temp_path, entry->path) != 0)) {
+        u6a_cache_abort(entry);
+        return ok;
+    }
+    entry->temp_path[0] = '\0';
+    return true;
+}
+
+void
+u6a_cache_abort(struct u6a_cache_entry* entry) {
+    if (entry->temp_stream) {
+        fclose(entry->temp_stream);
+        entry->temp_stream = NULL;
+    }
+    if (entry->temp_path[0]) {
+        remove(entry->temp_path);
+        entry->temp_path[0] = '\0';
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * cache.h - Compile cache definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_CACHE_H_
+#define U6A_CACHE_H_
+
+#include "common.h"
+#include "codegen.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <limits.h>
+
+#define U6A_CACHE_DIR_ENV "U6AC_CACHE_DIR"
+
+// Length of the hexadecimal SHA-256 digest of the source and options, which names the cached output
+#define U6A_CACHE_KEY_LEN 64
+
+struct u6a_cache_entry {
+    char  path[PATH_MAX];            /* of the cached output */
+    char  temp_path[PATH_MAX];       /* of the output being written, renamed to `path` once complete */
+    FILE* temp_stream;
+};
+
+/*
+ * Read the whole source from `input_stream` into `source`, to be freed by the caller, and find where its output
+ * would be cached in `dir`, with regard to everything that affects it. Returns false on failure.
+ */
+bool
+u6a_cache_lookup(const char* dir, FILE* input_stream, char** source, size_t* source_len,
+                 const struct u6a_codegen_options* options, const char* prefix, struct u6a_cache_entry* entry);
+
+enum u6a_cache_status {
+    u6a_cs_miss,
+    u6a_cs_hit,
+    u6a_cs_error                     /* cached, but failed to be copied to the output */
+};
+
+// Copy the cached output to `output_stream`, if any
+enum u6a_cache_status
+u6a_cache_fetch(struct u6a_cache_entry* entry, FILE* output_stream, const char* output_name);
+
+// Open a stream to read the source from, after u6a_cache_lookup() has read it, returns NULL on failure
+FILE*
+u6a_cache_source_stream(char* source, size_t source_len);
+
+// Open a stream for the output to be written to, or NULL if it cannot be cached
+FILE*
+u6a_cache_begin(struct u6a_cache_entry* entry);
+
+// Copy the output written so far to `output_stream`, and add it to the cache
+bool
+u6a_cache_commit(struct u6a_cache_entry* entry, FILE* output_stream, const char* output_name);
+
+// Discard the output written so far, if any
+void
+u6a_cache_abort(struct u6a_cache_entry* entry);
+
+#endif
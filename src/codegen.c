@@ -23,6 +23,7 @@
 #include "logging.h"
 #include "vm_defs.h"
 #include "dump.h"
+#include "time_report.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +32,9 @@
 
 #define OPTIMIZE_STR_MIN_LEN 0x04
 
+#define RODATA_TABLE_INIT_CAP  64
+#define RODATA_HASH_MULTIPLIER 0x01000193
+
 #define WRITE_SECION(buffer, type_size, len, ostream)                \
     if (UNLIKELY(len != fwrite(buffer, type_size, len, ostream))) {  \
         write_len = len * type_size;                                 \
@@ -45,21 +49,203 @@ struct ins_with_offset {
     uint32_t          offset;
 };
 
+// Strings in .rodata, along with all of their suffixes, are interned in an open addressing hash table
+struct rodata_entry {
+    uint32_t offset;
+    uint32_t len;
+    uint32_t hash;
+};
+
+struct rodata_table {
+    struct rodata_entry* entries;
+    uint32_t             cap;
+    uint32_t             size;
+    uint32_t             strings;
+    uint32_t             reused;
+    uint32_t             saved_bytes;
+};
+
+// Hash is computed from the tail, so that hashes of all suffixes can be obtained in one pass
+static inline uint32_t
+rodata_hash_step(uint32_t hash, char ch) {
+    return hash * RODATA_HASH_MULTIPLIER + (uint8_t)ch;
+}
+
+static inline uint32_t
+rodata_hash(const char* str, uint32_t len) {
+    uint32_t hash = 0;
+    while (len) {
+        hash = rodata_hash_step(hash, str[--len]);
+    }
+    return hash;
+}
+
+static inline struct rodata_entry*
+rodata_table_find(struct rodata_table* table, const char* rodata, const char* str, uint32_t len, uint32_t hash) {
+    for (uint32_t idx = hash & (table->cap - 1); ; idx = (idx + 1) & (table->cap - 1)) {
+        struct rodata_entry* entry = table->entries + idx;
+        if (entry->len == 0) {
+            return entry;
+        }
+        if (entry->hash == hash && entry->len == len && memcmp(rodata + entry->offset, str, len) == 0) {
+            return entry;
+        }
+    }
+}
+
+static bool
+rodata_table_grow(struct rodata_table* table, const char* rodata) {
+    struct rodata_entry* old_entries = table->entries;
+    uint32_t old_cap = table->cap;
+    table->cap = old_cap ? old_cap * 2 : RODATA_TABLE_INIT_CAP;
+    table->entries = calloc(table->cap, sizeof(struct rodata_entry));
+    if (UNLIKELY(table->entries == NULL)) {
+        u6a_err_bad_alloc(err_codegen, table->cap * sizeof(struct rodata_entry));
+        free(old_entries);
+        return false;
+    }
+    u6a_time_report_alloc(u6a_tp_codegen, table->cap * sizeof(struct rodata_entry));
+    for (uint32_t idx = 0; idx < old_cap; ++idx) {
+        struct rodata_entry* entry = old_entries + idx;
+        if (entry->len) {
+            *rodata_table_find(table, rodata, rodata + entry->offset, entry->len, entry->hash) = *entry;
+        }
+    }
+    free(old_entries);
+    u6a_time_report_free(u6a_tp_codegen, old_cap * sizeof(struct rodata_entry));
+    return true;
+}
+
+static bool
+rodata_table_insert(struct rodata_table* table, const char* rodata, uint32_t offset, uint32_t len) {
+    uint32_t hash = 0;
+    for (uint32_t idx = len; idx-- > 0; ) {
+        hash = rodata_hash_step(hash, rodata[offset + idx]);
+        uint32_t suffix_len = len - idx;
+        if (suffix_len < OPTIMIZE_STR_MIN_LEN) {
+            continue;
+        }
+        if (UNLIKELY(table->size * 2 >= table->cap)) {
+            if (UNLIKELY(!rodata_table_grow(table, rodata))) {
+                return false;
+            }
+        }
+        struct rodata_entry* entry = rodata_table_find(table, rodata, rodata + offset + idx, suffix_len, hash);
+        if (entry->len == 0) {
+            *entry = (struct rodata_entry) { .offset = offset + idx, .len = suffix_len, .hash = hash };
+            ++table->size;
+        }
+    }
+    ++table->strings;
+    return true;
+}
+
+// Features other than `d` can only be used by the function tokens which are operands of `app`
+static inline uint32_t
+text_unused_features(const struct u6a_vm_ins* text, uint32_t text_len) {
+    uint32_t flags = U6A_BC_FLAGS_NO_FEATURE;
+    for (const struct u6a_vm_ins* ins = text; ins < text + text_len; ++ins) {
+        if (ins->opcode == u6a_vo_app) {
+            flags &= ~u6a_vm_fn_feature(ins->operand.fn.first.fn) & ~u6a_vm_fn_feature(ins->operand.fn.second.fn);
+        } else if (ins->opcode == u6a_vo_del) {
+            flags &= ~U6A_BC_FLAG_NO_PROMISE;
+        }
+    }
+    return flags;
+}
+
+// Offsets are written in network byte order, and kept in host byte order for programs generated into memory
+static inline uint32_t
+encode_offset(const struct u6a_codegen_options* options, uint32_t offset) {
+    return options->program ? offset : htonl(offset);
+}
+
+// Hand the buffer of .text over to the program, along with a copy of .rodata
+static bool
+hand_over(struct u6a_codegen_program* program, void* bc_buffer, uint32_t text_len, const char* rodata_buffer,
+          uint32_t rodata_len)
+{
+    const struct u6a_vm_ins* text_buffer = (struct u6a_vm_ins*)bc_buffer + program->text_reserved;
+    char* rodata = malloc(rodata_len);
+    if (UNLIKELY(rodata == NULL)) {
+        u6a_err_bad_alloc(err_codegen, rodata_len);
+        free(bc_buffer);
+        return false;
+    }
+    memcpy(rodata, rodata_buffer, rodata_len);
+    program->flags = text_unused_features(text_buffer, text_len);
+    // Give back the space of .rodata and of the instructions not generated
+    void* text = realloc(bc_buffer, ( program->text_reserved + text_len ) * sizeof(struct u6a_vm_ins));
+    program->text = text ? text : bc_buffer;
+    program->text_len = text_len;
+    program->rodata = rodata;
+    program->rodata_len = rodata_len;
+    return true;
+}
+
 static inline bool
-write_bc_header(FILE* restrict output_stream, uint32_t text_len, uint32_t rodata_len) {
+write_bc_header(FILE* restrict output_stream, uint32_t text_size, uint32_t rodata_len, uint32_t flags) {
+    // Files without flags keep the version and the shorter program header understood by older versions
+    const uint8_t prog_header_size = flags ? U6A_BC_PROG_HEADER_SIZE : U6A_BC_PROG_HEADER_MIN_SIZE;
     struct u6a_bc_header header = {
         .file = {
             .magic            = U6A_MAGIC,
             .ver_major        = U6A_VER_MAJOR,
-            .ver_minor        = U6A_VER_MINOR,
-            .prog_header_size = U6A_BC_PROG_HEADER_SIZE
+            .ver_minor        = flags ? U6A_VER_MINOR : U6A_BC_VER_MINOR_NO_FLAGS,
+            .prog_header_size = prog_header_size
         },
         .prog = {
-            .text_size        = htonl(text_len * sizeof(struct u6a_vm_ins)),
-            .rodata_size      = htonl(rodata_len * sizeof(uint8_t))
+            .text_size        = htonl(text_size),
+            .rodata_size      = htonl(rodata_len * sizeof(uint8_t)),
+            .flags            = htonl(flags)
         }
     };
-    return 1 == fwrite(&header, sizeof(struct u6a_bc_header), 1, output_stream);
+    return 1 == fwrite(&header, U6A_BC_FILE_HEADER_SIZE + prog_header_size, 1, output_stream);
+}
+
+static inline uint8_t*
+dense_write_varint(uint8_t* out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+static inline uint8_t*
+dense_write_token(uint8_t* out, struct u6a_token token) {
+    *out++ = token.fn;
+    if (token.fn & U6A_TOKEN_FN_CHAR) {
+        *out++ = token.ch;
+    }
+    return out;
+}
+
+// Encode instructions (with offsets in network byte order) into `out`, returning the size in bytes
+static uint32_t
+dense_encode(uint8_t* out, const struct u6a_vm_ins* text, uint32_t text_len) {
+    uint8_t* const begin = out;
+    for (const struct u6a_vm_ins* ins = text; ins < text + text_len; ++ins) {
+        *out++ = ins->opcode;
+        switch (ins->opcode) {
+            case u6a_vo_app:
+                out = dense_write_token(out, ins->operand.fn.first);
+                out = dense_write_token(out, ins->operand.fn.second);
+                break;
+            case u6a_vo_lc:
+                *out++ = ins->opcode_ex;
+                out = dense_write_varint(out, ntohl(ins->operand.offset));
+                break;
+            case u6a_vo_sa:
+            case u6a_vo_del:
+                out = dense_write_varint(out, ntohl(ins->operand.offset));
+                break;
+            default:
+                break;
+        }
+    }
+    return out - begin;
 }
 
 bool
@@ -81,12 +267,17 @@ u6a_write_prefix(const struct u6a_codegen_options* options, const char* prefix_s
 
 bool
 u6a_codegen(const struct u6a_codegen_options* options, struct u6a_ast_node* ast_arr, uint32_t ast_len) {
-    void* bc_buffer = calloc(ast_len, sizeof(struct u6a_vm_ins) + sizeof(char));
+    if (options->module) {
+        // Instead of exiting with it, a module leaves the value of its expression to what it is linked with
+        U6A_AN_FN(U6A_AN_LEFT(ast_arr)) = u6a_tf_i;
+    }
+    const uint32_t text_reserved = options->program ? options->program->text_reserved : 0;
+    void* bc_buffer = calloc(text_reserved + ast_len, sizeof(struct u6a_vm_ins) + sizeof(char));
     if (UNLIKELY(bc_buffer == NULL)) {
-        u6a_err_bad_alloc(err_codegen, ast_len * (sizeof(struct u6a_vm_ins) + sizeof(char)));
+        u6a_err_bad_alloc(err_codegen, ( text_reserved + ast_len ) * (sizeof(struct u6a_vm_ins) + sizeof(char)));
         return false;
     }
-    struct u6a_vm_ins* text_buffer = bc_buffer;
+    struct u6a_vm_ins* text_buffer = (struct u6a_vm_ins*)bc_buffer + text_reserved;
     char* rodata_buffer = (char*)(text_buffer + ast_len);
     uint32_t text_len = 0;
     uint32_t rodata_len = 0;
@@ -96,7 +287,15 @@ u6a_codegen(const struct u6a_codegen_options* options, struct u6a_ast_node* ast_
         free(bc_buffer);
         return false;
     }
+    u6a_time_report_alloc(u6a_tp_codegen, ast_len * (sizeof(struct u6a_vm_ins) + sizeof(char) +
+                                                     sizeof(struct ins_with_offset)));
     uint32_t stack_top = UINT32_MAX;
+    struct rodata_table rodata_table = { 0 };
+    if (options->optimize_const && UNLIKELY(!rodata_table_grow(&rodata_table, rodata_buffer))) {
+        free(bc_buffer);
+        free(stack);
+        return false;
+    }
     for (uint32_t node_idx = 0; node_idx < ast_len; ++node_idx) {
         struct u6a_ast_node* node = ast_arr + node_idx;
         if (U6A_AN_FN(node) != u6a_tf_app) {
@@ -149,11 +348,29 @@ u6a_codegen(const struct u6a_codegen_options* options, struct u6a_ast_node* ast_
                         stack_top = old_stack_top;
                         goto no_optimize_str;
                     } else {
-                        rodata_buffer[rodata_len++] = '\0';
+                        uint32_t str_len = rodata_len - old_rodata_len;
+                        const char* str = rodata_buffer + old_rodata_len;
+                        struct rodata_entry* entry = rodata_table_find(&rodata_table, rodata_buffer, str, str_len,
+                                                                       rodata_hash(str, str_len));
+                        uint32_t str_offset = old_rodata_len;
+                        if (entry->len) {
+                            // Identical string (or suffix of a longer one) already in .rodata
+                            str_offset = entry->offset;
+                            rodata_len = old_rodata_len;
+                            ++rodata_table.reused;
+                            rodata_table.saved_bytes += str_len + 1;
+                        } else {
+                            rodata_buffer[rodata_len++] = '\0';
+                            if (UNLIKELY(!rodata_table_insert(&rodata_table, rodata_buffer, str_offset, str_len))) {
+                                free(bc_buffer);
+                                free(stack);
+                                return false;
+                            }
+                        }
                         text_buffer[text_len++] = (struct u6a_vm_ins) {
                             .opcode = u6a_vo_lc,
                             .opcode_ex = u6a_vo_ex_print,
-                            .operand.offset = htonl(old_rodata_len)
+                            .operand.offset = encode_offset(options, str_offset)
                         };
                         text_buffer[text_len++] = (struct u6a_vm_ins) {
                             .opcode = u6a_vo_app,
@@ -182,37 +399,83 @@ u6a_codegen(const struct u6a_codegen_options* options, struct u6a_ast_node* ast_
                     } else {
                         text_buffer[text_len++] = top_elem->ins;
                         if (top_elem->ins.opcode == u6a_vo_la) {
-                            text_buffer[top_elem->offset].operand.offset = htonl(text_len);
+                            text_buffer[top_elem->offset].operand.offset = encode_offset(options, text_len);
                         }
                     }
                 }
             }
         }
     }
+    bool emitted;
+    if (options->program) {
+        emitted = hand_over(options->program, bc_buffer, text_len, rodata_buffer, rodata_len);
+    } else {
+        emitted = u6a_codegen_emit(options, text_buffer, text_len, rodata_buffer, rodata_len);
+        free(bc_buffer);
+    }
+    free(stack);
+    free(rodata_table.entries);
+    if (UNLIKELY(!emitted)) {
+        return false;
+    }
+    u6a_info_verbose(info_codegen, "completed, text: %" PRIu32 ", rodata: %" PRIu32, text_len, rodata_len);
+    if (options->optimize_const) {
+        u6a_info_verbose(info_codegen, "rodata strings: %" PRIu32 " stored, %" PRIu32 " reused, %" PRIu32
+            " bytes saved", rodata_table.strings, rodata_table.reused, rodata_table.saved_bytes);
+    }
+    return true;
+}
+
+bool
+u6a_codegen_emit(const struct u6a_codegen_options* options, const struct u6a_vm_ins* text_buffer, uint32_t text_len,
+                 const char* rodata_buffer, uint32_t rodata_len)
+{
     uint32_t write_len = 0;
+    uint8_t* dense_buffer = NULL;
+    const uint32_t flags = text_unused_features(text_buffer, text_len) | ( options->module ? U6A_BC_FLAG_MODULE : 0 );
     if (UNLIKELY(options->dump_mnemonics)) {
+        u6a_time_report_enter(u6a_tp_write);
         if (UNLIKELY(!u6a_dump_mnemonics(options->output_stream, text_buffer, text_len))) {
             goto codegen_failed;
         }
         if (UNLIKELY(!u6a_dump_data(options->output_stream, rodata_buffer, rodata_len))) {
             goto codegen_failed;
         }
-    } else {
-        if (UNLIKELY(!write_bc_header(options->output_stream, text_len, rodata_len))) {
+    } else if (options->dense_text) {
+        dense_buffer = malloc(text_len * U6A_VM_DENSE_INS_MAX_SIZE + 1);
+        if (UNLIKELY(dense_buffer == NULL)) {
+            u6a_err_bad_alloc(err_codegen, text_len * U6A_VM_DENSE_INS_MAX_SIZE + 1);
+            return false;
+        }
+        u6a_time_report_alloc(u6a_tp_codegen, text_len * U6A_VM_DENSE_INS_MAX_SIZE + 1);
+        uint32_t dense_size = dense_encode(dense_buffer, text_buffer, text_len);
+        u6a_time_report_enter(u6a_tp_write);
+        if (UNLIKELY(!write_bc_header(options->output_stream, dense_size, rodata_len,
+                                     flags | U6A_BC_FLAG_DENSE_TEXT)))
+        {
             write_len = sizeof(struct u6a_bc_header);
             goto codegen_failed;
         }
+        WRITE_SECION(dense_buffer, sizeof(uint8_t), dense_size, options->output_stream);
+        WRITE_SECION(rodata_buffer, sizeof(char), rodata_len, options->output_stream);
+        u6a_info_verbose(info_codegen, "dense text: %" PRIu32 " bytes, %zu bytes when not encoded", dense_size,
+            text_len * sizeof(struct u6a_vm_ins));
+    } else {
+        u6a_time_report_enter(u6a_tp_write);
+        if (UNLIKELY(!write_bc_header(options->output_stream, text_len * sizeof(struct u6a_vm_ins), rodata_len,
+                                      flags)))
+        {
+            write_len = U6A_BC_FILE_HEADER_SIZE + ( flags ? U6A_BC_PROG_HEADER_SIZE : U6A_BC_PROG_HEADER_MIN_SIZE );
+            goto codegen_failed;
+        }
         WRITE_SECION(text_buffer, sizeof(struct u6a_vm_ins), text_len, options->output_stream);
         WRITE_SECION(rodata_buffer, sizeof(char), rodata_len, options->output_stream);
     }
-    free(bc_buffer);
-    free(stack);
-    u6a_info_verbose(info_codegen, "completed, text: %" PRIu32 ", rodata: %" PRIu32, text_len, rodata_len);
+    free(dense_buffer);
     return true;
 
     codegen_failed:
     u6a_err_write_failed(err_codegen, write_len, options->file_name);
-    free(bc_buffer);
-    free(stack);
+    free(dense_buffer);
     return false;
 }
@@ -24,15 +24,29 @@
 
 #include "common.h"
 #include "defs.h"
+#include "vm_defs.h"
 
 #include <stdbool.h>
 #include <stdio.h>
 
+// Program generated into memory, with offsets in host byte order. Buffers are to be freed by the caller.
+struct u6a_codegen_program {
+    uint32_t           text_reserved;  /* instructions left unused before .text, for the caller to fill in */
+    struct u6a_vm_ins* text;           /* including the reserved instructions */
+    uint32_t           text_len;       /* excluding the reserved instructions */
+    char*              rodata;
+    uint32_t           rodata_len;
+    uint32_t           flags;          /* U6A_BC_FLAG_NO_* */
+};
+
 struct u6a_codegen_options {
-    FILE* output_stream;
-    char* file_name;
-    bool  optimize_const;
-    bool  dump_mnemonics;
+    FILE*                       output_stream;
+    char*                       file_name;
+    bool                        optimize_const;
+    bool                        dump_mnemonics;
+    bool                        dense_text;
+    bool                        module;          /* relocatable, to be linked with u6a_link() */
+    struct u6a_codegen_program* program;         /* if not NULL, generate into it instead of `output_stream` */
 };
 
 bool
@@ -41,4 +55,9 @@ u6a_write_prefix(const struct u6a_codegen_options* options, const char* prefix_s
 bool
 u6a_codegen(const struct u6a_codegen_options* options, struct u6a_ast_node* ast_arr, uint32_t ast_len);
 
+// Write a program of instructions with offsets in network byte order, as generated by u6a_codegen()
+bool
+u6a_codegen_emit(const struct u6a_codegen_options* options, const struct u6a_vm_ins* text_buffer, uint32_t text_len,
+                 const char* rodata_buffer, uint32_t rodata_len);
+
 #endif
@@ -31,13 +31,31 @@
 #define UNLIKELY(expr)    __builtin_expect(!!(expr), 0)
 #define U6A_COLD          __attribute__((cold))
 #define U6A_HOT           __attribute__((hot))
+#define U6A_INLINE_ALWAYS inline __attribute__((always_inline))
+#define U6A_INLINE_NEVER  __attribute__((noinline))
 #define U6A_NOT_REACHED() __builtin_unreachable()
+#define U6A_PREFETCH(ptr) __builtin_prefetch(ptr)
+#define U6A_CTZ(word)     __builtin_ctz(word)
+#define U6A_THREAD_LOCAL  __thread
 #else
 #define LIKELY(expr)      (expr)
 #define UNLIKELY(expr)    (expr)
 #define U6A_COLD
 #define U6A_HOT
+#define U6A_INLINE_ALWAYS inline
+#define U6A_INLINE_NEVER
 #define U6A_NOT_REACHED()
+#define U6A_PREFETCH(ptr) ( (void)(ptr) )
+#define U6A_CTZ(word)     u6a_ctz_(word)
+#define U6A_THREAD_LOCAL
+static inline int
+u6a_ctz_(unsigned word) {
+    int count = 0;
+    for (; !( word & 1 ); word >>= 1) {
+        ++count;
+    }
+    return count;
+}
 #endif
 
 #ifdef __linux__
@@ -48,7 +66,7 @@
 
 #define U6A_MAGIC     0xDC  /* Latin 'U' with diaeresis */
 #define U6A_VER_MAJOR 0x00
-#define U6A_VER_MINOR 0x01
-#define U6A_VER_PATCH 0x02
+#define U6A_VER_MINOR 0x02
+#define U6A_VER_PATCH 0x00
 
 #endif
@@ -70,10 +70,30 @@ struct u6a_bc_header {
     struct {
         uint32_t text_size;          /* length of text segment (Bytes) */
         uint32_t rodata_size;        /* length of rodata segment (Bytes) */
+        uint32_t flags;              /* since version 0.2, which is only written when not zero */
     } prog;
 };
 
-#define U6A_BC_FILE_HEADER_SIZE sizeof(((struct u6a_bc_header*)NULL)->file)
-#define U6A_BC_PROG_HEADER_SIZE sizeof(((struct u6a_bc_header*)NULL)->prog)
+#define U6A_BC_FILE_HEADER_SIZE     sizeof(((struct u6a_bc_header*)NULL)->file)
+#define U6A_BC_PROG_HEADER_SIZE     sizeof(((struct u6a_bc_header*)NULL)->prog)
+#define U6A_BC_PROG_HEADER_MIN_SIZE ( U6A_BC_PROG_HEADER_SIZE - sizeof(uint32_t) )
+
+// Files without flags are written as version 0.1, with the program header understood by older versions
+#define U6A_BC_VER_MINOR_NO_FLAGS 0x01
+
+#define U6A_BC_FLAG_DENSE_TEXT ( 1 << 0 )  /* .text is in the dense variable-length encoding */
+
+// Features never used by a program, as found by u6ac, which the runtime may leave out of the interpreter
+#define U6A_BC_FLAG_NO_CONT    ( 1 << 1 )  /* `c` never occurs in .text, so no continuation is ever captured */
+#define U6A_BC_FLAG_NO_PROMISE ( 1 << 2 )  /* `d` never occurs in .text, so no promise is ever created */
+#define U6A_BC_FLAG_NO_INPUT   ( 1 << 3 )  /* `@`, `?X` and `|` never occur in .text, so no input is ever read */
+
+#define U6A_BC_FLAGS_NO_FEATURE ( U6A_BC_FLAG_NO_CONT | U6A_BC_FLAG_NO_PROMISE | U6A_BC_FLAG_NO_INPUT )
+
+/*
+ * A relocatable module, which leaves the value of its expression in the accumulator instead of applying `e` to it.
+ * Offsets of `sa` and `del` are relative to the start of its .text, and those of `lc` to the start of its .rodata.
+ */
+#define U6A_BC_FLAG_MODULE     ( 1 << 4 )
 
 #endif
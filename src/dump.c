@@ -99,7 +99,7 @@ u6a_hexdump(FILE* restrict output_stream, const char* data, const char* formatte
 }
 
 bool
-u6a_dump_mnemonics(FILE* restrict output_stream, struct u6a_vm_ins* data, uint32_t length) {
+u6a_dump_mnemonics(FILE* restrict output_stream, const struct u6a_vm_ins* data, uint32_t length) {
     fprintf_check(output_stream, "%s\n", ".text");
     for (uint32_t idx = 0; idx < length; ++idx) {
         if (UNLIKELY(!write_mnemonic_ins(output_stream, idx, data[idx]))) {
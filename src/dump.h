@@ -31,7 +31,7 @@
 #define U6A_HEXDUMP_BYTES_PER_LINE 16
 
 bool
-u6a_dump_mnemonics(FILE* restrict output_stream, struct u6a_vm_ins* data, uint32_t length);
+u6a_dump_mnemonics(FILE* restrict output_stream, const struct u6a_vm_ins* data, uint32_t length);
 
 bool
 u6a_dump_data(FILE* restrict output_stream, const char* data, uint32_t length);
@@ -0,0 +1,207 @@
+/*
+ * heap_profile.c - Heap profiler
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "heap_profile.h"
+#include "vm_stack.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#define SITE_LABEL_SIZE 24
+
+struct heap_group {
+    uint64_t key;                    /* allocation site in the upper half, kind in the lower half */
+    uint64_t count;
+    uint64_t size;                   /* total length of captured stacks, for continuations */
+};
+
+static       FILE*    output;
+static const char*    output_name;
+static       uint32_t num_snapshots;
+
+static const char* err_heap_profile = "heap profile error";
+
+static const char*
+site_label(uint32_t site, uint32_t kind, uint32_t prelude_len, char* buffer) {
+    if (kind == 0) {
+        // Allocated before the program was resumed from a snapshot
+        return "unknown";
+    }
+    if (site < prelude_len) {
+        snprintf(buffer, SITE_LABEL_SIZE, "[s:%" PRIu32 "]", site);
+    } else {
+        snprintf(buffer, SITE_LABEL_SIZE, "%08" PRIx32, site - prelude_len);
+    }
+    return buffer;
+}
+
+static const char*
+kind_name(uint32_t kind) {
+    switch (kind) {
+        case u6a_vf_k1:
+            return "`kX";
+        case u6a_vf_s1:
+            return "`sX";
+        case u6a_vf_s2:
+            return "``sXY";
+        case u6a_vf_c1:
+            return "continuation";
+        case u6a_vf_n1:
+            return "`NF";
+        case u6a_vf_m:
+            return "(memo)";
+        case u6a_vf_d1_c:
+            return "`dX";
+        case u6a_vf_d1_s:
+            return "`d`XZ";
+        default:
+            return "unknown";
+    }
+}
+
+static int
+group_cmp_key(const void* lhs, const void* rhs) {
+    const uint64_t lhs_key = ((const struct heap_group*)lhs)->key;
+    const uint64_t rhs_key = ((const struct heap_group*)rhs)->key;
+    return ( lhs_key > rhs_key ) - ( lhs_key < rhs_key );
+}
+
+static int
+group_cmp_count(const void* lhs, const void* rhs) {
+    const uint64_t lhs_count = ((const struct heap_group*)lhs)->count;
+    const uint64_t rhs_count = ((const struct heap_group*)rhs)->count;
+    // Largest first
+    return ( lhs_count < rhs_count ) - ( lhs_count > rhs_count );
+}
+
+static uint32_t
+group_merge(struct heap_group* groups, uint32_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    qsort(groups, len, sizeof(struct heap_group), group_cmp_key);
+    uint32_t merged = 0;
+    for (uint32_t idx = 1; idx < len; ++idx) {
+        if (groups[idx].key == groups[merged].key) {
+            groups[merged].count += groups[idx].count;
+            groups[merged].size += groups[idx].size;
+        } else {
+            groups[++merged] = groups[idx];
+        }
+    }
+    qsort(groups, ++merged, sizeof(struct heap_group), group_cmp_count);
+    return merged;
+}
+
+static uint64_t
+stack_len(struct u6a_vm_stack* vs) {
+    uint64_t len = 0;
+    for (; vs; vs = vs->prev) {
+        len += vs->top + 1;
+    }
+    return len;
+}
+
+bool
+u6a_heap_profile_open(const char* file_name) {
+    output = fopen(file_name, "w");
+    if (UNLIKELY(output == NULL)) {
+        u6a_err_cannot_open_file(err_heap_profile, file_name);
+        return false;
+    }
+    output_name = file_name;
+    return true;
+}
+
+void
+u6a_heap_profile_snapshot(struct u6a_vm_pool_ctx* ctx, uint32_t prelude_len, uint64_t clock, const char* reason) {
+    if (UNLIKELY(output == NULL || ctx->tags == NULL)) {
+        return;
+    }
+    struct u6a_vm_pool* pool = ctx->active_pool;
+    struct heap_group* groups = malloc(ctx->pool_len * sizeof(struct heap_group));
+    if (UNLIKELY(groups == NULL)) {
+        u6a_err_bad_alloc(err_heap_profile, ctx->pool_len * sizeof(struct heap_group));
+        return;
+    }
+    uint32_t num_live = 0, num_conts = 0;
+    for (uint32_t offset = u6a_vm_pool_next_live(ctx, UINT32_MAX); offset != UINT32_MAX;
+         offset = u6a_vm_pool_next_live(ctx, offset))
+    {
+        const struct u6a_vm_pool_tag tag = ctx->tags[offset];
+        groups[num_live++] = (struct heap_group) {
+            .key   = (uint64_t)tag.site << 32 | tag.kind,
+            .count = 1,
+            .size  = 0
+        };
+    }
+    const uint32_t num_elem_groups = group_merge(groups, num_live);
+    char site[SITE_LABEL_SIZE];
+    fprintf(output, "# snapshot %" PRIu32 " (%s) at %" PRIu64 " VM instructions: %" PRIu32 " of %" PRIu32
+        " elements live\n", ++num_snapshots, reason, clock, num_live, ctx->pool_len);
+    fprintf(output, "# %14s  %-12s  %s\n", "elements", "site", "kind");
+    for (uint32_t idx = 0; idx < num_elem_groups; ++idx) {
+        const uint32_t tag_site = groups[idx].key >> 32, tag_kind = (uint32_t)groups[idx].key;
+        fprintf(output, "%16" PRIu64 "  %-12s  %s\n", groups[idx].count,
+            site_label(tag_site, tag_kind, prelude_len, site), kind_name(tag_kind));
+    }
+    for (uint32_t offset = u6a_vm_pool_next_live(ctx, UINT32_MAX); offset != UINT32_MAX;
+         offset = u6a_vm_pool_next_live(ctx, offset))
+    {
+        if (pool->refcnts[offset] & U6A_VM_POOL_ELEM_HOLDS_PTR) {
+            const struct u6a_vm_pool_tag tag = ctx->tags[offset];
+            groups[num_conts++] = (struct heap_group) {
+                .key   = (uint64_t)tag.site << 32 | tag.kind,
+                .count = 1,
+                .size  = stack_len(pool->values[offset].v1.ptr)
+            };
+        }
+    }
+    const uint32_t num_cont_groups = group_merge(groups, num_conts);
+    if (num_cont_groups) {
+        // Segments shared by several continuations are counted for each of them
+        fprintf(output, "# %14s  %16s  %s\n", "continuations", "stack elements", "capture site");
+    }
+    for (uint32_t idx = 0; idx < num_cont_groups; ++idx) {
+        const uint32_t tag_site = groups[idx].key >> 32, tag_kind = (uint32_t)groups[idx].key;
+        fprintf(output, "%16" PRIu64 "  %16" PRIu64 "  %s\n", groups[idx].count, groups[idx].size,
+            site_label(tag_site, tag_kind, prelude_len, site));
+    }
+    fputc('\n', output);
+    fflush(output);
+    free(groups);
+}
+
+bool
+u6a_heap_profile_close() {
+    if (output == NULL) {
+        return true;
+    }
+    bool ok = !ferror(output);
+    if (UNLIKELY(fclose(output) != 0 || !ok)) {
+        u6a_err_write_failed(err_heap_profile, 0, output_name);
+        ok = false;
+    }
+    output = NULL;
+    return ok;
+}
@@ -0,0 +1,47 @@
+/*
+ * heap_profile.h - Heap profiler definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_HEAP_PROFILE_H_
+#define U6A_HEAP_PROFILE_H_
+
+#include "common.h"
+#include "vm_pool.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define U6A_HEAP_PROFILE_MIN_INTERVAL 0
+#define U6A_HEAP_PROFILE_MAX_INTERVAL UINT32_MAX
+
+bool
+u6a_heap_profile_open(const char* file_name);
+
+/*
+ * Write the live elements of the object pool, grouped by allocation site and kind, and the continuations among
+ * them, grouped by capture site. The clock is the number of VM instructions executed so far.
+ */
+void
+u6a_heap_profile_snapshot(struct u6a_vm_pool_ctx* ctx, uint32_t prelude_len, uint64_t clock, const char* reason);
+
+bool
+u6a_heap_profile_close();
+
+#endif
@@ -21,6 +21,7 @@
 
 #include "lexer.h"
 #include "logging.h"
+#include "time_report.h"
 
 #include <stdlib.h>
 #include <stddef.h>
@@ -51,6 +52,7 @@ u6a_lex(FILE* restrict input_stream, struct u6a_token** token_arr, uint32_t* tok
         u6a_err_bad_alloc(err_lex, token_arr_size * sizeof(struct u6a_token));
         return false;
     }
+    u6a_time_report_alloc(u6a_tp_lex, token_arr_size * sizeof(struct u6a_token));
     int fn, ch;
     uint32_t len = 0;
     while (true) {
@@ -78,6 +80,7 @@ u6a_lex(FILE* restrict input_stream, struct u6a_token** token_arr, uint32_t* tok
                 goto lex_failed;
             }
             tokens = new_tokens;
+            u6a_time_report_alloc(u6a_tp_lex, token_arr_size / 2 * sizeof(struct u6a_token));
         }
         switch (fn) {
             case '`':
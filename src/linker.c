@@ -0,0 +1,204 @@
+/*
+ * linker.c - Bytecode linker
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "linker.h"
+#include "bytecode.h"
+#include "logging.h"
+#include "time_report.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+struct link_buffer {
+    struct u6a_vm_ins* text;
+    char*              rodata;
+    uint32_t           text_len;
+    uint32_t           rodata_len;
+    uint32_t           text_cap;
+    uint32_t           rodata_cap;
+};
+
+static const char* err_link = "link error";
+static const char* info_link = "link";
+
+static bool
+buffer_reserve(void** buffer, uint32_t* cap, uint32_t len, uint32_t extra, size_t elem_size) {
+    if (LIKELY(len + (uint64_t)extra <= *cap)) {
+        return true;
+    }
+    uint64_t new_cap = *cap ? *cap : 1024;
+    while (new_cap < len + (uint64_t)extra) {
+        new_cap *= 2;
+    }
+    if (UNLIKELY(new_cap > UINT32_MAX / elem_size)) {
+        u6a_err_bad_alloc(err_link, new_cap * elem_size);
+        return false;
+    }
+    void* new_buffer = realloc(*buffer, new_cap * elem_size);
+    if (UNLIKELY(new_buffer == NULL)) {
+        u6a_err_bad_alloc(err_link, new_cap * elem_size);
+        return false;
+    }
+    u6a_time_report_alloc(u6a_tp_codegen, (new_cap - *cap) * elem_size);
+    *buffer = new_buffer;
+    *cap = new_cap;
+    return true;
+}
+
+static bool
+read_text(FILE* restrict input_stream, uint32_t text_size, bool dense, struct u6a_vm_ins* text, uint32_t* text_len) {
+    if (dense) {
+        uint8_t* dense_buffer = malloc(text_size);
+        if (UNLIKELY(dense_buffer == NULL)) {
+            u6a_err_bad_alloc(err_link, text_size);
+            return false;
+        }
+        *text_len = UINT32_MAX;
+        if (LIKELY(text_size == fread(dense_buffer, sizeof(uint8_t), text_size, input_stream))) {
+            *text_len = u6a_bc_dense_decode(dense_buffer, text_size, text);
+        }
+        free(dense_buffer);
+        return *text_len != UINT32_MAX;
+    }
+    *text_len = text_size / sizeof(struct u6a_vm_ins);
+    if (UNLIKELY(*text_len != fread(text, sizeof(struct u6a_vm_ins), *text_len, input_stream))) {
+        return false;
+    }
+    for (struct u6a_vm_ins* ins = text; ins < text + *text_len; ++ins) {
+        if (ins->opcode & U6A_VM_OP_OFFSET) {
+            ins->operand.offset = ntohl(ins->operand.offset);
+        }
+    }
+    return true;
+}
+
+// Append a module to the buffer, with offsets relocated, and left in host byte order
+static bool
+link_module(struct link_buffer* buffer, const char* file_name) {
+    FILE* input_stream = fopen(file_name, "rb");
+    if (UNLIKELY(input_stream == NULL)) {
+        u6a_err_cannot_open_file(err_link, file_name);
+        return false;
+    }
+    struct u6a_bc_header header;
+    if (UNLIKELY(!u6a_bc_read_header(&header, input_stream))) {
+        goto invalid_file;
+    }
+    if (UNLIKELY(!U6A_BC_CHECK_VER(header.file))) {
+        u6a_err_bad_bc_ver(err_link, file_name, header.file.ver_major, header.file.ver_minor);
+        goto link_failed;
+    }
+    const uint32_t text_size = ntohl(header.prog.text_size);
+    const uint32_t rodata_len = ntohl(header.prog.rodata_size) / sizeof(char);
+    const uint32_t flags = ntohl(header.prog.flags);
+    if (UNLIKELY(!( flags & U6A_BC_FLAG_MODULE ))) {
+        u6a_err_not_module(err_link, file_name);
+        goto link_failed;
+    }
+    // Every densely encoded instruction takes at least one byte. Room is left for the `sa` and `la` around it.
+    const bool dense = flags & U6A_BC_FLAG_DENSE_TEXT;
+    const uint32_t max_text_len = dense ? text_size : text_size / sizeof(struct u6a_vm_ins);
+    if (UNLIKELY(!buffer_reserve((void**)&buffer->text, &buffer->text_cap, buffer->text_len, max_text_len + 3,
+                                 sizeof(struct u6a_vm_ins))
+                 || !buffer_reserve((void**)&buffer->rodata, &buffer->rodata_cap, buffer->rodata_len, rodata_len,
+                                    sizeof(char))))
+    {
+        goto link_failed;
+    }
+    // Apply what comes before to this module
+    const bool apply = buffer->text_len != 0;
+    const uint32_t sa_offset = buffer->text_len;
+    if (apply) {
+        buffer->text[buffer->text_len++].opcode = u6a_vo_sa;
+    }
+    struct u6a_vm_ins* text = buffer->text + buffer->text_len;
+    uint32_t text_len;
+    if (UNLIKELY(!read_text(input_stream, text_size, dense, text, &text_len))) {
+        goto invalid_file;
+    }
+    if (UNLIKELY(rodata_len != fread(buffer->rodata + buffer->rodata_len, sizeof(char), rodata_len, input_stream))) {
+        goto invalid_file;
+    }
+    for (struct u6a_vm_ins* ins = text; ins < text + text_len; ++ins) {
+        if (ins->opcode == u6a_vo_sa || ins->opcode == u6a_vo_del) {
+            if (UNLIKELY(ins->operand.offset > text_len)) {
+                goto invalid_file;
+            }
+            ins->operand.offset += buffer->text_len;
+        } else if (ins->opcode == u6a_vo_lc) {
+            if (UNLIKELY(ins->operand.offset >= rodata_len)) {
+                goto invalid_file;
+            }
+            ins->operand.offset += buffer->rodata_len;
+        }
+    }
+    buffer->text_len += text_len;
+    buffer->rodata_len += rodata_len;
+    if (apply) {
+        buffer->text[buffer->text_len++].opcode = u6a_vo_la;
+        buffer->text[sa_offset].operand.offset = buffer->text_len;
+    }
+    fclose(input_stream);
+    u6a_info_verbose(info_link, "module %s linked, text: %" PRIu32 ", rodata: %" PRIu32, file_name, text_len,
+        rodata_len);
+    return true;
+
+    invalid_file:
+    u6a_err_invalid_bc_file(err_link, file_name);
+    link_failed:
+    fclose(input_stream);
+    return false;
+}
+
+bool
+u6a_link(const struct u6a_codegen_options* options, char* const* file_names, uint32_t num_files) {
+    struct link_buffer buffer = { 0 };
+    bool linked = false;
+    for (uint32_t idx = 0; idx < num_files; ++idx) {
+        if (UNLIKELY(!link_module(&buffer, file_names[idx]))) {
+            goto terminate;
+        }
+    }
+    if (!options->module) {
+        // The program exits with the value of the linked modules, as is done by u6a_codegen()
+        buffer.text[buffer.text_len++] = (struct u6a_vm_ins) {
+            .opcode = u6a_vo_app,
+            .operand.fn.first.fn = u6a_vf_e
+        };
+    }
+    for (struct u6a_vm_ins* ins = buffer.text; ins < buffer.text + buffer.text_len; ++ins) {
+        if (ins->opcode & U6A_VM_OP_OFFSET) {
+            ins->operand.offset = htonl(ins->operand.offset);
+        }
+    }
+    linked = u6a_codegen_emit(options, buffer.text, buffer.text_len, buffer.rodata, buffer.rodata_len);
+    if (linked) {
+        u6a_info_verbose(info_link, "completed, %" PRIu32 " modules, text: %" PRIu32 ", rodata: %" PRIu32,
+            num_files, buffer.text_len, buffer.rodata_len);
+    }
+
+    terminate:
+    free(buffer.text);
+    free(buffer.rodata);
+    return linked;
+}
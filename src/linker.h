@@ -0,0 +1,39 @@
+/*
+ * linker.h - Bytecode linker definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_LINKER_H_
+#define U6A_LINKER_H_
+
+#include "common.h"
+#include "codegen.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Link modules compiled with the `module` option into a program, which applies the value of the first module to
+ * that of the second, the result to that of the third, and so on, as if their source code were concatenated after
+ * one "`" per module but the first. Writes a module instead of a program if `options->module` is set.
+ */
+bool
+u6a_link(const struct u6a_codegen_options* options, char* const* file_names, uint32_t num_files);
+
+#endif
@@ -25,13 +25,20 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <errno.h>
+#include <string.h>
 
 #define E_UNEXPECTED_EOF_AFTER "%s: [%s] unexpected end of file after "
 #define E_UNRECOGNIZABLE_CHAR  "%s: [%s] unrecognizable character "
 
+#define ERR_PRINT(...)         ( quiet ? 0 : fprintf(stderr, __VA_ARGS__) )
+
 const char* prog_name;
 bool verbose = false;
 
+// Errors of threads which retry elsewhere what they fail to do are not reported
+static U6A_THREAD_LOCAL bool quiet;
+
 void
 u6a_logging_init(const char* prog_name_) {
     prog_name = prog_name_;
@@ -42,112 +49,155 @@ u6a_logging_verbose(bool verbose_) {
     verbose = verbose_;
 }
 
+void
+u6a_logging_quiet(bool quiet_) {
+    quiet = quiet_;
+}
+
 U6A_COLD void
 u6a_err_bad_alloc(const char* stage, size_t size) {
-    fprintf(stderr, "%s: [%s] allocation failed - trying to allocate %zu bytes.\n", prog_name, stage, size);
+    ERR_PRINT("%s: [%s] allocation failed - trying to allocate %zu bytes.\n", prog_name, stage, size);
 }
 
 U6A_COLD void
 u6a_err_unexpected_eof(const char* stage, int after) {
-    fprintf(stderr, E_UNEXPECTED_EOF_AFTER "'%c'.\n", prog_name, stage, (char)after);
+    ERR_PRINT(E_UNEXPECTED_EOF_AFTER "'%c'.\n", prog_name, stage, (char)after);
 }
 
 U6A_COLD void
 u6a_err_unprintable_ch(const char* stage, int got) {
-    fprintf(stderr, "%s: [%s] printable character or '\\n' expected, 0x%02x given.\n", prog_name, stage, got);
+    ERR_PRINT("%s: [%s] printable character or '\\n' expected, 0x%02x given.\n", prog_name, stage, got);
 }
 
 U6A_COLD void
 u6a_err_bad_ch(const char* stage, int got) {
     if (isprint(got)) {
-        fprintf(stderr, E_UNRECOGNIZABLE_CHAR "'%c'.\n", prog_name, stage, (char)got);
+        ERR_PRINT(E_UNRECOGNIZABLE_CHAR "'%c'.\n", prog_name, stage, (char)got);
     } else if (LIKELY(got == '\n')) {
-        fprintf(stderr, E_UNRECOGNIZABLE_CHAR "'\\n'.\n", prog_name, stage);
+        ERR_PRINT(E_UNRECOGNIZABLE_CHAR "'\\n'.\n", prog_name, stage);
     } else {
-        fprintf(stderr, E_UNRECOGNIZABLE_CHAR "0x%02x.\n", prog_name, stage, got);
+        ERR_PRINT(E_UNRECOGNIZABLE_CHAR "0x%02x.\n", prog_name, stage, got);
     }
 }
 
 U6A_COLD void
 u6a_err_bad_syntax(const char* stage) {
-    fprintf(stderr, "%s: [%s] bad syntax.\n", prog_name, stage);
+    ERR_PRINT("%s: [%s] bad syntax.\n", prog_name, stage);
 }
 
 U6A_COLD void
 u6a_err_write_failed(const char* stage, size_t bytes, const char* filename) {
     if (bytes > 0) {
-        fprintf(stderr, "%s: [%s] failed writing %zu bytes to %s.\n", prog_name, stage, bytes, filename);
+        ERR_PRINT("%s: [%s] failed writing %zu bytes to %s.\n", prog_name, stage, bytes, filename);
     } else {
-        fprintf(stderr, "%s: [%s] failed writing data to %s.\n", prog_name, stage, filename);
+        ERR_PRINT("%s: [%s] failed writing data to %s.\n", prog_name, stage, filename);
     }
 }
 
 U6A_COLD void
 u6a_err_path_too_long(const char* stage, size_t maximum, size_t given) {
-    fprintf(stderr, "%s: [%s] file path too long. A maximum of %zu expected, %zu given.\n",
+    ERR_PRINT("%s: [%s] file path too long. A maximum of %zu expected, %zu given.\n",
         prog_name, stage, maximum, given);
 }
 
 U6A_COLD void
 u6a_err_no_input_file(const char* stage) {
-    fprintf(stderr, "%s: [%s] no input file specified.\n", prog_name, stage);
+    ERR_PRINT("%s: [%s] no input file specified.\n", prog_name, stage);
 }
 
 U6A_COLD void
 u6a_err_custom(const char* stage, const char* err_message) {
-    fprintf(stderr, "%s: [%s] %s.\n", prog_name, stage, err_message);
+    ERR_PRINT("%s: [%s] %s.\n", prog_name, stage, err_message);
 }
 
 U6A_COLD void
 u6a_err_cannot_open_file(const char* stage, const char* filename) {
-    fprintf(stderr, "%s: [%s] failed to open file %s.\n", prog_name, stage, filename);
+    ERR_PRINT("%s: [%s] failed to open file %s.\n", prog_name, stage, filename);
 }
 
 U6A_COLD void
 u6a_err_stack_underflow(const char* stage) {
-    fprintf(stderr, "%s: [%s] stack underflow.\n", prog_name, stage);
+    ERR_PRINT("%s: [%s] stack underflow.\n", prog_name, stage);
+}
+
+U6A_COLD void
+u6a_err_stack_overflow(const char* stage) {
+    ERR_PRINT("%s: [%s] stack overflow.\n", prog_name, stage);
 }
 
 U6A_COLD void
 u6a_err_invalid_uint(const char* stage, const char* str) {
-    fprintf(stderr, "%s: [%s] \"%s\" is not a valid unsigned integer.\n", prog_name, stage, str);
+    ERR_PRINT("%s: [%s] \"%s\" is not a valid unsigned integer.\n", prog_name, stage, str);
 }
 
 U6A_COLD void
 u6a_err_uint_not_in_range(const char* stage, uint32_t min_val, uint32_t max_val, uint32_t got) {
-    fprintf(stderr, "%s: [%s] Integer out of range - [%" PRIu32 ", %" PRIu32 "] expected, %" PRIu32 " given.\n",
+    ERR_PRINT("%s: [%s] Integer out of range - [%" PRIu32 ", %" PRIu32 "] expected, %" PRIu32 " given.\n",
         prog_name, stage, min_val, max_val, got);
 }
 
 U6A_COLD void
 u6a_err_invalid_bc_file(const char* stage, const char* filename) {
-    fprintf(stderr, "%s: [%s] %s is not a valid Unlambda bytecode file.\n", prog_name, stage, filename);
+    ERR_PRINT("%s: [%s] %s is not a valid Unlambda bytecode file.\n", prog_name, stage, filename);
 }
 
 U6A_COLD void
 u6a_err_bad_bc_ver(const char* stage, const char* filename, int ver_major, int ver_minor) {
-    fprintf(stderr, "%s: [%s] bytecode file %s version %d.%d is not compatible.\n",
+    ERR_PRINT("%s: [%s] bytecode file %s version %d.%d is not compatible.\n",
         prog_name, stage, filename, ver_major, ver_minor);
 }
 
+U6A_COLD void
+u6a_err_module_not_linked(const char* stage, const char* filename) {
+    ERR_PRINT("%s: [%s] %s is a module, which should be linked with \"u6ac --link\" first.\n",
+        prog_name, stage, filename);
+}
+
+U6A_COLD void
+u6a_err_not_module(const char* stage, const char* filename) {
+    ERR_PRINT("%s: [%s] %s is not a module, which should be compiled with \"u6ac --module\".\n",
+        prog_name, stage, filename);
+}
+
+U6A_COLD void
+u6a_err_invalid_snapshot(const char* stage, const char* filename) {
+    ERR_PRINT("%s: [%s] %s is not a valid snapshot for this build of u6a.\n", prog_name, stage, filename);
+}
+
+U6A_COLD void
+u6a_err_bad_bytecode(const char* stage, uint32_t offset, const char* reason) {
+    ERR_PRINT("%s: [%s] bytecode rejected at instruction 0x%08" PRIx32 " - %s.\n", prog_name, stage, offset,
+        reason);
+}
+
 U6A_COLD void
 u6a_err_vm_pool_oom(const char* stage) {
-    fprintf(stderr, "%s: [%s] VM object pool memory exhausted.\n", prog_name, stage);
+    ERR_PRINT("%s: [%s] VM object pool memory exhausted.\n", prog_name, stage);
+}
+
+U6A_COLD void
+u6a_err_syscall_failed(const char* stage, const char* func_name) {
+    ERR_PRINT("%s: [%s] %s() failed - %s.\n", prog_name, stage, func_name, strerror(errno));
+}
+
+U6A_COLD void
+u6a_err_invalid_address(const char* stage, const char* address) {
+    ERR_PRINT("%s: [%s] cannot listen on %s.\n", prog_name, stage, address);
 }
 
 U6A_COLD void
 u6a_err_invalid_opcode(const char* stage, int opcode) {
-    fprintf(stderr, "%s: [%s] invalid opcode %d.\n", prog_name, stage, opcode);
+    ERR_PRINT("%s: [%s] invalid opcode %d.\n", prog_name, stage, opcode);
 }
 
 U6A_COLD void
 u6a_err_invalid_ex_opcode(const char* stage, int ex_opcode) {
-    fprintf(stderr, "%s: [%s] invalid extended opcode %d.\n", prog_name, stage, ex_opcode);
+    ERR_PRINT("%s: [%s] invalid extended opcode %d.\n", prog_name, stage, ex_opcode);
 }
 
 U6A_COLD void
 u6a_err_invalid_vm_func(const char* stage, int fn) {
-    fprintf(stderr, "%s: [%s] invalid function %d.\n", prog_name, stage, fn);
+    ERR_PRINT("%s: [%s] invalid function %d.\n", prog_name, stage, fn);
 }
 
 U6A_COLD void
@@ -34,6 +34,10 @@ u6a_logging_init(const char* prog_name);
 void
 u6a_logging_verbose(bool verbose);
 
+// Silence error messages of the calling thread
+void
+u6a_logging_quiet(bool quiet);
+
 void
 u6a_err_bad_alloc(const char* stage, size_t size);
 
@@ -67,6 +71,9 @@ u6a_err_cannot_open_file(const char* stage, const char* filename);
 void
 u6a_err_stack_underflow(const char* stage);
 
+void
+u6a_err_stack_overflow(const char* stage);
+
 void
 u6a_err_invalid_uint(const char* stage, const char* str);
 
@@ -79,9 +86,27 @@ u6a_err_invalid_bc_file(const char* stage, const char* filename);
 void
 u6a_err_bad_bc_ver(const char* stage, const char* filename, int ver_major, int ver_minor);
 
+void
+u6a_err_module_not_linked(const char* stage, const char* filename);
+
+void
+u6a_err_not_module(const char* stage, const char* filename);
+
+void
+u6a_err_invalid_snapshot(const char* stage, const char* filename);
+
+void
+u6a_err_bad_bytecode(const char* stage, uint32_t offset, const char* reason);
+
 void
 u6a_err_vm_pool_oom(const char* stage);
 
+void
+u6a_err_syscall_failed(const char* stage, const char* func_name);
+
+void
+u6a_err_invalid_address(const char* stage, const char* address);
+
 void
 u6a_err_invalid_opcode(const char* stage, int opcode);
 
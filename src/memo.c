@@ -0,0 +1,153 @@
+/*
+ * memo.c - Memo table of pure applications
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "memo.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#define MEMO_REPORT(format, ...) \
+    fprintf(stderr, "%s: [%s] " format ".\n", u6a_logging_get_prog_name_(), info_memo, __VA_ARGS__)
+
+static const char* info_memo = "memo";
+
+static inline void
+memo_release(struct u6a_memo_ctx* ctx, struct u6a_vm_var_fn var) {
+    if (var.token.fn & U6A_VM_FN_REF) {
+        u6a_vm_pool_free(ctx->pool_ctx, var.ref);
+    }
+}
+
+static inline struct u6a_vm_var_fn
+memo_retain(struct u6a_memo_ctx* ctx, struct u6a_vm_var_fn var) {
+    if (var.token.fn & U6A_VM_FN_REF) {
+        u6a_vm_pool_addref(ctx->pool_ctx->active_pool, var.ref);
+    }
+    return var;
+}
+
+static inline void
+memo_forward_entry(struct u6a_memo_ctx* ctx, struct u6a_memo_entry* entry) {
+    entry->func = u6a_vm_pool_forward(ctx->pool_ctx, entry->func);
+    entry->arg = u6a_vm_pool_forward(ctx->pool_ctx, entry->arg);
+    entry->result = u6a_vm_pool_forward(ctx->pool_ctx, entry->result);
+}
+
+bool
+u6a_memo_init(struct u6a_memo_ctx* ctx, uint32_t size, struct u6a_vm_pool_ctx* pool_ctx, const char* err_stage) {
+    uint32_t num_sets = 1;
+    while (num_sets * U6A_MEMO_WAYS < size) {
+        num_sets *= 2;
+    }
+    const size_t entries_size = (size_t)num_sets * U6A_MEMO_WAYS * sizeof(struct u6a_memo_entry);
+    ctx->entries = calloc(1, entries_size);
+    if (UNLIKELY(ctx->entries == NULL)) {
+        u6a_err_bad_alloc(err_stage, entries_size);
+        return false;
+    }
+    ctx->mru = calloc(num_sets, sizeof(uint8_t));
+    if (UNLIKELY(ctx->mru == NULL)) {
+        u6a_err_bad_alloc(err_stage, num_sets * sizeof(uint8_t));
+        free(ctx->entries);
+        ctx->entries = NULL;
+        return false;
+    }
+    ctx->set_mask = num_sets - 1;
+    ctx->log_len = 0;
+    ctx->lookups = ctx->hits = ctx->evictions = 0;
+    ctx->pool_ctx = pool_ctx;
+    return true;
+}
+
+void
+u6a_memo_insert(struct u6a_memo_ctx* ctx, struct u6a_vm_var_fn func, struct u6a_vm_var_fn arg,
+                struct u6a_vm_var_fn result)
+{
+    uint32_t set;
+    struct u6a_memo_entry* entries = u6a_memo_set_(ctx, func, arg, &set);
+    // The same application may have been made again before its first result was recorded
+    uint32_t way = 0;
+    while (way < U6A_MEMO_WAYS && !( u6a_memo_key_(entries[way].func) == u6a_memo_key_(func)
+                                     && u6a_memo_key_(entries[way].arg) == u6a_memo_key_(arg) )) {
+        ++way;
+    }
+    // Otherwise, take a vacant way if any, or the one not used most recently
+    if (way == U6A_MEMO_WAYS) {
+        way = 0;
+        while (way < U6A_MEMO_WAYS && !U6A_VM_VAR_FN_IS_EMPTY(entries[way].func)) {
+            ++way;
+        }
+        if (way == U6A_MEMO_WAYS) {
+            way = !ctx->mru[set];
+            ++ctx->evictions;
+        }
+    }
+    const struct u6a_memo_entry victim = entries[way];
+    entries[way] = (struct u6a_memo_entry) {
+        .func   = memo_retain(ctx, func),
+        .arg    = memo_retain(ctx, arg),
+        .result = memo_retain(ctx, result)
+    };
+    memo_release(ctx, victim.func);
+    memo_release(ctx, victim.arg);
+    memo_release(ctx, victim.result);
+    ctx->mru[set] = way;
+    if (ctx->log_len < U6A_MEMO_LOG_LEN) {
+        ctx->log[ctx->log_len] = set * U6A_MEMO_WAYS + way;
+    }
+    if (ctx->log_len <= U6A_MEMO_LOG_LEN) {
+        ++ctx->log_len;
+    }
+}
+
+void
+u6a_memo_forward(struct u6a_memo_ctx* ctx) {
+    if (ctx->log_len > U6A_MEMO_LOG_LEN) {
+        const uint32_t num_entries = ( ctx->set_mask + 1 ) * U6A_MEMO_WAYS;
+        for (uint32_t idx = 0; idx < num_entries; ++idx) {
+            memo_forward_entry(ctx, ctx->entries + idx);
+        }
+    } else {
+        // Forwarding is idempotent, so entries logged more than once do no harm
+        for (uint32_t idx = 0; idx < ctx->log_len; ++idx) {
+            memo_forward_entry(ctx, ctx->entries + ctx->log[idx]);
+        }
+    }
+    ctx->log_len = 0;
+}
+
+void
+u6a_memo_report(struct u6a_memo_ctx* ctx) {
+    const double hit_rate = ctx->lookups ? 100.0 * ctx->hits / ctx->lookups : 0;
+    MEMO_REPORT("%-9s: %" PRIu64, "lookups", ctx->lookups);
+    MEMO_REPORT("%-9s: %" PRIu64 " (%.2f%%)", "hits", ctx->hits, hit_rate);
+    MEMO_REPORT("%-9s: %" PRIu64, "evictions", ctx->evictions);
+}
+
+void
+u6a_memo_destroy(struct u6a_memo_ctx* ctx) {
+    free(ctx->entries);
+    free(ctx->mru);
+    ctx->entries = NULL;
+    ctx->mru = NULL;
+}
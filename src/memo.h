@@ -0,0 +1,117 @@
+/*
+ * memo.h - Memo table of pure applications definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_MEMO_H_
+#define U6A_MEMO_H_
+
+#include "common.h"
+#include "vm_defs.h"
+#include "vm_pool.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define U6A_MEMO_MIN_SIZE 0
+#define U6A_MEMO_MAX_SIZE ( 16 * 1024 * 1024 )
+
+// Entries are grouped in sets of two, the least recently used of which is evicted to make room
+#define U6A_MEMO_WAYS     2
+
+// Entries inserted since the nursery was last evacuated, which are the only ones that may refer to it
+#define U6A_MEMO_LOG_LEN  4096
+
+struct u6a_memo_entry {
+    struct u6a_vm_var_fn func;       /* empty if the entry is vacant */
+    struct u6a_vm_var_fn arg;
+    struct u6a_vm_var_fn result;
+};
+
+struct u6a_memo_ctx {
+    struct u6a_memo_entry*  entries;
+    uint8_t*                mru;     /* most recently used way of each set */
+    uint32_t                set_mask;
+    uint32_t                log[U6A_MEMO_LOG_LEN];
+    uint32_t                log_len; /* U6A_MEMO_LOG_LEN + 1 once overflown */
+    uint64_t                lookups;
+    uint64_t                hits;
+    uint64_t                evictions;
+    struct u6a_vm_pool_ctx* pool_ctx;
+};
+
+static inline uint64_t
+u6a_memo_key_(struct u6a_vm_var_fn var) {
+    uint64_t key;
+    memcpy(&key, &var, sizeof(uint64_t));
+    return key;
+}
+
+static inline struct u6a_memo_entry*
+u6a_memo_set_(struct u6a_memo_ctx* ctx, struct u6a_vm_var_fn func, struct u6a_vm_var_fn arg, uint32_t* set) {
+    const uint64_t hash = ( u6a_memo_key_(func) * UINT64_C(0x9e3779b97f4a7c15) ^ u6a_memo_key_(arg) )
+                        * UINT64_C(0xff51afd7ed558ccd);
+    *set = ( hash >> 32 ) & ctx->set_mask;
+    return ctx->entries + (size_t)*set * U6A_MEMO_WAYS;
+}
+
+/*
+ * Initialize a memo table of at least `size` entries for applications whose operands live in the given pool.
+ * Entries are keyed on the identity of operands, which hold a reference to their pool elements, so that
+ * the elements cannot be reused while the entries exist.
+ */
+bool
+u6a_memo_init(struct u6a_memo_ctx* ctx, uint32_t size, struct u6a_vm_pool_ctx* pool_ctx, const char* err_stage);
+
+// Find the result of applying `func` to `arg`, which are both pure, returns false if not known
+static inline bool
+u6a_memo_lookup(struct u6a_memo_ctx* ctx, struct u6a_vm_var_fn func, struct u6a_vm_var_fn arg,
+                struct u6a_vm_var_fn* result)
+{
+    uint32_t set;
+    struct u6a_memo_entry* entries = u6a_memo_set_(ctx, func, arg, &set);
+    ++ctx->lookups;
+    for (uint32_t way = 0; way < U6A_MEMO_WAYS; ++way) {
+        struct u6a_memo_entry* entry = entries + way;
+        if (u6a_memo_key_(entry->func) == u6a_memo_key_(func) && u6a_memo_key_(entry->arg) == u6a_memo_key_(arg)) {
+            ctx->mru[set] = way;
+            ++ctx->hits;
+            *result = entry->result;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+u6a_memo_insert(struct u6a_memo_ctx* ctx, struct u6a_vm_var_fn func, struct u6a_vm_var_fn arg,
+                struct u6a_vm_var_fn result);
+
+// Update the references held by the table, after the nursery of the pool is evacuated
+void
+u6a_memo_forward(struct u6a_memo_ctx* ctx);
+
+void
+u6a_memo_report(struct u6a_memo_ctx* ctx);
+
+void
+u6a_memo_destroy(struct u6a_memo_ctx* ctx);
+
+#endif
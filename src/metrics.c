@@ -0,0 +1,245 @@
+/*
+ * metrics.c - Live metrics in the Prometheus text format
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "metrics.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_SIGACTION
+#include <signal.h>
+#endif
+#ifdef HAVE_SETITIMER
+#include <sys/time.h>
+#endif
+
+#define SNAPSHOT_MAX_SIZE 4096
+
+#define METRIC(buffer, len, name, type, help, format, value)                                         \
+    len += snprintf(buffer + len, SNAPSHOT_MAX_SIZE - len,                                           \
+        "# HELP " name " " help "\n# TYPE " name " " type "\n" name " %" format "\n", value)
+
+static const char* file_name;
+static       char  temp_name[PATH_MAX];
+static       int   output_fd = -1;
+static       bool  seekable;
+static       bool  failing;
+static  uint64_t   start_ns;
+static  uint64_t   interval_ns;
+static  uint64_t   next_ns;
+
+static const char* err_metrics = "metrics error";
+
+#ifdef HAVE_SIGACTION
+static volatile sig_atomic_t requested;
+static volatile bool*        wakeup;
+static struct sigaction      prev_usr1_action;
+#ifdef HAVE_SETITIMER
+static struct sigaction      prev_alrm_action;
+#endif
+
+static void
+on_signal(int signo) {
+    (void)signo;
+    requested = 1;
+    *wakeup = true;
+}
+#endif
+
+static inline uint64_t
+clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+write_all(int fd, const char* buffer, size_t len) {
+    while (len) {
+        const ssize_t written = write(fd, buffer, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer += written;
+        len -= written;
+    }
+    return true;
+}
+
+// Replace the whole file, so that readers never see a partial snapshot
+static bool
+write_file(const char* buffer, size_t len) {
+    const int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (UNLIKELY(fd < 0)) {
+        return false;
+    }
+    const bool written = write_all(fd, buffer, len);
+    if (UNLIKELY(close(fd) != 0 || !written)) {
+        unlink(temp_name);
+        return false;
+    }
+    return rename(temp_name, file_name) == 0;
+}
+
+// Regular files are overwritten in place, while pipes and sockets receive one snapshot after another
+static bool
+write_fd(const char* buffer, size_t len) {
+    if (seekable) {
+        return lseek(output_fd, 0, SEEK_SET) == 0 && write_all(output_fd, buffer, len)
+            && ftruncate(output_fd, len) == 0;
+    }
+    return write_all(output_fd, buffer, len);
+}
+
+bool
+u6a_metrics_open(const char* file_name_, int fd, uint32_t interval, volatile bool* wakeup_) {
+    if (file_name_) {
+        const size_t name_len = strlen(file_name_);
+        if (UNLIKELY(name_len + sizeof(".tmp") > PATH_MAX)) {
+            u6a_err_path_too_long(err_metrics, PATH_MAX - sizeof(".tmp"), name_len);
+            return false;
+        }
+        memcpy(temp_name, file_name_, name_len);
+        strcpy(temp_name + name_len, ".tmp");
+        file_name = file_name_;
+    } else {
+        if (UNLIKELY(fcntl(fd, F_GETFD) < 0)) {
+            u6a_err_custom(err_metrics, "metrics file descriptor is not open");
+            return false;
+        }
+        output_fd = fd;
+        seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    }
+    start_ns = clock_ns();
+    interval_ns = (uint64_t)interval * 1000000000;
+    next_ns = start_ns + interval_ns;
+#ifdef HAVE_SIGACTION
+    wakeup = wakeup_;
+    struct sigaction action = {
+        .sa_handler = on_signal,
+        .sa_flags   = SA_RESTART
+    };
+    sigemptyset(&action.sa_mask);
+    if (UNLIKELY(sigaction(SIGUSR1, &action, &prev_usr1_action))) {
+        u6a_err_syscall_failed(err_metrics, "sigaction");
+        return false;
+    }
+#ifdef HAVE_SETITIMER
+    // Without the timer, the clock is still checked whenever the VM reaches a safe point for its own reasons
+    const struct itimerval timer = {
+        .it_interval = { .tv_sec = interval },
+        .it_value    = { .tv_sec = interval }
+    };
+    if (UNLIKELY(sigaction(SIGALRM, &action, &prev_alrm_action))) {
+        u6a_err_syscall_failed(err_metrics, "sigaction");
+        return false;
+    }
+    if (UNLIKELY(setitimer(ITIMER_REAL, &timer, NULL))) {
+        u6a_err_syscall_failed(err_metrics, "setitimer");
+        return false;
+    }
+#endif
+#else
+    (void)wakeup_;
+#endif
+    return true;
+}
+
+bool
+u6a_metrics_due() {
+#ifdef HAVE_SIGACTION
+    if (requested) {
+        requested = 0;
+        return true;
+    }
+#ifdef HAVE_SETITIMER
+    // Snapshots are only due when the timer says so
+    return false;
+#endif
+#endif
+    const uint64_t now = clock_ns();
+    if (now < next_ns) {
+        return false;
+    }
+    next_ns = now + interval_ns;
+    return true;
+}
+
+void
+u6a_metrics_write(const struct u6a_metrics* metrics) {
+    char buffer[SNAPSHOT_MAX_SIZE];
+    int len = 0;
+    METRIC(buffer, len, "u6a_uptime_seconds", "gauge", "Seconds since the program started.", ".3f",
+        ( clock_ns() - start_ns ) / 1e9);
+    if (metrics->ins_counted) {
+        METRIC(buffer, len, "u6a_instructions_total", "counter", "VM instructions executed.", PRIu64,
+            metrics->ins_count);
+    }
+    METRIC(buffer, len, "u6a_pool_allocations_total", "counter", "Elements allocated from the object pool.", PRIu64,
+        metrics->allocs);
+    METRIC(buffer, len, "u6a_pool_frees_total", "counter", "Elements of the object pool freed.", PRIu64,
+        metrics->frees);
+    METRIC(buffer, len, "u6a_pool_live_elements", "gauge", "Live elements of the object pool.", PRIu32,
+        metrics->live_elems);
+    METRIC(buffer, len, "u6a_pool_elements", "gauge", "Size of the object pool in elements.", PRIu32,
+        metrics->pool_len);
+    METRIC(buffer, len, "u6a_stack_segments", "gauge", "Stack segments in use.", PRIu32, metrics->stack_segments);
+    METRIC(buffer, len, "u6a_continuations", "gauge", "Live continuations.", PRIu32, metrics->conts);
+    METRIC(buffer, len, "u6a_output_bytes_total", "counter", "Bytes written by the program.", PRIu64,
+        metrics->bytes_written);
+    METRIC(buffer, len, "u6a_input_bytes_total", "counter", "Bytes read by the program.", PRIu64,
+        metrics->bytes_read);
+    const bool written = file_name ? write_file(buffer, len) : write_fd(buffer, len);
+    if (UNLIKELY(!written)) {
+        // Reported once until a snapshot is written again, as the program goes on anyway
+        if (!failing) {
+            u6a_err_write_failed(err_metrics, len, file_name ? file_name : "metrics file descriptor");
+        }
+    }
+    failing = !written;
+}
+
+void
+u6a_metrics_close() {
+#ifdef HAVE_SIGACTION
+    if (file_name || output_fd >= 0) {
+#ifdef HAVE_SETITIMER
+        const struct itimerval stopped = { 0 };
+        setitimer(ITIMER_REAL, &stopped, NULL);
+        sigaction(SIGALRM, &prev_alrm_action, NULL);
+#endif
+        sigaction(SIGUSR1, &prev_usr1_action, NULL);
+    }
+#endif
+    file_name = NULL;
+    output_fd = -1;
+}
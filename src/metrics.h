@@ -0,0 +1,69 @@
+/*
+ * metrics.h - Live metrics definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef U6A_METRICS_H_
+#define U6A_METRICS_H_
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// In seconds
+#define U6A_METRICS_DEFAULT_INTERVAL 10
+#define U6A_METRICS_MIN_INTERVAL     1
+#define U6A_METRICS_MAX_INTERVAL     86400
+
+struct u6a_metrics {
+    bool     ins_counted;            /* whether VM instructions were counted, which only some options do */
+    uint64_t ins_count;
+    uint64_t allocs;                 /* elements allocated from the object pool */
+    uint64_t frees;
+    uint32_t live_elems;
+    uint32_t pool_len;
+    uint32_t stack_segments;
+    uint32_t conts;                  /* live continuations */
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+};
+
+/*
+ * Write snapshots to `file_name`, which is replaced as a whole each time, or to the file descriptor `fd` if
+ * `file_name` is NULL, every `interval` seconds, and upon SIGUSR1.
+ *
+ * Whenever a snapshot falls due, `*wakeup` is set from a signal handler, so that the VM soon reaches a safe point
+ * where u6a_metrics_due() is checked.
+ */
+bool
+u6a_metrics_open(const char* file_name, int fd, uint32_t interval, volatile bool* wakeup);
+
+// Whether a snapshot should be written now
+bool
+u6a_metrics_due();
+
+void
+u6a_metrics_write(const struct u6a_metrics* metrics);
+
+void
+u6a_metrics_close();
+
+#endif
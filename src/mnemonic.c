@@ -80,8 +80,10 @@ u6a_mnemonic_fn(uint8_t fn) {
         case u6a_vf_cmp:
             return "?";
         case u6a_vf_k1:
+        case u6a_vf_k1_i:
             return "`k";
         case u6a_vf_s1:
+        case u6a_vf_s1_i:
             return "`s";
         case u6a_vf_s2:
             return "``s";
@@ -90,6 +92,7 @@ u6a_mnemonic_fn(uint8_t fn) {
         case u6a_vf_d1_s:
         case u6a_vf_d1_c:
         case u6a_vf_d1_d:
+        case u6a_vf_d1_i:
             return "`d";
         case u6a_vf_j:
             return "~j";
@@ -0,0 +1,327 @@
+/*
+ * mux.c - Unlambda VM multiplexer
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mux.h"
+#include "runtime.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MUX_DEFAULT_HOST "127.0.0.1"
+#define MUX_MAX_EVENTS   64
+#define MUX_READ_SIZE    4096
+#define MUX_BACKLOG      128
+
+struct mux_session {
+    struct u6a_runtime_vm* vm;
+    int                    fd;
+    FILE*                  ostream;      /* output of the VM, buffered until the socket accepts it */
+    char*                  out_buf;
+    size_t                 out_len;
+    size_t                 out_sent;
+    bool                   exited;
+};
+
+static const char* err_mux = "mux error";
+static const char* info_mux = "mux";
+
+static int      epoll_fd = -1;
+static int      listen_fd = -1;
+static uint32_t num_sessions;
+static uint32_t max_sessions_;
+
+static int
+mux_listen(const char* address) {
+    char* host = strdup(address);
+    if (UNLIKELY(host == NULL)) {
+        u6a_err_bad_alloc(err_mux, strlen(address) + 1);
+        return -1;
+    }
+    const char* port = host;
+    const char* node = MUX_DEFAULT_HOST;
+    char* colon = strrchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        port = colon + 1;
+        node = host;
+        // Brackets around IPv6 addresses
+        if (host[0] == '[' && colon > host && colon[-1] == ']') {
+            colon[-1] = '\0';
+            ++node;
+        }
+    }
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags    = AI_PASSIVE
+    };
+    struct addrinfo* addr_list;
+    if (UNLIKELY(getaddrinfo(node[0] ? node : NULL, port, &hints, &addr_list))) {
+        u6a_err_invalid_address(err_mux, address);
+        free(host);
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* addr = addr_list; addr; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
+        if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 && listen(fd, MUX_BACKLOG) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addr_list);
+    free(host);
+    if (UNLIKELY(fd < 0)) {
+        u6a_err_invalid_address(err_mux, address);
+    }
+    return fd;
+}
+
+static inline bool
+mux_watch(int op, int fd, uint32_t events, void* ptr) {
+    struct epoll_event event = {
+        .events   = events,
+        .data.ptr = ptr
+    };
+    if (UNLIKELY(epoll_ctl(epoll_fd, op, fd, &event))) {
+        u6a_err_syscall_failed(err_mux, "epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+static void
+session_close(struct mux_session* session) {
+    close(session->fd);
+    if (session->vm) {
+        u6a_runtime_vm_destroy(session->vm);
+    }
+    fclose(session->ostream);
+    free(session->out_buf);
+    free(session);
+    if (num_sessions-- == max_sessions_) {
+        // Room for new sessions again
+        mux_watch(EPOLL_CTL_MOD, listen_fd, EPOLLIN, NULL);
+    }
+}
+
+// Returns false on a broken connection, otherwise `out_sent < out_len` if the socket is full
+static bool
+session_flush(struct mux_session* session) {
+    fflush(session->ostream);
+    while (session->out_sent < session->out_len) {
+        ssize_t sent = send(session->fd, session->out_buf + session->out_sent,
+                            session->out_len - session->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        session->out_sent += sent;
+    }
+    // Everything is sent, reuse the buffer from the beginning
+    fseeko(session->ostream, 0, SEEK_SET);
+    fflush(session->ostream);
+    session->out_sent = 0;
+    return true;
+}
+
+// Flush output after the VM is suspended or has exited, then decide what to wait for next
+static void
+session_settle(struct mux_session* session, enum u6a_runtime_status status) {
+    if (status != u6a_rs_input && session->vm) {
+        session->exited = true;
+        u6a_runtime_vm_destroy(session->vm);
+        session->vm = NULL;
+    }
+    if (UNLIKELY(!session_flush(session))) {
+        session_close(session);
+        return;
+    }
+    if (session->out_sent < session->out_len) {
+        if (UNLIKELY(!mux_watch(EPOLL_CTL_MOD, session->fd, EPOLLOUT, session))) {
+            session_close(session);
+        }
+        return;
+    }
+    if (session->exited) {
+        session_close(session);
+        return;
+    }
+    if (UNLIKELY(!mux_watch(EPOLL_CTL_MOD, session->fd, EPOLLIN | EPOLLRDHUP, session))) {
+        session_close(session);
+    }
+}
+
+static void
+session_input(struct mux_session* session) {
+    if (UNLIKELY(session->vm == NULL || session->out_sent < session->out_len)) {
+        // Error or hangup while waiting for the socket to become writable
+        session_close(session);
+        return;
+    }
+    char buffer[MUX_READ_SIZE];
+    ssize_t len;
+    do {
+        len = recv(session->fd, buffer, MUX_READ_SIZE, 0);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            session_close(session);
+        }
+        return;
+    }
+    session_settle(session, u6a_runtime_vm_resume(session->vm, buffer, len, len == 0, session->ostream));
+}
+
+static void
+session_output(struct mux_session* session) {
+    if (UNLIKELY(!session_flush(session))) {
+        session_close(session);
+        return;
+    }
+    if (session->out_sent == session->out_len) {
+        session_settle(session, session->exited ? u6a_rs_exited : u6a_rs_input);
+    }
+}
+
+static void
+session_accept() {
+    while (num_sessions < max_sessions_) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        struct mux_session* session = calloc(1, sizeof(struct mux_session));
+        if (UNLIKELY(session == NULL)) {
+            u6a_err_bad_alloc(err_mux, sizeof(struct mux_session));
+            close(fd);
+            return;
+        }
+        session->fd = fd;
+        session->ostream = open_memstream(&session->out_buf, &session->out_len);
+        if (UNLIKELY(session->ostream == NULL)) {
+            u6a_err_syscall_failed(err_mux, "open_memstream");
+            close(fd);
+            free(session);
+            return;
+        }
+        session->vm = u6a_runtime_vm_create();
+        if (UNLIKELY(session->vm == NULL)) {
+            fclose(session->ostream);
+            free(session->out_buf);
+            close(fd);
+            free(session);
+            return;
+        }
+        if (UNLIKELY(!mux_watch(EPOLL_CTL_ADD, fd, 0, session))) {
+            u6a_runtime_vm_destroy(session->vm);
+            fclose(session->ostream);
+            free(session->out_buf);
+            close(fd);
+            free(session);
+            return;
+        }
+        if (++num_sessions == max_sessions_) {
+            // Stop accepting until a session is closed
+            mux_watch(EPOLL_CTL_MOD, listen_fd, 0, NULL);
+        }
+        // Run until the program first asks for input
+        session_settle(session, u6a_runtime_vm_resume(session->vm, NULL, 0, false, session->ostream));
+    }
+}
+
+bool
+u6a_mux_serve(const char* address, uint32_t max_sessions) {
+    max_sessions_ = max_sessions;
+    listen_fd = mux_listen(address);
+    if (UNLIKELY(listen_fd < 0)) {
+        return false;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (UNLIKELY(epoll_fd < 0)) {
+        u6a_err_syscall_failed(err_mux, "epoll_create1");
+        goto mux_failed;
+    }
+    if (UNLIKELY(!mux_watch(EPOLL_CTL_ADD, listen_fd, EPOLLIN, NULL))) {
+        goto mux_failed;
+    }
+    u6a_info_verbose(info_mux, "listening on %s, at most %" PRIu32 " sessions", address, max_sessions);
+    struct epoll_event events[MUX_MAX_EVENTS];
+    while (true) {
+        int num_events = epoll_wait(epoll_fd, events, MUX_MAX_EVENTS, -1);
+        if (UNLIKELY(num_events < 0)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            u6a_err_syscall_failed(err_mux, "epoll_wait");
+            goto mux_failed;
+        }
+        for (int idx = 0; idx < num_events; ++idx) {
+            struct mux_session* session = events[idx].data.ptr;
+            if (session == NULL) {
+                session_accept();
+            } else if (events[idx].events & EPOLLOUT) {
+                session_output(session);
+            } else {
+                session_input(session);
+            }
+        }
+    }
+
+    mux_failed:
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    close(listen_fd);
+    return false;
+}
+
+#else
+
+bool
+u6a_mux_serve(const char* address, uint32_t max_sessions) {
+    u6a_err_custom("mux error", "multiplexing is not supported on this platform");
+    return false;
+}
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * mux.h - Unlambda VM multiplexer definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_MUX_H_
+#define U6A_MUX_H_
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define U6A_MUX_DEFAULT_MAX_SESSIONS 1024
+#define U6A_MUX_MIN_MAX_SESSIONS     1
+#define U6A_MUX_MAX_MAX_SESSIONS     ( 1024 * 1024 )
+
+bool
+u6a_mux_serve(const char* address, uint32_t max_sessions);
+
+#endif
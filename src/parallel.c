@@ -0,0 +1,308 @@
+/*
+ * parallel.c - Worker threads for parallel evaluation
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "parallel.h"
+#include "logging.h"
+
+#include <stdlib.h>
+
+uint32_t                  u6a_parallel_idle_;
+uint32_t                  u6a_parallel_grain_ = 1;
+U6A_THREAD_LOCAL uint32_t u6a_parallel_tick_;
+
+#if defined(HAVE_PTHREAD_H) && defined(__GNUC__)
+
+#include <time.h>
+#include <pthread.h>
+
+enum worker_state {
+    ws_starting,
+    ws_idle,
+    ws_claimed,                      /* the claimer is copying the application into the pool of the worker */
+    ws_running,
+    ws_done,
+    ws_failed,
+    ws_released,                     /* the result is copied out, and the worker is cleaning up */
+    ws_exit,
+    ws_dead                          /* failed to start */
+};
+
+struct worker_thread {
+    struct u6a_parallel_worker worker;
+    pthread_t                  thread;
+    pthread_mutex_t            lock;
+    pthread_cond_t             cond;
+    bool                       started;
+};
+
+static struct worker_thread* workers;
+static uint32_t              num_workers;
+static uint64_t              num_tasks;
+static u6a_parallel_init_fn  worker_init;
+static u6a_parallel_run      worker_run;
+static u6a_parallel_reset    worker_reset;
+
+static inline uint32_t
+state_get(struct worker_thread* wt) {
+    return __atomic_load_n(&wt->worker.state, __ATOMIC_ACQUIRE);
+}
+
+// Changes the state under the lock of the worker, so that waiters never miss it
+static inline void
+state_set(struct worker_thread* wt, uint32_t state) {
+    pthread_mutex_lock(&wt->lock);
+    __atomic_store_n(&wt->worker.state, state, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&wt->cond);
+    pthread_mutex_unlock(&wt->lock);
+}
+
+static inline uint32_t
+state_wait(struct worker_thread* wt, uint32_t state_0, uint32_t state_1) {
+    pthread_mutex_lock(&wt->lock);
+    uint32_t state;
+    while ((state = state_get(wt)) != state_0 && state != state_1) {
+        pthread_cond_wait(&wt->cond, &wt->lock);
+    }
+    pthread_mutex_unlock(&wt->lock);
+    return state;
+}
+
+static inline uint64_t
+clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void*
+worker_main(void* data) {
+    struct worker_thread* wt = data;
+    struct u6a_parallel_worker* worker = &wt->worker;
+    worker->pool_ctx = worker_init(worker);
+    if (UNLIKELY(worker->pool_ctx == NULL)) {
+        state_set(wt, ws_dead);
+        return NULL;
+    }
+    state_set(wt, ws_idle);
+    __atomic_add_fetch(&u6a_parallel_idle_, 1, __ATOMIC_RELAXED);
+    while (state_wait(wt, ws_running, ws_exit) == ws_running) {
+        const uint64_t start = clock_ns();
+        const bool ok = worker_run(worker);
+        worker->duration = clock_ns() - start;
+        state_set(wt, ok ? ws_done : ws_failed);
+        if (state_wait(wt, ws_released, ws_exit) == ws_exit) {
+            break;
+        }
+        if (UNLIKELY(!worker_reset(worker))) {
+            state_set(wt, ws_dead);
+            return NULL;
+        }
+        state_set(wt, ws_idle);
+        __atomic_add_fetch(&u6a_parallel_idle_, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+bool
+u6a_parallel_init(uint32_t num_workers_, u6a_parallel_init_fn init, u6a_parallel_run run, u6a_parallel_reset reset,
+                  const char* err_stage)
+{
+    workers = calloc(num_workers_, sizeof(struct worker_thread));
+    if (UNLIKELY(workers == NULL)) {
+        u6a_err_bad_alloc(err_stage, num_workers_ * sizeof(struct worker_thread));
+        return false;
+    }
+    num_workers = num_workers_;
+    worker_init = init;
+    worker_run = run;
+    worker_reset = reset;
+    for (uint32_t idx = 0; idx < num_workers; ++idx) {
+        struct worker_thread* wt = workers + idx;
+        wt->worker.index = idx;
+        wt->worker.state = ws_starting;
+        pthread_mutex_init(&wt->lock, NULL);
+        pthread_cond_init(&wt->cond, NULL);
+        if (UNLIKELY(pthread_create(&wt->thread, NULL, worker_main, wt) != 0)) {
+            u6a_err_syscall_failed(err_stage, "pthread_create");
+            wt->worker.state = ws_dead;
+            continue;
+        }
+        wt->started = true;
+    }
+    // Workers still starting would miss the applications made early on, leaving them to the main thread
+    for (uint32_t idx = 0; idx < num_workers; ++idx) {
+        if (workers[idx].started) {
+            state_wait(workers + idx, ws_idle, ws_dead);
+        }
+    }
+    return true;
+}
+
+struct u6a_parallel_worker*
+u6a_parallel_claim() {
+    for (uint32_t idx = 0; idx < num_workers; ++idx) {
+        struct worker_thread* wt = workers + idx;
+        uint32_t state = ws_idle;
+        if (__atomic_compare_exchange_n(&wt->worker.state, &state, ws_claimed, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED))
+        {
+            __atomic_sub_fetch(&u6a_parallel_idle_, 1, __ATOMIC_RELAXED);
+            u6a_parallel_tick_ = 0;
+            return &wt->worker;
+        }
+    }
+    return NULL;
+}
+
+void
+u6a_parallel_start(struct u6a_parallel_worker* worker) {
+    state_set(workers + worker->index, ws_running);
+}
+
+struct u6a_parallel_worker*
+u6a_parallel_get(uint32_t index) {
+    return &workers[index].worker;
+}
+
+bool
+u6a_parallel_join(struct u6a_parallel_worker* worker) {
+    const bool ok = state_wait(workers + worker->index, ws_done, ws_failed) == ws_done;
+    if (ok) {
+        __atomic_add_fetch(&num_tasks, 1, __ATOMIC_RELAXED);
+    }
+    // Hand over fewer and larger tasks if they turn out to be small, and more if they are large
+    uint32_t grain = U6A_PARALLEL_LOAD(u6a_parallel_grain_);
+    if (worker->duration < U6A_PARALLEL_MIN_TASK_NS) {
+        grain = grain < U6A_PARALLEL_MAX_GRAIN ? grain * 2 : grain;
+    } else if (worker->duration > 8 * U6A_PARALLEL_MIN_TASK_NS) {
+        grain = grain > 1 ? grain / 2 : grain;
+    }
+    __atomic_store_n(&u6a_parallel_grain_, grain, __ATOMIC_RELAXED);
+    return ok;
+}
+
+void
+u6a_parallel_release(struct u6a_parallel_worker* worker) {
+    struct worker_thread* wt = workers + worker->index;
+    if (state_get(wt) == ws_claimed) {
+        // Never started, so there is nothing to clean up
+        state_set(wt, ws_idle);
+        __atomic_add_fetch(&u6a_parallel_idle_, 1, __ATOMIC_RELAXED);
+    } else {
+        state_set(wt, ws_released);
+    }
+}
+
+uint32_t
+u6a_parallel_num_workers() {
+    return num_workers;
+}
+
+uint64_t
+u6a_parallel_num_tasks() {
+    return U6A_PARALLEL_LOAD(num_tasks);
+}
+
+bool
+u6a_parallel_destroy() {
+    bool all_joined = true;
+    for (uint32_t idx = 0; idx < num_workers; ++idx) {
+        struct worker_thread* wt = workers + idx;
+        if (!wt->started) {
+            continue;
+        }
+        // Workers which are starting or cleaning up are waited for, but not those making an application
+        pthread_mutex_lock(&wt->lock);
+        uint32_t state;
+        while ((state = state_get(wt)) == ws_starting || state == ws_released) {
+            pthread_cond_wait(&wt->cond, &wt->lock);
+        }
+        if (state == ws_idle && __atomic_compare_exchange_n(&wt->worker.state, &state, ws_exit, false,
+                                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            pthread_cond_broadcast(&wt->cond);
+            state = ws_exit;
+        }
+        pthread_mutex_unlock(&wt->lock);
+        if (state == ws_exit || state == ws_dead) {
+            pthread_join(wt->thread, NULL);
+        } else {
+            all_joined = false;
+        }
+    }
+    if (all_joined) {
+        for (uint32_t idx = 0; idx < num_workers; ++idx) {
+            u6a_vm_pool_map_destroy(&workers[idx].worker.origins);
+        }
+        free(workers);
+        workers = NULL;
+        num_workers = 0;
+    }
+    return all_joined;
+}
+
+#else
+
+bool
+u6a_parallel_init(uint32_t num_workers_, u6a_parallel_init_fn init, u6a_parallel_run run, u6a_parallel_reset reset,
+                  const char* err_stage)
+{
+    u6a_err_custom(err_stage, "parallel evaluation is not supported on this platform");
+    return false;
+}
+
+struct u6a_parallel_worker*
+u6a_parallel_claim() {
+    return NULL;
+}
+
+void
+u6a_parallel_start(struct u6a_parallel_worker* worker) { }
+
+struct u6a_parallel_worker*
+u6a_parallel_get(uint32_t index) {
+    return NULL;
+}
+
+bool
+u6a_parallel_join(struct u6a_parallel_worker* worker) {
+    return false;
+}
+
+void
+u6a_parallel_release(struct u6a_parallel_worker* worker) { }
+
+uint32_t
+u6a_parallel_num_workers() {
+    return 0;
+}
+
+uint64_t
+u6a_parallel_num_tasks() {
+    return 0;
+}
+
+bool
+u6a_parallel_destroy() {
+    return true;
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * parallel.h - Worker threads for parallel evaluation definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_PARALLEL_H_
+#define U6A_PARALLEL_H_
+
+#include "common.h"
+#include "vm_defs.h"
+#include "vm_pool.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define U6A_PARALLEL_MIN_WORKERS 0
+#define U6A_PARALLEL_MAX_WORKERS 256
+
+// Tasks which finish sooner than this are considered too small to be worth handing over
+#define U6A_PARALLEL_MIN_TASK_NS 100000
+#define U6A_PARALLEL_MAX_GRAIN   ( UINT32_C(1) << 20 )
+
+#ifdef __GNUC__
+#define U6A_PARALLEL_LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#else
+#define U6A_PARALLEL_LOAD(var) (var)
+#endif
+
+struct u6a_parallel_worker {
+    struct u6a_vm_pool_ctx* pool_ctx;     /* pool of the worker, which only its claimer may use meanwhile */
+    struct u6a_vm_var_fn    func;         /* application to be made, in the pool of the worker */
+    struct u6a_vm_var_fn    arg;
+    struct u6a_vm_var_fn    result;       /* empty if failed */
+    uint64_t                ins_count;    /* VM instructions executed for the task */
+    uint64_t                duration;     /* in nanoseconds */
+    struct u6a_vm_pool_map  origins;      /* elements copied into the pool of the worker from that of its claimer */
+    uint32_t                state;
+    uint32_t                index;
+};
+
+// Make the application held by the worker, returns false on failure. Called by the worker's own thread.
+typedef bool (*u6a_parallel_run)(struct u6a_parallel_worker* worker);
+
+// Prepare the thread for making applications, and return the pool of the worker
+typedef struct u6a_vm_pool_ctx* (*u6a_parallel_init_fn)(struct u6a_parallel_worker* worker);
+
+// Clean up after an application, successful or not, returns false if the worker cannot be used any more
+typedef bool (*u6a_parallel_reset)(struct u6a_parallel_worker* worker);
+
+extern uint32_t u6a_parallel_idle_;
+extern uint32_t u6a_parallel_grain_;
+extern U6A_THREAD_LOCAL uint32_t u6a_parallel_tick_;
+
+bool
+u6a_parallel_init(uint32_t num_workers, u6a_parallel_init_fn init, u6a_parallel_run run, u6a_parallel_reset reset,
+                  const char* err_stage);
+
+// Whether an application should be handed over to a worker, as some are idle and tasks are not too small
+static inline bool
+u6a_parallel_ready() {
+    return U6A_PARALLEL_LOAD(u6a_parallel_idle_) && ++u6a_parallel_tick_ >= U6A_PARALLEL_LOAD(u6a_parallel_grain_);
+}
+
+// Take an idle worker, or NULL if none. The claimer then copies the application into its pool.
+struct u6a_parallel_worker*
+u6a_parallel_claim();
+
+void
+u6a_parallel_start(struct u6a_parallel_worker* worker);
+
+struct u6a_parallel_worker*
+u6a_parallel_get(uint32_t index);
+
+// Wait until the application is made, returns false on failure
+bool
+u6a_parallel_join(struct u6a_parallel_worker* worker);
+
+// Let the worker clean up and become idle again, once the result is copied out of its pool,
+// or if the application could not be copied into it
+void
+u6a_parallel_release(struct u6a_parallel_worker* worker);
+
+uint32_t
+u6a_parallel_num_workers();
+
+// Applications made by workers so far, as joined successfully
+uint64_t
+u6a_parallel_num_tasks();
+
+// Returns false if some workers are still busy, in which case the data they use should not be freed
+bool
+u6a_parallel_destroy();
+
+#endif
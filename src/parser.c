@@ -21,6 +21,7 @@
 
 #include "parser.h"
 #include "logging.h"
+#include "time_report.h"
 
 #include <stdlib.h>
 
@@ -36,6 +37,7 @@ u6a_parse(struct u6a_token* token_arr, uint32_t token_len, struct u6a_ast_node**
         u6a_err_bad_alloc(err_parse, ast_size);
         return false;
     }
+    u6a_time_report_alloc(u6a_tp_parse, ast_size);
     // Add an explicit `e` function as a guard, to ensure proper exit of the program.
     U6A_AN_FN(ast) = u6a_tf_app;
     U6A_AN_FN(U6A_AN_LEFT(ast)) = u6a_tf_e;
@@ -46,6 +48,7 @@ u6a_parse(struct u6a_token* token_arr, uint32_t token_len, struct u6a_ast_node**
         u6a_err_bad_alloc(err_parse, pstack_size);
         goto parse_failed;
     }
+    u6a_time_report_alloc(u6a_tp_parse, pstack_size);
     pstack[0] = ast;
     uint32_t pstack_idx = 0;
     // LL(0) parser
@@ -74,6 +77,7 @@ u6a_parse(struct u6a_token* token_arr, uint32_t token_len, struct u6a_ast_node**
         goto parse_failed;
     }
     free(pstack);
+    u6a_time_report_free(u6a_tp_parse, pstack_size);
     *ast_arr = ast;
     u6a_info_verbose(info_parse, "%s", "completed");
     return true;
@@ -0,0 +1,187 @@
+/*
+ * perf.c - Hardware performance counters
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "perf.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define PERF_REPORT(format, ...) \
+    fprintf(stderr, "%s: [%s] " format ".\n", u6a_logging_get_prog_name_(), info_perf, __VA_ARGS__)
+
+static const char* err_perf = "perf error";
+static const char* info_perf = "perf";
+
+static const char* event_names[u6a_pe_max_] = {
+    [u6a_pe_cycles]        = "cycles",
+    [u6a_pe_instructions]  = "instructions",
+    [u6a_pe_branches]      = "branches",
+    [u6a_pe_branch_misses] = "branch misses",
+    [u6a_pe_cache_misses]  = "cache misses",
+    [u6a_pe_dtlb_misses]   = "dTLB load misses"
+};
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} event_attrs[u6a_pe_max_] = {
+    [u6a_pe_cycles]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [u6a_pe_instructions]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [u6a_pe_branches]      = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    [u6a_pe_branch_misses] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [u6a_pe_cache_misses]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [u6a_pe_dtlb_misses]   = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | ( PERF_COUNT_HW_CACHE_OP_READ << 8 )
+                                                   | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ) }
+};
+
+bool
+u6a_perf_open(struct u6a_perf_counters* counters) {
+    uint32_t num_opened = 0;
+    for (int idx = 0; idx < u6a_pe_max_; ++idx) {
+        // Events are opened separately rather than as a group, so that unsupported ones do not fail the others
+        struct perf_event_attr attr = {
+            .type           = event_attrs[idx].type,
+            .size           = sizeof(struct perf_event_attr),
+            .config         = event_attrs[idx].config,
+            .read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+            .disabled       = 1,
+            .exclude_kernel = 1,
+            .exclude_hv     = 1
+        };
+        counters->fds[idx] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        counters->values[idx] = 0;
+        if (counters->fds[idx] >= 0) {
+            ++num_opened;
+        }
+    }
+    if (UNLIKELY(num_opened == 0)) {
+        u6a_err_syscall_failed(err_perf, "perf_event_open");
+        return false;
+    }
+    return true;
+}
+
+void
+u6a_perf_start(struct u6a_perf_counters* counters) {
+    for (int idx = 0; idx < u6a_pe_max_; ++idx) {
+        if (counters->fds[idx] >= 0) {
+            ioctl(counters->fds[idx], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[idx], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void
+u6a_perf_stop(struct u6a_perf_counters* counters) {
+    for (int idx = 0; idx < u6a_pe_max_; ++idx) {
+        if (counters->fds[idx] >= 0) {
+            ioctl(counters->fds[idx], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (int idx = 0; idx < u6a_pe_max_; ++idx) {
+        // Value, time enabled, time running
+        uint64_t result[3];
+        if (counters->fds[idx] < 0) {
+            continue;
+        }
+        if (UNLIKELY(read(counters->fds[idx], result, sizeof(result)) != sizeof(result) || result[2] == 0)) {
+            close(counters->fds[idx]);
+            counters->fds[idx] = -1;
+            continue;
+        }
+        // Extrapolate when the event had to share a hardware counter with others
+        counters->values[idx] = result[2] < result[1] ? (double)result[0] * result[1] / result[2] : result[0];
+    }
+}
+
+void
+u6a_perf_close(struct u6a_perf_counters* counters) {
+    for (int idx = 0; idx < u6a_pe_max_; ++idx) {
+        if (counters->fds[idx] >= 0) {
+            close(counters->fds[idx]);
+            counters->fds[idx] = -1;
+        }
+    }
+}
+
+#else
+
+bool
+u6a_perf_open(struct u6a_perf_counters* counters) {
+    for (int idx = 0; idx < u6a_pe_max_; ++idx) {
+        counters->fds[idx] = -1;
+    }
+    u6a_err_custom(err_perf, "performance counters are not supported on this platform");
+    return false;
+}
+
+void
+u6a_perf_start(struct u6a_perf_counters* counters) { }
+
+void
+u6a_perf_stop(struct u6a_perf_counters* counters) { }
+
+void
+u6a_perf_close(struct u6a_perf_counters* counters) { }
+
+#endif
+
+void
+u6a_perf_report(struct u6a_perf_counters* counters, uint64_t vm_ins_count) {
+    const double per_ins = vm_ins_count ? 1.0 / vm_ins_count : 0;
+    PERF_REPORT("%-17s: %" PRIu64, "VM instructions", vm_ins_count);
+    for (int idx = 0; idx < u6a_pe_max_; ++idx) {
+        const uint64_t value = counters->values[idx];
+        if (counters->fds[idx] < 0) {
+            PERF_REPORT("%-17s: %s", event_names[idx], "not available");
+            continue;
+        }
+        switch (idx) {
+            case u6a_pe_instructions:
+                if (counters->fds[u6a_pe_cycles] >= 0 && counters->values[u6a_pe_cycles]) {
+                    PERF_REPORT("%-17s: %" PRIu64 " (%.2f per VM instruction, %.3f IPC)", event_names[idx], value,
+                        value * per_ins, (double)value / counters->values[u6a_pe_cycles]);
+                    continue;
+                }
+                break;
+            case u6a_pe_branch_misses:
+                if (counters->fds[u6a_pe_branches] >= 0 && counters->values[u6a_pe_branches]) {
+                    PERF_REPORT("%-17s: %" PRIu64 " (%.4f per VM instruction, %.2f%% of branches)", event_names[idx],
+                        value, value * per_ins, 100.0 * value / counters->values[u6a_pe_branches]);
+                    continue;
+                }
+                break;
+            default:
+                break;
+        }
+        PERF_REPORT("%-17s: %" PRIu64 " (%.4f per VM instruction)", event_names[idx], value, value * per_ins);
+    }
+}
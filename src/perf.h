@@ -0,0 +1,60 @@
+/*
+ * perf.h - Hardware performance counters definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_PERF_H_
+#define U6A_PERF_H_
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum u6a_perf_event {
+    u6a_pe_cycles,
+    u6a_pe_instructions,
+    u6a_pe_branches,
+    u6a_pe_branch_misses,
+    u6a_pe_cache_misses,
+    u6a_pe_dtlb_misses,
+    u6a_pe_max_
+};
+
+struct u6a_perf_counters {
+    int      fds[u6a_pe_max_];       /* -1 if the event is unavailable */
+    uint64_t values[u6a_pe_max_];    /* scaled for the time the event was not scheduled on a counter */
+};
+
+bool
+u6a_perf_open(struct u6a_perf_counters* counters);
+
+void
+u6a_perf_start(struct u6a_perf_counters* counters);
+
+void
+u6a_perf_stop(struct u6a_perf_counters* counters);
+
+void
+u6a_perf_report(struct u6a_perf_counters* counters, uint64_t vm_ins_count);
+
+void
+u6a_perf_close(struct u6a_perf_counters* counters);
+
+#endif
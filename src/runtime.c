@@ -22,8 +22,19 @@
 #include "runtime.h"
 #include "logging.h"
 #include "vm_defs.h"
+#include "bytecode.h"
 #include "vm_stack.h"
 #include "vm_pool.h"
+#include "vm_snapshot.h"
+#include "vm_verify.h"
+#include "trace.h"
+#include "heap_profile.h"
+#include "memo.h"
+#include "parallel.h"
+#include "metrics.h"
+#include "lexer.h"
+#include "parser.h"
+#include "codegen.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -31,14 +42,60 @@
 #include <arpa/inet.h>
 #include <setjmp.h>
 
+// State of an Unlambda VM hosted by the multiplexer, while it is not executing
+struct u6a_runtime_vm {
+    struct u6a_vm_stack_ctx     stack_ctx;
+    struct u6a_vm_pool_ctx      pool_ctx;
+    struct u6a_vm_snapshot_regs regs;
+    const char*                 input;
+    uint32_t                    input_len;
+    bool                        input_eof;
+    bool                        started;
+    bool                        suspended;
+};
+
 static struct u6a_vm_ins*      text;
 static        uint32_t         text_len;
 static        char*            rodata;
 static        uint32_t         rodata_len;
 static        bool             force_exec;
-static struct u6a_vm_stack_ctx stack_ctx;
-static struct u6a_vm_pool_ctx  pool_ctx;
-static        jmp_buf          jmp_ctx;
+static        bool             church_numerals;
+static        uint32_t         memo_size;
+static struct u6a_memo_ctx     memo_ctx;
+static        uint32_t         num_workers;
+static        bool             verified;
+static        uint32_t         unused_features;
+static        bool             count_ins;
+static        bool             instrument;
+static U6A_THREAD_LOCAL uint64_t ins_count;
+static        uint32_t         trace_interval;
+static        uint64_t         trace_next;
+static        uint32_t         heap_interval;
+static        uint64_t         heap_next;
+static        bool             heap_profile;
+// Metrics are only written by the main VM, at its safe points
+static U6A_THREAD_LOCAL bool   metrics;
+static        uint64_t         bytes_written;
+static        uint64_t         bytes_read;
+static const  char*            snapshot_file;
+// Each worker thread of parallel evaluation has a VM of its own
+static U6A_THREAD_LOCAL uint64_t sample_next;
+static U6A_THREAD_LOCAL bool   resuming;
+static U6A_THREAD_LOCAL struct u6a_vm_snapshot_regs resume_regs;
+static U6A_THREAD_LOCAL struct u6a_vm_stack_ctx stack_ctx;
+static U6A_THREAD_LOCAL struct u6a_vm_pool_ctx  pool_ctx;
+static U6A_THREAD_LOCAL jmp_buf jmp_ctx;
+#ifdef U6A_VM_STACK_FLAT_SUPPORTED
+// Only the main VM may run on the flat stack
+static        sigjmp_buf       flat_fault_ctx;
+#endif
+static U6A_THREAD_LOCAL struct u6a_vm_pool_copier copier;
+static        uint32_t         stack_seg_len;
+static        uint32_t         pool_len;
+static        uint32_t         nursery_len;
+static        bool             huge_pages;
+static enum   u6a_vm_pool_policy pool_policy;
+static struct u6a_runtime_vm*  current_vm;
 
 static const struct u6a_vm_ins text_subst[] = {
     { .opcode = u6a_vo_la  },
@@ -50,60 +107,129 @@ static const struct u6a_vm_ins text_subst[] = {
 static const uint32_t text_subst_len = sizeof(text_subst) / sizeof(struct u6a_vm_ins);
 
 static const char* err_runtime = "runtime error";
+static const char* info_runtime = "runtime";
 
-#define CHECK_BC_HEADER_VER(file_header)       \
-    ( (file_header).ver_major == U6A_VER_MAJOR && (file_header).ver_minor == U6A_VER_MINOR )
-
-#define ACC_FN_REF(fn_, ref_)                  \
-    acc = U6A_VM_VAR_FN_REF(fn_, ref_)
+#define ACC_FN_REF(fn_, ref_)                       \
+    acc = U6A_VM_VAR_FN_REF(fn_, ref_);             \
+    if (instrumented && UNLIKELY(pool_ctx.tags)) {  \
+        POOL_TAG(acc);                              \
+    }
+#define ACC_FN_CAPTURE(fn_imm, fn_ref, var)                     \
+    if (U6A_VM_FN_UNBOXABLE((var).token.fn)) {                  \
+        acc = U6A_VM_VAR_FN_IMM(fn_imm, var);                   \
+    } else {                                                    \
+        ACC_FN_REF(fn_ref, POOL_ALLOC1(vm_var_fn_addref(var))); \
+    }
+// On a miss, the application is made in tail position, returning into the `la` at 0x04, which applies `m` to
+// the result to record it, and then goes on to the caller's own return frame
+#define MEMO_APPLY(label)                                                                   \
+    if (memo && vm_var_fn_pure(func) && vm_var_fn_pure(arg)) {                              \
+        if (u6a_memo_lookup(&memo_ctx, func, arg, &acc)) {                                  \
+            vm_var_fn_addref(acc);                                                          \
+            break;                                                                          \
+        }                                                                                   \
+        ACC_FN_REF(u6a_vf_m, POOL_ALLOC2(vm_var_fn_addref(func), vm_var_fn_addref(arg)));   \
+        STACK_PUSH_RET1(acc);                                                               \
+        ins = text + 0x03;                                                                  \
+        goto label;                                                                         \
+    }
 #define VM_JMP(dest)                           \
     ins = text + (dest);                       \
     continue
 #define CHECK_FORCE(log_func, err_val)         \
+    if (!checked) {                            \
+        U6A_NOT_REACHED();                     \
+    }                                          \
     if (!force_exec) {                         \
         log_func(err_runtime, err_val);        \
         goto runtime_error;                    \
     }
 
+#define FEATURE_USED(no_flag)                  \
+    if (unused & (no_flag)) {                  \
+        U6A_NOT_REACHED();                     \
+    }
+
+#define SNAPSHOT_AT_INPUT()                                           \
+    if (UNLIKELY(snapshot_file)) {                                    \
+        if (!save_snapshot(ins, acc, top, func, arg, current_char)) { \
+            goto runtime_error;                                       \
+        }                                                             \
+    }
+
+#define VM_SUSPEND()                                               \
+    current_vm->regs = (struct u6a_vm_snapshot_regs) {             \
+        .ins          = ins - text,                                \
+        .current_char = current_char,                              \
+        .acc          = acc,                                       \
+        .top          = top,                                       \
+        .func         = func,                                      \
+        .arg          = arg                                        \
+    };                                                             \
+    current_vm->suspended = true;                                  \
+    return U6A_VM_VAR_FN_EMPTY
+
 #define VM_VAR_JMP       U6A_VM_VAR_FN_REF(u6a_vf_j, ins - text)
 #define VM_VAR_FINALIZE  U6A_VM_VAR_FN_REF(u6a_vf_f, ins - text)
 
-#define STACK_PUSH1(fn_0)                    u6a_vm_stack_push1(&stack_ctx, fn_0)
-#define STACK_PUSH2(fn_0, fn_1)              u6a_vm_stack_push2(&stack_ctx, fn_0, fn_1)
-#define STACK_PUSH3(fn_0, fn_1, fn_2)        u6a_vm_stack_push3(&stack_ctx, fn_0, fn_1, fn_2)
-#define STACK_PUSH4(fn_0, fn_1, fn_2, fn_3)  u6a_vm_stack_push4(&stack_ctx, fn_0, fn_1, fn_2, fn_3)
-#define STACK_XCH(fn_0)                      u6a_vm_stack_xch(&stack_ctx, fn_0)
+// Applications made by the `la` at 0x03 return into the `la` at 0x04, which pops the caller's own return frame
+#define VM_TAIL_POS      ( ins - text == 0x03 )
+
+// Functions of the flat stack are chosen at compile time, as `flat` is constant in each instance of vm_execute()
+#define STACK_FN(name)                       ( flat ? u6a_vm_stack_flat_##name : u6a_vm_stack_##name )
+#define STACK_PUSH1(fn_0)                    STACK_FN(push1)(&stack_ctx, fn_0)
+#define STACK_PUSH2(fn_0, fn_1)              STACK_FN(push2)(&stack_ctx, fn_0, fn_1)
+#define STACK_PUSH3(fn_0, fn_1, fn_2)        STACK_FN(push3)(&stack_ctx, fn_0, fn_1, fn_2)
+#define STACK_PUSH4(fn_0, fn_1, fn_2, fn_3)  STACK_FN(push4)(&stack_ctx, fn_0, fn_1, fn_2, fn_3)
+#define STACK_PUSH_RET1(fn_0)                          \
+    if (VM_TAIL_POS) {                                 \
+        STACK_PUSH1(fn_0);                             \
+    } else {                                           \
+        STACK_PUSH2(VM_VAR_JMP, fn_0);                 \
+    }
+#define STACK_PUSH_RET2(fn_0, fn_1)                    \
+    if (VM_TAIL_POS) {                                 \
+        STACK_PUSH2(fn_0, fn_1);                       \
+    } else {                                           \
+        STACK_PUSH3(VM_VAR_JMP, fn_0, fn_1);           \
+    }
+#define STACK_PUSH_RET3(fn_0, fn_1, fn_2)              \
+    if (VM_TAIL_POS) {                                 \
+        STACK_PUSH3(fn_0, fn_1, fn_2);                 \
+    } else {                                           \
+        STACK_PUSH4(VM_VAR_JMP, fn_0, fn_1, fn_2);     \
+    }
+#define STACK_XCH(fn_0)                      STACK_FN(xch)(&stack_ctx, fn_0)
 #define STACK_POP(var)                         \
     vm_var_fn_free(top);                       \
-    var = top = u6a_vm_stack_top(&stack_ctx);  \
-    u6a_vm_stack_pop(&stack_ctx)
+    var = top = STACK_FN(top)(&stack_ctx);     \
+    STACK_FN(pop)(&stack_ctx)
 
-#define POOL_ALLOC1(v1)             u6a_vm_pool_alloc1(&pool_ctx, v1)
-#define POOL_ALLOC2(v1, v2)         u6a_vm_pool_alloc2(&pool_ctx, v1, v2)
+#define POOL_ALLOC1(v1)             pool_alloc1(purity, v1)
+#define POOL_ALLOC2(v1, v2)         pool_alloc2(purity, v1, v2)
 #define POOL_ALLOC2_PTR(v1, v2)     u6a_vm_pool_alloc2_ptr(&pool_ctx, v1, v2)
 #define POOL_GET1(offset)           u6a_vm_pool_get1(pool_ctx.active_pool, offset)
 #define POOL_GET2(offset)           u6a_vm_pool_get2(pool_ctx.active_pool, offset)
 #define POOL_GET2_SEPARATE(offset)  u6a_vm_pool_get2_separate(&pool_ctx, offset)
+#define POOL_FORWARD(var)           var = u6a_vm_pool_forward(&pool_ctx, var)
+#define POOL_PREFETCH(var)          u6a_vm_pool_prefetch(pool_ctx.active_pool, var)
+#define POOL_TAG(var)                                                                      \
+    pool_ctx.tags[(var).ref] = (struct u6a_vm_pool_tag) { .site = ins - text, .kind = (var).token.fn }
 
-static inline bool
-read_bc_header(struct u6a_bc_header* restrict header, FILE* restrict input_stream) {
-    int ch;
-    do {
-        ch = fgetc(input_stream);
-        if (UNLIKELY(ch == EOF)) {
-            return false;
-        }
-    } while (ch != U6A_MAGIC);
-    if (UNLIKELY(ch != ungetc(ch, input_stream))) {
-        return false;
-    }
-    if (UNLIKELY(1 != fread(&header->file, U6A_BC_FILE_HEADER_SIZE, 1, input_stream))) {
+static bool
+read_dense_text(FILE* restrict input_stream, uint32_t size) {
+    uint8_t* buffer = malloc(size);
+    if (UNLIKELY(buffer == NULL)) {
+        u6a_err_bad_alloc(err_runtime, size);
         return false;
     }
-    if (LIKELY(header->file.prog_header_size >= U6A_BC_FILE_HEADER_SIZE)) {
-        return 1 == fread(&header->prog, header->file.prog_header_size, 1, input_stream);
+    bool result = false;
+    if (LIKELY(size == fread(buffer, sizeof(uint8_t), size, input_stream))) {
+        text_len = u6a_bc_dense_decode(buffer, size, text + text_subst_len);
+        result = text_len != UINT32_MAX;
     }
-    return true;
+    free(buffer);
+    return result;
 }
 
 static inline struct u6a_vm_var_fn
@@ -121,18 +247,360 @@ vm_var_fn_free(struct u6a_vm_var_fn var) {
     }
 }
 
+// Whether applying `var` is free of side effects, so that the result may be memoized
+static inline bool
+vm_var_fn_pure(struct u6a_vm_var_fn var) {
+    switch (var.token.fn) {
+        case u6a_vf_k:
+        case u6a_vf_s:
+        case u6a_vf_i:
+        case u6a_vf_v:
+        case u6a_vf_n:
+            return true;
+        case u6a_vf_k1_i:
+        case u6a_vf_s1_i:
+            return var.captured.fn == u6a_vf_k || var.captured.fn == u6a_vf_s || var.captured.fn == u6a_vf_i
+                || var.captured.fn == u6a_vf_v;
+        case u6a_vf_k1:
+        case u6a_vf_s1:
+        case u6a_vf_s2:
+        case u6a_vf_n1:
+            return pool_ctx.active_pool->refcnts[var.ref] & U6A_VM_POOL_ELEM_PURE;
+        default:
+            // Including `.X`, `@`, `c`, `d`, `e` and whatever captures them
+            return false;
+    }
+}
+
+// Closures are marked pure when memoizing or evaluating in parallel, if what they capture is pure
+static inline uint32_t
+pool_alloc1(bool purity, struct u6a_vm_var_fn v1) {
+    return u6a_vm_pool_alloc1(&pool_ctx, v1, purity && vm_var_fn_pure(v1) ? U6A_VM_POOL_ELEM_PURE : 0);
+}
+
+static inline uint32_t
+pool_alloc2(bool purity, struct u6a_vm_var_fn v1, struct u6a_vm_var_fn v2) {
+    return u6a_vm_pool_alloc2(&pool_ctx, v1, v2,
+        purity && vm_var_fn_pure(v1) && vm_var_fn_pure(v2) ? U6A_VM_POOL_ELEM_PURE : 0);
+}
+
+// Hand the application over to an idle worker, returns NULL if it is to be made here instead
+static struct u6a_parallel_worker*
+task_fork(struct u6a_vm_var_fn func, struct u6a_vm_var_fn arg) {
+    struct u6a_parallel_worker* worker = u6a_parallel_claim();
+    if (worker == NULL) {
+        return NULL;
+    }
+    u6a_vm_pool_map_clear(&worker->origins);
+    worker->func = u6a_vm_pool_copy(worker->pool_ctx, &pool_ctx, func, &copier, &worker->origins);
+    worker->arg = u6a_vm_pool_copy(worker->pool_ctx, &pool_ctx, arg, &copier, &worker->origins);
+    if (UNLIKELY(U6A_VM_VAR_FN_IS_EMPTY(worker->func) || U6A_VM_VAR_FN_IS_EMPTY(worker->arg))) {
+        u6a_parallel_release(worker);
+        return NULL;
+    }
+    u6a_parallel_start(worker);
+    return worker;
+}
+
+// Wait for the worker, and copy its result into the pool, returns an empty value if it is to be made here instead.
+// What the result shares with the application is not copied, as the original is kept alive by the `t` function.
+static struct u6a_vm_var_fn
+task_join(uint32_t index) {
+    struct u6a_parallel_worker* worker = u6a_parallel_get(index);
+    struct u6a_vm_var_fn result = U6A_VM_VAR_FN_EMPTY;
+    if (LIKELY(u6a_parallel_join(worker))) {
+        result = u6a_vm_pool_copy_back(&pool_ctx, worker->pool_ctx, worker->result, &copier, &worker->origins);
+        ins_count += worker->ins_count;
+    }
+    u6a_parallel_release(worker);
+    return result;
+}
+
+// Whether `var` is a numeral, either a native one, or `ki or i (zero or one) in combinator form
+static inline bool
+church_num(struct u6a_vm_var_fn var, uint32_t* num) {
+    if (var.token.fn == u6a_vf_n) {
+        *num = var.ref;
+    } else if (var.token.fn == u6a_vf_i) {
+        *num = 1;
+    } else if (var.token.fn == u6a_vf_k1_i && var.captured.fn == u6a_vf_i) {
+        *num = 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Whether `var` is ``s`ksk, so that `` ``s``s`kskN `` is the successor of numeral N
+static inline bool
+church_succ_core(struct u6a_vm_var_fn var) {
+    if (var.token.fn != u6a_vf_s2) {
+        return false;
+    }
+    struct u6a_vm_var_tuple tuple = POOL_GET2(var.ref);
+    return tuple.v1.fn.token.fn == u6a_vf_k1_i && tuple.v1.fn.captured.fn == u6a_vf_s
+        && tuple.v2.fn.token.fn == u6a_vf_k;
+}
+
+static inline bool
+church_pow(uint32_t base, uint32_t exp, uint32_t* result) {
+    uint64_t pow = 1;
+    if (base <= 1) {
+        *result = base;
+        return true;
+    }
+    while (exp--) {
+        pow *= base;
+        if (pow > UINT32_MAX) {
+            return false;
+        }
+    }
+    *result = pow;
+    return true;
+}
+
+static bool
+save_snapshot(struct u6a_vm_ins* ins, struct u6a_vm_var_fn acc, struct u6a_vm_var_fn top, struct u6a_vm_var_fn func,
+              struct u6a_vm_var_fn arg, int current_char)
+{
+    struct u6a_vm_snapshot snapshot = {
+        .text       = text,
+        .text_len   = text_subst_len + text_len,
+        .rodata     = rodata,
+        .rodata_len = rodata_len,
+        .regs       = {
+            .ins          = ins - text,
+            .current_char = current_char,
+            .acc          = acc,
+            .top          = top,
+            .func         = func,
+            .arg          = arg
+        }
+    };
+    const char* file_name = snapshot_file;
+    // Only the first input is of interest
+    snapshot_file = NULL;
+    if (UNLIKELY(!u6a_vm_snapshot_save(file_name, &snapshot, &stack_ctx, &pool_ctx, err_runtime))) {
+        return false;
+    }
+    u6a_info_verbose(info_runtime, "snapshot written to %s", file_name);
+    return true;
+}
+
+static bool
+vm_init(struct u6a_vm_stack_ctx* vm_stack_ctx, struct u6a_vm_pool_ctx* vm_pool_ctx, bool flat) {
+    // Segmented stacks are used where a flat one is not supported
+#ifdef U6A_VM_STACK_FLAT_SUPPORTED
+    flat = flat && u6a_vm_stack_init_flat(vm_stack_ctx, &jmp_ctx, &flat_fault_ctx, err_runtime);
+#else
+    flat = false;
+#endif
+    if (!flat && UNLIKELY(!u6a_vm_stack_init(vm_stack_ctx, stack_seg_len, huge_pages, &jmp_ctx, err_runtime)))
+    {
+        return false;
+    }
+    if (UNLIKELY(!u6a_vm_pool_init(vm_pool_ctx, pool_len, nursery_len, text_len, pool_policy, huge_pages, &jmp_ctx,
+                                   err_runtime))) {
+        u6a_vm_stack_free_all(vm_stack_ctx);
+        return false;
+    }
+    // Contexts of a VM always refer to each other by the instances used by the interpreter
+    vm_stack_ctx->pool_ctx = &pool_ctx;
+    vm_pool_ctx->stack_ctx = &stack_ctx;
+    return true;
+}
+
+static struct u6a_vm_var_fn
+vm_execute_worker();
+
+static struct u6a_vm_pool_ctx*
+worker_init(struct u6a_parallel_worker* worker) {
+    (void)worker;
+    if (UNLIKELY(!vm_init(&stack_ctx, &pool_ctx, false))) {
+        return NULL;
+    }
+    // Samples and metrics are only taken of the main VM
+    sample_next = UINT64_MAX;
+    // Failed applications are made again by the claimer, which reports the error if it fails likewise
+    u6a_logging_quiet(true);
+    return &pool_ctx;
+}
+
+static bool
+worker_run(struct u6a_parallel_worker* worker) {
+    if (setjmp(jmp_ctx)) {
+        worker->result = U6A_VM_VAR_FN_EMPTY;
+        return false;
+    }
+    ins_count = 0;
+    // Copies of elements of the claimer's pool are kept alive, so that they can be told apart in the result
+    vm_var_fn_addref(worker->func);
+    vm_var_fn_addref(worker->arg);
+    // The application is made in tail position, returning into `e`
+    u6a_vm_stack_push1(&stack_ctx, U6A_VM_VAR_FN_REF(u6a_vf_e, 0));
+    resume_regs = (struct u6a_vm_snapshot_regs) {
+        .ins          = 0x03,
+        .current_char = EOF,
+        .func         = worker->func,
+        .arg          = worker->arg
+    };
+    resuming = true;
+    worker->result = vm_execute_worker();
+    worker->ins_count = ins_count;
+    return !U6A_VM_VAR_FN_IS_EMPTY(worker->result);
+}
+
+static bool
+worker_reset(struct u6a_parallel_worker* worker) {
+    // Whatever is left in the pool is no longer referred to, including what leaked
+    u6a_vm_pool_reset(&pool_ctx);
+    if (LIKELY(!U6A_VM_VAR_FN_IS_EMPTY(worker->result))) {
+        return true;
+    }
+    // Frames left on the stack by a failed application are discarded
+    u6a_vm_stack_free_all(&stack_ctx);
+    if (UNLIKELY(!u6a_vm_stack_init(&stack_ctx, stack_seg_len, huge_pages, &jmp_ctx, err_runtime))) {
+        return false;
+    }
+    stack_ctx.pool_ctx = &pool_ctx;
+    return true;
+}
+
+static bool
+parallel_init() {
+    if (!num_workers) {
+        return true;
+    }
+    if (UNLIKELY(!u6a_parallel_init(num_workers, worker_init, worker_run, worker_reset, err_runtime))) {
+        return false;
+    }
+    u6a_info_verbose(info_runtime, "parallel evaluation: %" PRIu32 " worker threads", num_workers);
+    return true;
+}
+
+static bool
+memo_init() {
+    if (!memo_size) {
+        return true;
+    }
+    if (UNLIKELY(!u6a_memo_init(&memo_ctx, memo_size, &pool_ctx, err_runtime))) {
+        return false;
+    }
+    u6a_info_verbose(info_runtime, "memo table: %" PRIu32 " entries", ( memo_ctx.set_mask + 1 ) * U6A_MEMO_WAYS);
+    return true;
+}
+
+static bool
+heap_profile_init() {
+    if (!heap_profile) {
+        return true;
+    }
+    pool_ctx.tags = calloc(pool_ctx.pool_len, sizeof(struct u6a_vm_pool_tag));
+    if (UNLIKELY(pool_ctx.tags == NULL)) {
+        u6a_err_bad_alloc(err_runtime, pool_ctx.pool_len * sizeof(struct u6a_vm_pool_tag));
+        return false;
+    }
+    return true;
+}
+
+static inline void
+vm_sample_schedule() {
+    sample_next = trace_next < heap_next ? trace_next : heap_next;
+}
+
+static void
+vm_metrics_write() {
+    struct u6a_metrics snapshot = {
+        .ins_counted    = count_ins || instrument,
+        .ins_count      = ins_count,
+        .allocs         = u6a_vm_pool_allocs(&pool_ctx),
+        .pool_len       = pool_ctx.pool_len,
+        .stack_segments = u6a_vm_stack_num_segments(&stack_ctx),
+        .bytes_written  = bytes_written,
+        .bytes_read     = bytes_read
+    };
+    u6a_vm_pool_count(&pool_ctx, &snapshot.live_elems, &snapshot.conts);
+    snapshot.frees = snapshot.allocs - snapshot.live_elems;
+    u6a_metrics_write(&snapshot);
+}
+
+static U6A_INLINE_NEVER void
+vm_sample(uint32_t offset) {
+    if (ins_count >= trace_next) {
+        trace_next += trace_interval;
+        u6a_trace_sample(&stack_ctx, offset, text_subst_len, ins_count);
+    }
+    if (ins_count >= heap_next) {
+        heap_next += heap_interval;
+        u6a_heap_profile_snapshot(&pool_ctx, text_subst_len, ins_count, "interval");
+    }
+    vm_sample_schedule();
+}
+
+static bool
+verify_program(uint32_t unused) {
+    verified = u6a_vm_verify(text + text_subst_len, text_len, rodata, rodata_len, unused, err_runtime);
+    if (LIKELY(verified)) {
+        u6a_info_verbose(info_runtime, "bytecode verified, %" PRIu32 " instructions", text_len);
+        // Features which the program never uses are left out of the interpreter
+        unused_features = unused;
+        return true;
+    }
+    // With -f, run anyway, ignoring what the checks find during execution
+    return force_exec;
+}
+
+static bool
+init_from_snapshot(struct u6a_runtime_options* options) {
+    struct u6a_vm_snapshot snapshot;
+    if (UNLIKELY(!u6a_vm_snapshot_load(options->file_name, &snapshot, &stack_ctx, &pool_ctx, options->huge_pages,
+                                       &jmp_ctx, err_runtime)))
+    {
+        return false;
+    }
+    text = snapshot.text;
+    text_len = snapshot.text_len - text_subst_len;
+    rodata = snapshot.rodata;
+    rodata_len = snapshot.rodata_len;
+    resume_regs = snapshot.regs;
+    resuming = true;
+    if (metrics) {
+        // Elements alive when resuming count as allocated, so that none seem to be freed yet
+        uint32_t live, conts;
+        u6a_vm_pool_count(&pool_ctx, &live, &conts);
+        pool_ctx.allocs = (uint64_t)live - (uint32_t)( pool_ctx.nursery_pos + 1 );
+    }
+    if (UNLIKELY(!verify_program(0) || !heap_profile_init() || !memo_init())) {
+        return false;
+    }
+    u6a_info_verbose(info_runtime, "resuming from snapshot %s, object pool using %s", options->file_name,
+        u6a_vm_mem_mode_name(pool_ctx.mem_mode));
+    return true;
+}
+
 bool
 u6a_runtime_info(FILE* restrict input_stream, const char* file_name) {
     struct u6a_bc_header header;
-    if (UNLIKELY(!read_bc_header(&header, input_stream))) {
+    if (UNLIKELY(!u6a_bc_read_header(&header, input_stream))) {
         u6a_err_invalid_bc_file(err_runtime, file_name);
         return false;
     }
     printf("Version: %d.%d.*\n", header.file.ver_major, header.file.ver_minor);
-    if (LIKELY(CHECK_BC_HEADER_VER(header.file))) {
-        if (LIKELY(header.file.prog_header_size == U6A_BC_PROG_HEADER_SIZE)) {
+    if (LIKELY(U6A_BC_CHECK_VER(header.file))) {
+        if (LIKELY(header.file.prog_header_size == U6A_BC_PROG_HEADER_SIZE
+                   || header.file.prog_header_size == U6A_BC_PROG_HEADER_MIN_SIZE))
+        {
             printf("Size of section .text   (bytes): %" PRIu32 "\n", ntohl(header.prog.text_size));
             printf("Size of section .rodata (bytes): %" PRIu32 "\n", ntohl(header.prog.rodata_size));
+            const uint32_t flags = ntohl(header.prog.flags);
+            printf("Type                           : %s\n", flags & U6A_BC_FLAG_MODULE ? "module" : "program");
+            printf("Encoding of section .text      : %s\n", flags & U6A_BC_FLAG_DENSE_TEXT ? "dense" : "fixed");
+            printf("Continuations (c)              : %s\n",
+                flags & U6A_BC_FLAG_NO_CONT ? "not used" : "may be used");
+            printf("Promises (d)                   : %s\n",
+                flags & U6A_BC_FLAG_NO_PROMISE ? "not used" : "may be used");
+            printf("Input (@, ?X and |)            : %s\n",
+                flags & U6A_BC_FLAG_NO_INPUT ? "not used" : "may be used");
         } else {
             printf("Program header unrecognizable (%d bytes)\n", header.file.prog_header_size);
         }
@@ -140,14 +608,15 @@ u6a_runtime_info(FILE* restrict input_stream, const char* file_name) {
     return true;
 }
 
-bool
-u6a_runtime_init(struct u6a_runtime_options* options) {
+// Read the program from a bytecode file. Buffers allocated are freed by u6a_runtime_destroy(), even on failure.
+static bool
+load_bc(struct u6a_runtime_options* options, uint32_t* flags) {
     struct u6a_bc_header header;
-    if (UNLIKELY(!read_bc_header(&header, options->istream))) {
+    if (UNLIKELY(!u6a_bc_read_header(&header, options->istream))) {
         u6a_err_invalid_bc_file(err_runtime, options->file_name);
         return false;
     }
-    if (UNLIKELY(!CHECK_BC_HEADER_VER(header.file))) {
+    if (UNLIKELY(!U6A_BC_CHECK_VER(header.file))) {
         if (!options->force_exec || header.file.prog_header_size != U6A_BC_FILE_HEADER_SIZE) {
             u6a_err_bad_bc_ver(err_runtime, options->file_name, header.file.ver_major, header.file.ver_minor);
             return false;
@@ -155,40 +624,159 @@ u6a_runtime_init(struct u6a_runtime_options* options) {
     }
     header.prog.text_size = ntohl(header.prog.text_size);
     header.prog.rodata_size = ntohl(header.prog.rodata_size);
-    text = malloc(header.prog.text_size + sizeof(text_subst));
+    header.prog.flags = ntohl(header.prog.flags);
+    if (UNLIKELY(header.prog.flags & U6A_BC_FLAG_MODULE)) {
+        // Never applies `e`, so execution would run off the end of .text, even with -f
+        u6a_err_module_not_linked(err_runtime, options->file_name);
+        return false;
+    }
+    const bool dense_text = header.prog.flags & U6A_BC_FLAG_DENSE_TEXT;
+    // Every densely encoded instruction takes at least one byte
+    text_len = dense_text ? header.prog.text_size : header.prog.text_size / sizeof(struct u6a_vm_ins);
+    const size_t text_size = (size_t)text_len * sizeof(struct u6a_vm_ins) + sizeof(text_subst);
+    text = malloc(text_size);
     if (UNLIKELY(text == NULL)) {
-        u6a_err_bad_alloc(err_runtime, header.prog.text_size + sizeof(text_subst));
+        u6a_err_bad_alloc(err_runtime, text_size);
         return false;
     }
-    text_len = header.prog.text_size / sizeof(struct u6a_vm_ins);
     rodata = malloc(header.prog.rodata_size);
     if (UNLIKELY(rodata == NULL)) {
         u6a_err_bad_alloc(err_runtime, header.prog.rodata_size);
-        free(text);
         return false;
     }
     rodata_len = header.prog.rodata_size / sizeof(char);
     memcpy(text, text_subst, sizeof(text_subst));
-    if (UNLIKELY(text_len != fread(text + text_subst_len, sizeof(struct u6a_vm_ins), text_len, options->istream))) {
-        goto runtime_init_failed;
+    if (dense_text) {
+        if (UNLIKELY(!read_dense_text(options->istream, header.prog.text_size))) {
+            u6a_err_invalid_bc_file(err_runtime, options->file_name);
+            return false;
+        }
+        // Give back the space reserved for the worst case
+        struct u6a_vm_ins* shrunk_text = realloc(text, (text_len + text_subst_len) * sizeof(struct u6a_vm_ins));
+        if (LIKELY(shrunk_text)) {
+            text = shrunk_text;
+        }
+    } else {
+        if (UNLIKELY(text_len != fread(text + text_subst_len, sizeof(struct u6a_vm_ins), text_len,
+                                       options->istream)))
+        {
+            return false;
+        }
+        for (struct u6a_vm_ins* ins = text + text_subst_len; ins < text + text_subst_len + text_len; ++ins) {
+            if (ins->opcode & U6A_VM_OP_OFFSET) {
+                ins->operand.offset = ntohl(ins->operand.offset);
+            }
+        }
     }
     if (UNLIKELY(rodata_len != fread(rodata, sizeof(char), rodata_len, options->istream))) {
+        return false;
+    }
+    *flags = header.prog.flags;
+    return true;
+}
+
+// Compile the program from Unlambda source, as `u6ac` would do, straight into memory
+static bool
+load_source(struct u6a_runtime_options* options, uint32_t* flags) {
+    struct u6a_token* token_arr = NULL;
+    struct u6a_ast_node* ast_arr = NULL;
+    uint32_t token_len;
+    struct u6a_codegen_program program = { .text_reserved = text_subst_len };
+    const struct u6a_codegen_options codegen = {
+        .file_name      = options->file_name,
+        .optimize_const = true,
+        .program        = &program
+    };
+    const bool compiled = u6a_lex(options->istream, &token_arr, &token_len)
+        && u6a_parse(token_arr, token_len, &ast_arr) && u6a_codegen(&codegen, ast_arr, token_len + 2);
+    free(token_arr);
+    free(ast_arr);
+    if (UNLIKELY(!compiled)) {
+        return false;
+    }
+    text = program.text;
+    text_len = program.text_len;
+    rodata = program.rodata;
+    rodata_len = program.rodata_len;
+    memcpy(text, text_subst, sizeof(text_subst));
+    *flags = program.flags;
+    return true;
+}
+
+bool
+u6a_runtime_init(struct u6a_runtime_options* options) {
+    force_exec = options->force_exec;
+    church_numerals = options->church_numerals;
+    memo_size = options->memo_size;
+    num_workers = options->parallel_workers;
+    count_ins = options->count_ins;
+    instrument = options->trace_interval || options->heap_profile || memo_size || num_workers;
+    trace_interval = options->trace_interval;
+    trace_next = trace_interval ? trace_interval : UINT64_MAX;
+    heap_profile = options->heap_profile;
+    heap_interval = options->heap_profile_interval;
+    heap_next = heap_profile && heap_interval ? heap_interval : UINT64_MAX;
+    metrics = options->metrics;
+    vm_sample_schedule();
+    snapshot_file = options->snapshot_file;
+    if (options->from_snapshot) {
+        return init_from_snapshot(options);
+    }
+    uint32_t flags;
+    if (UNLIKELY(!( options->source ? load_source(options, &flags) : load_bc(options, &flags) ))) {
         goto runtime_init_failed;
     }
-    if (UNLIKELY(!u6a_vm_stack_init(&stack_ctx, options->stack_segment_size, &jmp_ctx, err_runtime))) {
+    if (UNLIKELY(!verify_program(flags & U6A_BC_FLAGS_NO_FEATURE))) {
         goto runtime_init_failed;
     }
-    if (UNLIKELY(!u6a_vm_pool_init(&pool_ctx, options->pool_size, text_len, &jmp_ctx, err_runtime))) {
+    stack_seg_len = options->stack_segment_size;
+    pool_len = options->pool_size;
+    nursery_len = options->nursery_size;
+    huge_pages = options->huge_pages;
+    pool_policy = options->pool_policy;
+    if (options->multiplex) {
+        // VMs are created on demand by u6a_runtime_vm_create(), each with a segmented stack
+        unused_features &= ~U6A_BC_FLAG_NO_CONT;
+        return true;
+    }
+    // Without continuations, the stack is never shared, and it needs no segments unless saved to a snapshot
+    const bool flat = ( unused_features & U6A_BC_FLAG_NO_CONT ) && !snapshot_file;
+    if (UNLIKELY(!vm_init(&stack_ctx, &pool_ctx, flat) || !heap_profile_init() || !memo_init()
+                 || !parallel_init())) {
         goto runtime_init_failed;
     }
-    stack_ctx.pool_ctx = &pool_ctx;
-    pool_ctx.stack_ctx = &stack_ctx;
-    for (struct u6a_vm_ins* ins = text + text_subst_len; ins < text + text_len; ++ins) {
-        if (ins->opcode & U6A_VM_OP_OFFSET) {
-            ins->operand.offset = ntohl(ins->operand.offset);
+    // Instances of the interpreter without continuations are those which run on the flat stack
+    if (stack_ctx.flat_base == NULL) {
+        unused_features &= ~U6A_BC_FLAG_NO_CONT;
+    }
+    u6a_info_verbose(info_runtime, "object pool: %zu bytes, using %s, reusing the %s hole first", pool_ctx.mem_size,
+        u6a_vm_mem_mode_name(pool_ctx.mem_mode), u6a_vm_pool_policy_name(pool_ctx.policy));
+    if (pool_ctx.nursery_len) {
+        u6a_info_verbose(info_runtime, "nursery: %" PRIu32 " elements", pool_ctx.nursery_len);
+    }
+    if (stack_ctx.flat_base) {
+        u6a_info_verbose(info_runtime, "flat stack: %zu bytes reserved", U6A_VM_STACK_FLAT_SIZE);
+    } else if (options->huge_pages) {
+        u6a_info_verbose(info_runtime, "stack segment slab: %zu bytes, using %s", stack_ctx.slab_size,
+            u6a_vm_mem_mode_name(stack_ctx.slab_mode));
+    }
+    if (unused_features) {
+        static const struct { uint32_t flag; const char* name; } features[] = {
+            { U6A_BC_FLAG_NO_CONT,    "continuations" },
+            { U6A_BC_FLAG_NO_PROMISE, "promises"      },
+            { U6A_BC_FLAG_NO_INPUT,   "input"         }
+        };
+        char names[sizeof("continuations, promises, input")] = "";
+        for (uint32_t idx = 0; idx < sizeof(features) / sizeof(features[0]); ++idx) {
+            if (unused_features & features[idx].flag) {
+                if (names[0]) {
+                    strcat(names, ", ");
+                }
+                strcat(names, features[idx].name);
+            }
         }
+        u6a_info_verbose(info_runtime, "interpreter specialized without %s", names);
     }
-    force_exec = options->force_exec;
     return true;
 
     runtime_init_failed:
@@ -196,17 +784,57 @@ u6a_runtime_init(struct u6a_runtime_options* options) {
     return false;
 }
 
-U6A_HOT struct u6a_vm_var_fn
-u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
+// Instantiated with run-time checks compiled out for programs which passed verification,
+// with instruction counting compiled in only when requested, and sampling, heap tagging, memoization
+// and parallel evaluation only into the `instrumented` instances, which count instructions as well,
+// and with the `unused` features (U6A_BC_FLAG_NO_*) of verified programs compiled out
+static U6A_INLINE_ALWAYS struct u6a_vm_var_fn
+vm_execute(FILE* restrict istream, FILE* restrict ostream, const bool checked, const bool counted,
+           const bool instrumented, const uint32_t unused)
+{
+    // Without continuations, the stack is flat
+    const bool flat = unused & U6A_BC_FLAG_NO_CONT;
+    const bool memo = instrumented && memo_size;
+    const bool parallel = instrumented && num_workers;
+    const bool purity = memo || parallel;
     struct u6a_vm_var_fn acc = { 0 }, top = { 0 }, func = { 0 }, arg = { 0 };
     struct u6a_vm_ins* ins = text + text_subst_len;
     int current_char = EOF;
     struct u6a_vm_var_tuple tuple;
     void* cont;
-    if (setjmp(jmp_ctx)) {
-        goto runtime_error;
+    uint32_t num;
+    struct u6a_parallel_worker* worker;
+    if (resuming) {
+        // Continue with the application interrupted by the snapshot
+        resuming = false;
+        ins = text + resume_regs.ins;
+        current_char = resume_regs.current_char;
+        acc = resume_regs.acc;
+        top = resume_regs.top;
+        func = resume_regs.func;
+        arg = resume_regs.arg;
+        goto do_apply;
     }
     while (true) {
+        if (counted) {
+            ++ins_count;
+            if (instrumented && UNLIKELY(ins_count >= sample_next)) {
+                vm_sample(ins - text);
+            }
+        }
+        if (UNLIKELY(pool_ctx.nursery_full)) {
+            // Safe point: `acc` and `top` are the only references held outside the pool and stacks.
+            // Also requested by the metrics timer, so that the loop itself never checks the clock.
+            u6a_vm_pool_evacuate(&pool_ctx);
+            POOL_FORWARD(acc);
+            POOL_FORWARD(top);
+            if (memo) {
+                u6a_memo_forward(&memo_ctx);
+            }
+            if (UNLIKELY(metrics) && u6a_metrics_due()) {
+                vm_metrics_write();
+            }
+        }
         switch (ins->opcode) {
             case u6a_vo_app:
                 if (ins->operand.fn.first.fn) {
@@ -228,30 +856,56 @@ u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
                 do_apply:
                 switch (func.token.fn) {
                     case u6a_vf_s:
-                        ACC_FN_REF(u6a_vf_s1, POOL_ALLOC1(vm_var_fn_addref(arg)));
+                        ACC_FN_CAPTURE(u6a_vf_s1_i, u6a_vf_s1, arg);
                         break;
                     case u6a_vf_s1:
+                        if (UNLIKELY(church_numerals) && church_num(arg, &num) && num != UINT32_MAX
+                            && church_succ_core(POOL_GET1(func.ref).fn))
+                        {
+                            acc = U6A_VM_VAR_FN_REF(u6a_vf_n, num + 1);
+                            break;
+                        }
                         vm_var_fn_addref(arg);
                         ACC_FN_REF(u6a_vf_s2, POOL_ALLOC2(vm_var_fn_addref(POOL_GET1(func.ref).fn), arg));
                         break;
+                    case u6a_vf_s1_i:
+                        vm_var_fn_addref(arg);
+                        ACC_FN_REF(u6a_vf_s2, POOL_ALLOC2(U6A_VM_VAR_FN_CAPTURED(func), arg));
+                        break;
                     case u6a_vf_s2:
+                        MEMO_APPLY(apply_s2);
+                        apply_s2:
                         tuple = POOL_GET2(func.ref);
+                        if (parallel && UNLIKELY(u6a_parallel_ready()) && vm_var_fn_pure(func) && vm_var_fn_pure(arg)
+                            && ( worker = task_fork(tuple.v2.fn, arg) ))
+                        {
+                            // Y is applied to Z by the worker while X is applied here, and then `t` joins it
+                            POOL_PREFETCH(tuple.v1.fn);
+                            vm_var_fn_addref(tuple.v1.fn);
+                            vm_var_fn_addref(arg);
+                            ACC_FN_REF(u6a_vf_t, POOL_ALLOC2(vm_var_fn_addref(tuple.v2.fn),
+                                                            U6A_VM_VAR_FN_REF(0, worker->index)));
+                            STACK_PUSH_RET3(arg, acc, tuple.v1.fn);
+                            acc = arg;
+                            VM_JMP(0x00);
+                        }
+                        // X is applied first, once the prelude pops it
+                        POOL_PREFETCH(tuple.v1.fn);
                         vm_var_fn_addref(tuple.v1.fn);
                         vm_var_fn_addref(tuple.v2.fn);
                         vm_var_fn_addref(arg);
-                        // Tail call elimination
-                        if (ins - text == 0x03) {
-                            STACK_PUSH3(arg, tuple.v2.fn, tuple.v1.fn);
-                        } else {
-                            STACK_PUSH4(VM_VAR_JMP, arg, tuple.v2.fn, tuple.v1.fn);
-                        }
+                        STACK_PUSH_RET3(arg, tuple.v2.fn, tuple.v1.fn);
                         acc = arg;
                         VM_JMP(0x00);
                     case u6a_vf_k:
-                        ACC_FN_REF(u6a_vf_k1, POOL_ALLOC1(vm_var_fn_addref(arg)));
+                        ACC_FN_CAPTURE(u6a_vf_k1_i, u6a_vf_k1, arg);
                         break;
                     case u6a_vf_k1:
                         acc = vm_var_fn_addref(POOL_GET1(func.ref).fn);
+                        POOL_PREFETCH(acc);
+                        break;
+                    case u6a_vf_k1_i:
+                        acc = U6A_VM_VAR_FN_CAPTURED(func);
                         break;
                     case u6a_vf_i:
                         acc = arg;
@@ -259,6 +913,9 @@ u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
                     case u6a_vf_out:
                         acc = arg;
                         fputc(func.token.ch, ostream);
+                        if (UNLIKELY(metrics)) {
+                            ++bytes_written;
+                        }
                         break;
                     case u6a_vf_j:
                         acc = arg;
@@ -267,32 +924,48 @@ u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
                     case u6a_vf_f:
                         ins = text + func.ref;
                         STACK_POP(acc);
-                        STACK_PUSH2(U6A_VM_VAR_FN_REF(u6a_vf_j, func.ref), vm_var_fn_addref(arg));
+                        STACK_PUSH_RET1(vm_var_fn_addref(arg));
                         VM_JMP(0x03);
                     case u6a_vf_c:
+                        FEATURE_USED(U6A_BC_FLAG_NO_CONT);
                         cont = u6a_vm_stack_save(&stack_ctx);
-                        STACK_PUSH2(VM_VAR_JMP, vm_var_fn_addref(arg));
+                        STACK_PUSH_RET1(vm_var_fn_addref(arg));
                         ACC_FN_REF(u6a_vf_c1, POOL_ALLOC2_PTR(cont, ins));
                         VM_JMP(0x03);
                     case u6a_vf_d:
-                        ACC_FN_REF(u6a_vf_d1_c, POOL_ALLOC1(vm_var_fn_addref(arg)));
+                        FEATURE_USED(U6A_BC_FLAG_NO_PROMISE);
+                        ACC_FN_CAPTURE(u6a_vf_d1_i, u6a_vf_d1_c, arg);
                         break;
                     case u6a_vf_c1:
+                        FEATURE_USED(U6A_BC_FLAG_NO_CONT);
                         tuple = POOL_GET2_SEPARATE(func.ref);
+                        if (instrumented && UNLIKELY(trace_interval)) {
+                            u6a_trace_continuation(ins - text, (struct u6a_vm_ins*)tuple.v2.ptr - text);
+                        }
                         u6a_vm_stack_resume(&stack_ctx, tuple.v1.ptr);
                         ins = tuple.v2.ptr;
                         acc = arg;
                         break;
                     case u6a_vf_d1_c:
-                        STACK_PUSH2(VM_VAR_JMP, vm_var_fn_addref(POOL_GET1(func.ref).fn));
+                        FEATURE_USED(U6A_BC_FLAG_NO_PROMISE);
+                        STACK_PUSH_RET1(vm_var_fn_addref(POOL_GET1(func.ref).fn));
+                        acc = arg;
+                        VM_JMP(0x03);
+                    case u6a_vf_d1_i:
+                        FEATURE_USED(U6A_BC_FLAG_NO_PROMISE);
+                        // The compound literal is unpacked first, as its commas would split the macro arguments
+                        func = U6A_VM_VAR_FN_CAPTURED(func);
+                        STACK_PUSH_RET1(func);
                         acc = arg;
                         VM_JMP(0x03);
                     case u6a_vf_d1_s:
+                        FEATURE_USED(U6A_BC_FLAG_NO_PROMISE);
                         tuple = POOL_GET2(func.ref);
                         STACK_PUSH3(vm_var_fn_addref(arg), VM_VAR_FINALIZE, vm_var_fn_addref(tuple.v1.fn));
                         acc = tuple.v2.fn;
                         VM_JMP(0x03);
                     case u6a_vf_d1_d:
+                        FEATURE_USED(U6A_BC_FLAG_NO_PROMISE);
                         STACK_PUSH2(vm_var_fn_addref(arg), VM_VAR_FINALIZE);
                         VM_JMP(func.ref);
                     case u6a_vf_v:
@@ -301,10 +974,30 @@ u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
                     case u6a_vf_p:
                         acc = arg;
                         fputs(rodata + func.ref, ostream);
+                        if (UNLIKELY(metrics)) {
+                            bytes_written += strlen(rodata + func.ref);
+                        }
                         break;
                     case u6a_vf_in:
-                        current_char = fgetc(istream);
-                        STACK_PUSH2(VM_VAR_JMP, vm_var_fn_addref(arg));
+                        FEATURE_USED(U6A_BC_FLAG_NO_INPUT);
+                        SNAPSHOT_AT_INPUT();
+                        if (UNLIKELY(current_vm)) {
+                            if (current_vm->input_len) {
+                                current_char = (unsigned char)*current_vm->input++;
+                                --current_vm->input_len;
+                            } else if (current_vm->input_eof) {
+                                current_char = EOF;
+                            } else {
+                                // Retry this application once more input is available
+                                VM_SUSPEND();
+                            }
+                        } else {
+                            current_char = fgetc(istream);
+                        }
+                        if (UNLIKELY(metrics) && current_char != EOF) {
+                            ++bytes_read;
+                        }
+                        STACK_PUSH_RET1(vm_var_fn_addref(arg));
                         if (UNLIKELY(current_char == EOF)) {
                             arg.token.fn = u6a_vf_v;
                         } else {
@@ -313,12 +1006,16 @@ u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
                         acc = arg;
                         VM_JMP(0x03);
                     case u6a_vf_cmp:
-                        STACK_PUSH2(VM_VAR_JMP, vm_var_fn_addref(arg));
+                        FEATURE_USED(U6A_BC_FLAG_NO_INPUT);
+                        SNAPSHOT_AT_INPUT();
+                        STACK_PUSH_RET1(vm_var_fn_addref(arg));
                         arg.token.fn = func.token.ch == current_char ? u6a_vf_i : u6a_vf_v;
                         acc = arg;
                         VM_JMP(0x03);
                     case u6a_vf_pipe:
-                        STACK_PUSH2(VM_VAR_JMP, vm_var_fn_addref(arg));
+                        FEATURE_USED(U6A_BC_FLAG_NO_INPUT);
+                        SNAPSHOT_AT_INPUT();
+                        STACK_PUSH_RET1(vm_var_fn_addref(arg));
                         if (UNLIKELY(current_char == EOF)) {
                             arg.token.fn = u6a_vf_v;
                         } else {
@@ -326,6 +1023,60 @@ u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
                         }
                         acc = arg;
                         VM_JMP(0x03);
+                    case u6a_vf_n:
+                        // As with `ki, zero applications of F leave the identity function
+                        if (func.ref == 0) {
+                            acc = U6A_VM_VAR_FN_REF(u6a_vf_i, 0);
+                            break;
+                        }
+                        vm_var_fn_addref(arg);
+                        ACC_FN_REF(u6a_vf_n1, POOL_ALLOC2(arg, U6A_VM_VAR_FN_REF(u6a_vf_n, func.ref)));
+                        break;
+                    case u6a_vf_n1:
+                        tuple = POOL_GET2(func.ref);
+                        // Applications of the successor add up, and those of numeral M make M to the power of N
+                        if (tuple.v1.fn.token.fn == u6a_vf_s1 && church_num(arg, &num)
+                            && num <= UINT32_MAX - tuple.v2.fn.ref && church_succ_core(POOL_GET1(tuple.v1.fn.ref).fn))
+                        {
+                            acc = U6A_VM_VAR_FN_REF(u6a_vf_n, num + tuple.v2.fn.ref);
+                            break;
+                        }
+                        if (tuple.v1.fn.token.fn == u6a_vf_n && church_pow(tuple.v1.fn.ref, tuple.v2.fn.ref, &num)) {
+                            func = U6A_VM_VAR_FN_REF(u6a_vf_n, num);
+                            goto do_apply;
+                        }
+                        if (tuple.v2.fn.ref == 1) {
+                            func = tuple.v1.fn;
+                            goto do_apply;
+                        }
+                        MEMO_APPLY(apply_n1);
+                        apply_n1:
+                        // F is applied at 0x02, and the remaining applications are made by the `la` at 0x03,
+                        // in the same order as by the combinator form, with no more than two frames on the stack
+                        vm_var_fn_addref(tuple.v1.fn);
+                        ACC_FN_REF(u6a_vf_n1, POOL_ALLOC2(vm_var_fn_addref(tuple.v1.fn),
+                                                         U6A_VM_VAR_FN_REF(u6a_vf_n, tuple.v2.fn.ref - 1)));
+                        STACK_PUSH_RET2(acc, tuple.v1.fn);
+                        acc = arg;
+                        VM_JMP(0x02);
+                    case u6a_vf_m:
+                        // Recorded unless resumed from a snapshot without memoization
+                        if (memo) {
+                            tuple = POOL_GET2(func.ref);
+                            u6a_memo_insert(&memo_ctx, tuple.v1.fn, tuple.v2.fn, arg);
+                        }
+                        acc = arg;
+                        VM_JMP(0x04);
+                    case u6a_vf_t:
+                        tuple = POOL_GET2(func.ref);
+                        acc = task_join(tuple.v2.fn.ref);
+                        if (LIKELY(!U6A_VM_VAR_FN_IS_EMPTY(acc))) {
+                            vm_var_fn_free(arg);
+                            break;
+                        }
+                        // The worker failed, so Y is applied to Z here, which fails likewise unless it ran out of space
+                        func = tuple.v1.fn;
+                        goto do_apply;
                     case u6a_vf_e:
                         // Every program should terminate with explicit `e` function
                         return arg;
@@ -334,13 +1085,13 @@ u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
                 }
                 break;
             case u6a_vo_sa:
-                if (UNLIKELY(acc.token.fn == u6a_vf_d)) {
+                if (!( unused & U6A_BC_FLAG_NO_PROMISE ) && UNLIKELY(acc.token.fn == u6a_vf_d)) {
                     goto delay;
                 }
                 STACK_PUSH1(vm_var_fn_addref(acc));
                 break;
             case u6a_vo_xch:
-                if (UNLIKELY(acc.token.fn == u6a_vf_d)) {
+                if (!( unused & U6A_BC_FLAG_NO_PROMISE ) && UNLIKELY(acc.token.fn == u6a_vf_d)) {
                     STACK_POP(func);
                     vm_var_fn_addref(func);
                     STACK_POP(arg);
@@ -350,6 +1101,7 @@ u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
                 }
                 break;
             case u6a_vo_del:
+                FEATURE_USED(U6A_BC_FLAG_NO_PROMISE);
                 delay:
                 acc = U6A_VM_VAR_FN_REF(u6a_vf_d1_d, ins + 1 - text);
                 VM_JMP(text_subst_len + ins->operand.offset);
@@ -372,8 +1124,185 @@ u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
     return U6A_VM_VAR_FN_EMPTY;
 }
 
+static U6A_HOT U6A_INLINE_NEVER struct u6a_vm_var_fn
+vm_execute_checked(FILE* restrict istream, FILE* restrict ostream) {
+    return vm_execute(istream, ostream, true, false, false, 0);
+}
+
+static U6A_HOT U6A_INLINE_NEVER struct u6a_vm_var_fn
+vm_execute_checked_counted(FILE* restrict istream, FILE* restrict ostream) {
+    return vm_execute(istream, ostream, true, true, false, 0);
+}
+
+static U6A_INLINE_NEVER struct u6a_vm_var_fn
+vm_execute_checked_instrumented(FILE* restrict istream, FILE* restrict ostream) {
+    return vm_execute(istream, ostream, true, true, true, 0);
+}
+
+#define VM_EXECUTE_UNCHECKED(name, attr, counted, instrumented, unused)            \
+    static attr U6A_INLINE_NEVER struct u6a_vm_var_fn                              \
+    name(FILE* restrict istream, FILE* restrict ostream) {                         \
+        return vm_execute(istream, ostream, false, counted, instrumented, unused); \
+    }
+
+// One instance for each combination of U6A_BC_FLAG_NO_*, indexed by the flags shifted right by one
+#define VM_EXECUTE_UNCHECKED_ALL(prefix, attr, counted, instrumented)                                            \
+    VM_EXECUTE_UNCHECKED(prefix##_0, attr, counted, instrumented, 0)                                             \
+    VM_EXECUTE_UNCHECKED(prefix##_1, attr, counted, instrumented, U6A_BC_FLAG_NO_CONT)                           \
+    VM_EXECUTE_UNCHECKED(prefix##_2, attr, counted, instrumented, U6A_BC_FLAG_NO_PROMISE)                        \
+    VM_EXECUTE_UNCHECKED(prefix##_3, attr, counted, instrumented, U6A_BC_FLAG_NO_CONT | U6A_BC_FLAG_NO_PROMISE)  \
+    VM_EXECUTE_UNCHECKED(prefix##_4, attr, counted, instrumented, U6A_BC_FLAG_NO_INPUT)                          \
+    VM_EXECUTE_UNCHECKED(prefix##_5, attr, counted, instrumented, U6A_BC_FLAG_NO_CONT | U6A_BC_FLAG_NO_INPUT)    \
+    VM_EXECUTE_UNCHECKED(prefix##_6, attr, counted, instrumented, U6A_BC_FLAG_NO_PROMISE | U6A_BC_FLAG_NO_INPUT) \
+    VM_EXECUTE_UNCHECKED(prefix##_7, attr, counted, instrumented, U6A_BC_FLAGS_NO_FEATURE)                       \
+    static struct u6a_vm_var_fn (* const prefix[])(FILE* restrict, FILE* restrict) = {                           \
+        prefix##_0, prefix##_1, prefix##_2, prefix##_3, prefix##_4, prefix##_5, prefix##_6, prefix##_7           \
+    };
+
+VM_EXECUTE_UNCHECKED_ALL(vm_execute_unchecked, U6A_HOT, false, false)
+// Hardware events are counted on the same loop as the one above, only with `++ins_count` in it
+VM_EXECUTE_UNCHECKED_ALL(vm_execute_unchecked_counted, U6A_HOT, true, false)
+VM_EXECUTE_UNCHECKED_ALL(vm_execute_unchecked_instrumented, , true, true)
+
+// Only pure applications are made by workers, which neither read input nor use continuations or promises,
+// though they run on a segmented stack
+static struct u6a_vm_var_fn
+vm_execute_worker() {
+    return vm_execute_unchecked_instrumented[( U6A_BC_FLAG_NO_PROMISE | U6A_BC_FLAG_NO_INPUT ) >> 1](NULL, NULL);
+}
+
+static struct u6a_vm_var_fn
+vm_execute_failed() {
+    if (UNLIKELY(heap_profile)) {
+        u6a_heap_profile_snapshot(&pool_ctx, text_subst_len, ins_count, "error");
+    }
+    if (UNLIKELY(metrics)) {
+        vm_metrics_write();
+    }
+    return U6A_VM_VAR_FN_EMPTY;
+}
+
+struct u6a_vm_var_fn
+u6a_runtime_execute(FILE* restrict istream, FILE* restrict ostream) {
+#ifdef U6A_VM_STACK_FLAT_SUPPORTED
+    if (stack_ctx.flat_base) {
+        // Faults of the flat stack are caught by a signal handler, which leaves reporting them to here
+        if (sigsetjmp(flat_fault_ctx, 1)) {
+            if (u6a_vm_stack_flat_fault() == u6a_vsf_overflow) {
+                u6a_err_stack_overflow(err_runtime);
+            } else {
+                u6a_err_stack_underflow(err_runtime);
+            }
+            return vm_execute_failed();
+        }
+    }
+#endif
+    if (setjmp(jmp_ctx)) {
+        return vm_execute_failed();
+    }
+    if (UNLIKELY(instrument)) {
+        struct u6a_vm_var_fn result = verified
+            ? vm_execute_unchecked_instrumented[unused_features >> 1](istream, ostream)
+            : vm_execute_checked_instrumented(istream, ostream);
+        if (heap_profile) {
+            const char* reason = U6A_VM_VAR_FN_IS_EMPTY(result) ? "error" : "exit";
+            u6a_heap_profile_snapshot(&pool_ctx, text_subst_len, ins_count, reason);
+        }
+        if (memo_size) {
+            u6a_memo_report(&memo_ctx);
+        }
+        if (num_workers) {
+            u6a_info_verbose(info_runtime, "parallel evaluation: %" PRIu64 " applications made by workers",
+                u6a_parallel_num_tasks());
+        }
+        if (metrics) {
+            vm_metrics_write();
+        }
+        return result;
+    }
+    struct u6a_vm_var_fn result;
+    if (UNLIKELY(count_ins)) {
+        result = verified ? vm_execute_unchecked_counted[unused_features >> 1](istream, ostream)
+                          : vm_execute_checked_counted(istream, ostream);
+    } else if (LIKELY(verified)) {
+        result = vm_execute_unchecked[unused_features >> 1](istream, ostream);
+    } else {
+        result = vm_execute_checked(istream, ostream);
+    }
+    if (UNLIKELY(metrics)) {
+        vm_metrics_write();
+    }
+    return result;
+}
+
+uint64_t
+u6a_runtime_ins_count() {
+    return ins_count;
+}
+
+volatile bool*
+u6a_runtime_safe_point_flag() {
+    return &pool_ctx.nursery_full;
+}
+
+struct u6a_runtime_vm*
+u6a_runtime_vm_create() {
+    struct u6a_runtime_vm* vm = calloc(1, sizeof(struct u6a_runtime_vm));
+    if (UNLIKELY(vm == NULL)) {
+        u6a_err_bad_alloc(err_runtime, sizeof(struct u6a_runtime_vm));
+        return NULL;
+    }
+    if (UNLIKELY(!vm_init(&vm->stack_ctx, &vm->pool_ctx, false))) {
+        free(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+enum u6a_runtime_status
+u6a_runtime_vm_resume(struct u6a_runtime_vm* vm, const char* input, uint32_t input_len, bool input_eof,
+                      FILE* restrict ostream)
+{
+    // Only one VM executes at a time, so its contexts are swapped in and out of the interpreter
+    stack_ctx = vm->stack_ctx;
+    pool_ctx = vm->pool_ctx;
+    vm->input = input;
+    vm->input_len = input_len;
+    vm->input_eof = input_eof;
+    vm->suspended = false;
+    if (vm->started) {
+        resuming = true;
+        resume_regs = vm->regs;
+    }
+    vm->started = true;
+    current_vm = vm;
+    struct u6a_vm_var_fn result = u6a_runtime_execute(NULL, ostream);
+    current_vm = NULL;
+    vm->stack_ctx = stack_ctx;
+    vm->pool_ctx = pool_ctx;
+    if (vm->suspended) {
+        return u6a_rs_input;
+    }
+    return U6A_VM_VAR_FN_IS_EMPTY(result) ? u6a_rs_error : u6a_rs_exited;
+}
+
+void
+u6a_runtime_vm_destroy(struct u6a_runtime_vm* vm) {
+    u6a_vm_stack_free_all(&vm->stack_ctx);
+    u6a_vm_pool_destroy(&vm->pool_ctx);
+    free(vm);
+}
+
 void
 u6a_runtime_destroy() {
+    u6a_memo_destroy(&memo_ctx);
+    u6a_vm_pool_copier_destroy(&copier);
+    free(pool_ctx.tags);
+    pool_ctx.tags = NULL;
+    // Workers still making applications, as the program failed meanwhile, may go on reading the text
+    if (UNLIKELY(!u6a_parallel_destroy())) {
+        text = NULL;
+    }
     free(text);
     free(rodata);
     text = NULL;
@@ -23,6 +23,7 @@
 #define U6A_RUNTIME_H_
 
 #include "common.h"
+#include "vm_pool.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -31,11 +32,34 @@
 struct u6a_runtime_options {
     FILE*    istream;
     char*    file_name;
+    bool     source;                 /* `istream` holds Unlambda source rather than bytecode */
+    char*    snapshot_file;
     uint32_t stack_segment_size;
     uint32_t pool_size;
+    uint32_t nursery_size;
+    enum u6a_vm_pool_policy pool_policy;
     bool     force_exec;
+    bool     huge_pages;
+    bool     church_numerals;
+    uint32_t memo_size;              /* in entries, 0 if not memoizing */
+    uint32_t parallel_workers;       /* 0 if not evaluating in parallel */
+    bool     from_snapshot;
+    bool     multiplex;
+    bool     count_ins;
+    uint32_t trace_interval;         /* in VM instructions, 0 if not tracing */
+    bool     heap_profile;
+    uint32_t heap_profile_interval;  /* in VM instructions, 0 if only at exit */
+    bool     metrics;                /* metrics are written, see u6a_metrics_open() */
 };
 
+enum u6a_runtime_status {
+    u6a_rs_exited,
+    u6a_rs_input,                    /* suspended at `@`, waiting for more input */
+    u6a_rs_error
+};
+
+struct u6a_runtime_vm;
+
 bool
 u6a_runtime_info(FILE* restrict istream, const char* file_name);
 
@@ -45,6 +69,23 @@ u6a_runtime_init(struct u6a_runtime_options* options);
 struct u6a_vm_var_fn
 u6a_runtime_execute(FILE* restrict istream, FILE* restrict output_stream);
 
+uint64_t
+u6a_runtime_ins_count();
+
+// Setting the flag makes the main VM stop at its next safe point, where metrics are written if due
+volatile bool*
+u6a_runtime_safe_point_flag();
+
+struct u6a_runtime_vm*
+u6a_runtime_vm_create();
+
+enum u6a_runtime_status
+u6a_runtime_vm_resume(struct u6a_runtime_vm* vm, const char* input, uint32_t input_len, bool input_eof,
+                      FILE* restrict output_stream);
+
+void
+u6a_runtime_vm_destroy(struct u6a_runtime_vm* vm);
+
 void
 u6a_runtime_destroy();
 
@@ -0,0 +1,130 @@
+/*
+ * time_report.c - Per-phase time and memory report
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "time_report.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#define NUM_PHASES u6a_tp_none
+
+struct phase_stats {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    size_t   live;                   /* bytes currently allocated on behalf of the phase */
+    size_t   peak;
+};
+
+static const char* phase_names[NUM_PHASES] = { "lex", "parse", "codegen", "write" };
+
+static struct phase_stats  phases[NUM_PHASES];
+static bool                enabled;
+static enum u6a_time_phase current_phase = u6a_tp_none;
+static uint64_t            phase_wall_start, phase_cpu_start;
+static uint64_t            total_wall_start, total_cpu_start;
+static size_t              total_live, total_peak;
+
+static inline uint64_t
+wall_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+cpu_ns() {
+#ifdef CLOCK_PROCESS_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return (uint64_t)clock() * 1000000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+void
+u6a_time_report_enable() {
+    enabled = true;
+    total_wall_start = wall_ns();
+    total_cpu_start = cpu_ns();
+}
+
+void
+u6a_time_report_enter(enum u6a_time_phase phase) {
+    if (!enabled || phase == current_phase) {
+        return;
+    }
+    const uint64_t wall = wall_ns(), cpu = cpu_ns();
+    if (current_phase != u6a_tp_none) {
+        phases[current_phase].wall_ns += wall - phase_wall_start;
+        phases[current_phase].cpu_ns += cpu - phase_cpu_start;
+    }
+    current_phase = phase;
+    phase_wall_start = wall;
+    phase_cpu_start = cpu;
+}
+
+void
+u6a_time_report_alloc(enum u6a_time_phase phase, size_t size) {
+    struct phase_stats* stats = phases + phase;
+    stats->live += size;
+    if (stats->live > stats->peak) {
+        stats->peak = stats->live;
+    }
+    total_live += size;
+    if (total_live > total_peak) {
+        total_peak = total_live;
+    }
+}
+
+void
+u6a_time_report_free(enum u6a_time_phase phase, size_t size) {
+    phases[phase].live -= size;
+    total_live -= size;
+}
+
+bool
+u6a_time_report_print(FILE* stream, enum u6a_time_report_format format) {
+    if (!enabled) {
+        return true;
+    }
+    u6a_time_report_enter(u6a_tp_none);
+    const uint64_t total_wall = wall_ns() - total_wall_start, total_cpu = cpu_ns() - total_cpu_start;
+    if (format == u6a_trf_json) {
+        fputs("{\"phases\":[", stream);
+        for (int idx = 0; idx < NUM_PHASES; ++idx) {
+            fprintf(stream, "%s{\"name\":\"%s\",\"wall_ns\":%" PRIu64 ",\"cpu_ns\":%" PRIu64 ",\"peak_bytes\":%zu}",
+                idx ? "," : "", phase_names[idx], phases[idx].wall_ns, phases[idx].cpu_ns, phases[idx].peak);
+        }
+        fprintf(stream, "],\"total\":{\"wall_ns\":%" PRIu64 ",\"cpu_ns\":%" PRIu64 ",\"peak_bytes\":%zu}}\n",
+            total_wall, total_cpu, total_peak);
+    } else {
+        // Time outside of the phases, e.g. spent on options and the compile cache, only counts in the total
+        fprintf(stream, "%-8s  %12s  %12s  %16s\n", "phase", "wall (ms)", "cpu (ms)", "peak (bytes)");
+        for (int idx = 0; idx < NUM_PHASES; ++idx) {
+            fprintf(stream, "%-8s  %12.3f  %12.3f  %16zu\n", phase_names[idx], phases[idx].wall_ns / 1e6,
+                phases[idx].cpu_ns / 1e6, phases[idx].peak);
+        }
+        fprintf(stream, "%-8s  %12.3f  %12.3f  %16zu\n", "total", total_wall / 1e6, total_cpu / 1e6, total_peak);
+    }
+    return fflush(stream) == 0 && !ferror(stream);
+}
@@ -0,0 +1,63 @@
+/*
+ * time_report.h - Per-phase time and memory report definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_TIME_REPORT_H_
+#define U6A_TIME_REPORT_H_
+
+#include "common.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+enum u6a_time_phase {
+    u6a_tp_lex,
+    u6a_tp_parse,
+    u6a_tp_codegen,
+    u6a_tp_write,
+    u6a_tp_none
+};
+
+enum u6a_time_report_format {
+    u6a_trf_text,
+    u6a_trf_json
+};
+
+// Start measuring, the total time being counted from here
+void
+u6a_time_report_enable();
+
+// Stop timing the current phase, if any, and start timing the given one. Time spent in a phase adds up.
+void
+u6a_time_report_enter(enum u6a_time_phase phase);
+
+// Account for memory allocated or freed on behalf of a phase, whichever phase is being timed
+void
+u6a_time_report_alloc(enum u6a_time_phase phase, size_t size);
+
+void
+u6a_time_report_free(enum u6a_time_phase phase, size_t size);
+
+// Write the report if enabled, returns false on failure
+bool
+u6a_time_report_print(FILE* stream, enum u6a_time_report_format format);
+
+#endif
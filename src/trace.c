@@ -0,0 +1,304 @@
+/*
+ * trace.c - Sampling profiler
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define FRAME_PROMISE        ( UINT32_C(1) << 31 )
+#define FRAME_TRUNCATED        UINT32_MAX
+#define FRAME_LABEL_SIZE       24
+#define SAMPLE_BUF_LEN       ( U6A_TRACE_MAX_DEPTH + 2 )
+#define FOLDED_INIT_CAPACITY   1024
+
+struct trace_stack {
+    uint64_t  hash;
+    uint64_t  count;
+    uint32_t  depth;
+    uint32_t* frames;                /* outermost first, NULL if the slot is vacant */
+};
+
+static enum u6a_trace_format format;
+static        FILE*          output;
+static const  char*          output_name;
+static        bool           failed;
+static        uint32_t       prelude_len;
+
+// Frames of the latest sample, which begin at `sample + sample_pos`
+static        uint32_t       sample[SAMPLE_BUF_LEN];
+static        uint32_t       sample_pos;
+
+// Folded stacks, aggregated in an open-addressing hash table
+static struct trace_stack*   stacks;
+static        uint32_t       stacks_cap;
+static        uint32_t       stacks_len;
+
+// Frames currently open on the Chrome timeline
+static        uint32_t       opened[SAMPLE_BUF_LEN];
+static        uint32_t       opened_len;
+static const  char*          event_sep;
+
+static        uint64_t       cont_count;
+static        uint32_t       cont_from;
+static        uint32_t       cont_to;
+
+static const char* err_trace = "trace error";
+
+static const char*
+frame_label(uint32_t frame, char* buffer) {
+    if (frame == FRAME_TRUNCATED) {
+        return "[truncated]";
+    }
+    const uint32_t offset = frame & ~FRAME_PROMISE;
+    if (offset < prelude_len) {
+        // The prelude carries out applications of `s`
+        snprintf(buffer, FRAME_LABEL_SIZE, "[s:%" PRIu32 "]", offset);
+    } else {
+        snprintf(buffer, FRAME_LABEL_SIZE, "%08" PRIx32 "%s", offset - prelude_len,
+            frame & FRAME_PROMISE ? "(d)" : "");
+    }
+    return buffer;
+}
+
+// Record a return frame, returns false once the sample is full
+static inline bool
+trace_frame(struct u6a_vm_var_fn elem, uint32_t* pos) {
+    if (elem.token.fn != u6a_vf_j && elem.token.fn != u6a_vf_f) {
+        return true;
+    }
+    if (UNLIKELY(*pos == 1)) {
+        sample[--*pos] = FRAME_TRUNCATED;
+        return false;
+    }
+    sample[--*pos] = elem.ref | ( elem.token.fn == u6a_vf_f ? FRAME_PROMISE : 0 );
+    return true;
+}
+
+static void
+trace_walk(struct u6a_vm_stack_ctx* ctx, uint32_t offset) {
+    // Filled backwards from the innermost frame
+    uint32_t pos = SAMPLE_BUF_LEN;
+    sample[--pos] = offset;
+    for (const struct u6a_vm_var_fn* elem = ctx->flat_top; ctx->flat_base && elem >= ctx->flat_base; --elem) {
+        if (!trace_frame(*elem, &pos)) {
+            goto done;
+        }
+    }
+    for (struct u6a_vm_stack* vs = ctx->active_stack; vs; vs = vs->prev) {
+        for (uint32_t idx = vs->top; idx < UINT32_MAX; --idx) {
+            if (!trace_frame(vs->elems[idx], &pos)) {
+                goto done;
+            }
+        }
+    }
+
+    done:
+    sample_pos = pos;
+}
+
+static inline uint64_t
+folded_hash(const uint32_t* frames, uint32_t depth) {
+    // FNV-1a
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (uint32_t idx = 0; idx < depth; ++idx) {
+        hash = ( hash ^ frames[idx] ) * UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static inline struct trace_stack*
+folded_slot(struct trace_stack* table, uint32_t cap, uint64_t hash, const uint32_t* frames, uint32_t depth) {
+    for (uint32_t idx = hash & ( cap - 1 ); ; idx = ( idx + 1 ) & ( cap - 1 )) {
+        struct trace_stack* slot = table + idx;
+        if (slot->frames == NULL) {
+            return slot;
+        }
+        if (slot->hash == hash && slot->depth == depth && memcmp(slot->frames, frames, depth * sizeof(uint32_t)) == 0) {
+            return slot;
+        }
+    }
+}
+
+static bool
+folded_grow() {
+    const uint32_t new_cap = stacks_cap ? stacks_cap * 2 : FOLDED_INIT_CAPACITY;
+    struct trace_stack* new_stacks = calloc(new_cap, sizeof(struct trace_stack));
+    if (UNLIKELY(new_stacks == NULL)) {
+        u6a_err_bad_alloc(err_trace, new_cap * sizeof(struct trace_stack));
+        return false;
+    }
+    for (uint32_t idx = 0; idx < stacks_cap; ++idx) {
+        struct trace_stack* stack = stacks + idx;
+        if (stack->frames) {
+            *folded_slot(new_stacks, new_cap, stack->hash, stack->frames, stack->depth) = *stack;
+        }
+    }
+    free(stacks);
+    stacks = new_stacks;
+    stacks_cap = new_cap;
+    return true;
+}
+
+static bool
+folded_add(const uint32_t* frames, uint32_t depth) {
+    if (( stacks_len + 1 ) * 2 > stacks_cap && UNLIKELY(!folded_grow())) {
+        return false;
+    }
+    const uint64_t hash = folded_hash(frames, depth);
+    struct trace_stack* slot = folded_slot(stacks, stacks_cap, hash, frames, depth);
+    if (slot->frames == NULL) {
+        slot->frames = malloc(depth * sizeof(uint32_t));
+        if (UNLIKELY(slot->frames == NULL)) {
+            u6a_err_bad_alloc(err_trace, depth * sizeof(uint32_t));
+            return false;
+        }
+        memcpy(slot->frames, frames, depth * sizeof(uint32_t));
+        slot->hash = hash;
+        slot->depth = depth;
+        ++stacks_len;
+    }
+    ++slot->count;
+    return true;
+}
+
+static void
+folded_write() {
+    char buffer[FRAME_LABEL_SIZE];
+    for (uint32_t idx = 0; idx < stacks_cap; ++idx) {
+        struct trace_stack* stack = stacks + idx;
+        if (stack->frames == NULL) {
+            continue;
+        }
+        for (uint32_t depth = 0; depth < stack->depth; ++depth) {
+            fprintf(output, depth ? ";%s" : "%s", frame_label(stack->frames[depth], buffer));
+        }
+        fprintf(output, " %" PRIu64 "\n", stack->count);
+        free(stack->frames);
+    }
+    free(stacks);
+    stacks = NULL;
+    stacks_cap = stacks_len = 0;
+}
+
+static void
+chrome_event(const char* phase, uint32_t frame, uint64_t clock) {
+    char buffer[FRAME_LABEL_SIZE];
+    fprintf(output, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%" PRIu64 ",\"pid\":1,\"tid\":1}",
+        event_sep, frame_label(frame, buffer), phase, clock);
+    event_sep = ",\n";
+}
+
+static void
+chrome_continuation(uint64_t clock) {
+    char from[FRAME_LABEL_SIZE], to[FRAME_LABEL_SIZE];
+    fprintf(output, "%s{\"name\":\"continuation\",\"cat\":\"c\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64 ","
+        "\"pid\":1,\"tid\":1,\"args\":{\"jumps\":%" PRIu64 ",\"from\":\"%s\",\"to\":\"%s\"}}",
+        event_sep, clock, cont_count, frame_label(cont_from, from), frame_label(cont_to, to));
+    event_sep = ",\n";
+}
+
+static void
+chrome_add(const uint32_t* frames, uint32_t depth, uint64_t clock) {
+    uint32_t common = 0;
+    while (common < depth && common < opened_len && frames[common] == opened[common]) {
+        ++common;
+    }
+    while (opened_len > common) {
+        chrome_event("E", opened[--opened_len], clock);
+    }
+    while (opened_len < depth) {
+        opened[opened_len] = frames[opened_len];
+        chrome_event("B", opened[opened_len++], clock);
+    }
+}
+
+bool
+u6a_trace_open(enum u6a_trace_format format_, const char* file_name) {
+    format = format_;
+    if (file_name) {
+        output = fopen(file_name, "w");
+        if (UNLIKELY(output == NULL)) {
+            u6a_err_cannot_open_file(err_trace, file_name);
+            return false;
+        }
+        output_name = file_name;
+    } else {
+        output = stderr;
+        output_name = "STDERR";
+    }
+    if (format == u6a_tr_chrome) {
+        fputs("{\"traceEvents\":[\n", output);
+        event_sep = "";
+    }
+    return true;
+}
+
+void
+u6a_trace_sample(struct u6a_vm_stack_ctx* ctx, uint32_t offset, uint32_t prelude_len_, uint64_t clock) {
+    if (UNLIKELY(output == NULL || failed)) {
+        return;
+    }
+    prelude_len = prelude_len_;
+    trace_walk(ctx, offset);
+    const uint32_t depth = SAMPLE_BUF_LEN - sample_pos;
+    if (format == u6a_tr_folded) {
+        failed = !folded_add(sample + sample_pos, depth);
+        return;
+    }
+    if (cont_count) {
+        chrome_continuation(clock);
+        cont_count = 0;
+    }
+    chrome_add(sample + sample_pos, depth, clock);
+}
+
+void
+u6a_trace_continuation(uint32_t from, uint32_t to) {
+    ++cont_count;
+    cont_from = from;
+    cont_to = to;
+}
+
+bool
+u6a_trace_close(uint64_t clock) {
+    if (output == NULL) {
+        return true;
+    }
+    if (format == u6a_tr_folded) {
+        folded_write();
+    } else {
+        chrome_add(NULL, 0, clock);
+        fputs("\n],\"otherData\":{\"clock\":\"VM instructions\"}}\n", output);
+    }
+    bool ok = !failed && !ferror(output);
+    if (UNLIKELY(!ok && !failed)) {
+        u6a_err_write_failed(err_trace, 0, output_name);
+    }
+    if (output != stderr) {
+        ok = fclose(output) == 0 && ok;
+    }
+    output = NULL;
+    return ok;
+}
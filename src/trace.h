@@ -0,0 +1,60 @@
+/*
+ * trace.h - Sampling profiler definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_TRACE_H_
+#define U6A_TRACE_H_
+
+#include "common.h"
+#include "vm_stack.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define U6A_TRACE_DEFAULT_INTERVAL 10000
+#define U6A_TRACE_MIN_INTERVAL     1
+#define U6A_TRACE_MAX_INTERVAL     UINT32_MAX
+
+// Return frames beyond this depth are not recorded, the outermost ones being dropped first
+#define U6A_TRACE_MAX_DEPTH        1024
+
+enum u6a_trace_format {
+    u6a_tr_folded,                   /* folded stacks, as consumed by flamegraph.pl */
+    u6a_tr_chrome                    /* Chrome trace event JSON */
+};
+
+bool
+u6a_trace_open(enum u6a_trace_format format, const char* file_name);
+
+/*
+ * Record the chain of return frames on the VM stack, followed by `offset`, the instruction to be executed.
+ * The clock is the number of VM instructions executed so far.
+ */
+void
+u6a_trace_sample(struct u6a_vm_stack_ctx* ctx, uint32_t offset, uint32_t prelude_len, uint64_t clock);
+
+// Record a jump made by applying a continuation, to be reported with the next sample
+void
+u6a_trace_continuation(uint32_t from, uint32_t to);
+
+bool
+u6a_trace_close(uint64_t clock);
+
+#endif
@@ -22,32 +22,63 @@
 #include "logging.h"
 #include "vm_defs.h"
 #include "runtime.h"
+#include "mux.h"
+#include "perf.h"
+#include "trace.h"
+#include "heap_profile.h"
+#include "memo.h"
+#include "parallel.h"
+#include "metrics.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <errno.h>
+#include <limits.h>
 
 #define EC_ERR_OPTIONS  1
 #define EC_ERR_INIT     2
 #define EC_ERR_RUNTIME  3
 
+// Files named as such are compiled before execution, as if by `u6ac`
+#define SOURCE_SUFFIX     ".unl"
+#define SOURCE_SUFFIX_LEN ( sizeof(SOURCE_SUFFIX) - 1 )
+
 #define PARSE_UINT_OPT(opt, min_val, max_val)                            \
+    PARSE_UINT_OPT_MAX(opt, min_val, max_val);                           \
+    if (UNLIKELY((opt) < (min_val))) {                                   \
+        u6a_err_uint_not_in_range(err_toplevel, min_val, max_val, opt);  \
+        return false;                                                    \
+    }
+
+// Only the upper bound is checked, for options which can be as low as 0
+#define PARSE_UINT_OPT_MAX(opt, min_val, max_val)                        \
     errno = 0;                                                           \
     (opt) = strtoul(optarg, NULL, 10);                                   \
     if (UNLIKELY(errno)) {                                               \
         u6a_err_invalid_uint(err_toplevel, optarg);                      \
         return false;                                                    \
     }                                                                    \
-    if (UNLIKELY((opt) < (min_val) || (opt) > (max_val))) {              \
+    if (UNLIKELY((opt) > (max_val))) {                                   \
         u6a_err_uint_not_in_range(err_toplevel, min_val, max_val, opt);  \
         return false;                                                    \
     }
 
 struct arg_options {
     struct u6a_runtime_options runtime;
+    char*                      listen_address;
+    uint32_t                   max_sessions;
     bool                       print_info;
     bool                       print_only;
+    bool                       perf_counters;
+    bool                       trace;
+    enum u6a_trace_format      trace_format;
+    char*                      trace_file;
+    uint32_t                   trace_interval;
+    char*                      heap_profile_file;
+    char*                      metrics_file;
+    uint32_t                   metrics_fd;
+    uint32_t                   metrics_interval;
 };
 
 static const char* err_toplevel = "error";
@@ -62,19 +93,44 @@ arg_options_destroy(struct arg_options* options) {
 static bool
 process_options(struct arg_options* options, int argc, char** argv) {
     static const struct option long_opts[] = {
-        { "stack-segment-size", required_argument, NULL, 's' },
-        { "pool-size",          required_argument, NULL, 'p' },
-        { "info",               no_argument,       NULL, 'i' },
-        { "force",              no_argument,       NULL, 'f' },
-        { "help",               no_argument,       NULL, 'H' },
-        { "version",            no_argument,       NULL, 'V' },
+        { "stack-segment-size",      required_argument, NULL, 's' },
+        { "pool-size",               required_argument, NULL, 'p' },
+        { "nursery-size",            required_argument, NULL, 'n' },
+        { "huge-pages",              no_argument,       NULL, 'G' },
+        { "church-numerals",         no_argument,       NULL, 'N' },
+        { "memo-size",               required_argument, NULL, 'm' },
+        { "parallel",                required_argument, NULL, 'j' },
+        { "pool-policy",             required_argument, NULL, 'A' },
+        { "verbose",                 no_argument,       NULL, 'v' },
+        { "snapshot-at-first-input", required_argument, NULL, 'D' },
+        { "from-snapshot",           required_argument, NULL, 'R' },
+        { "listen",                  required_argument, NULL, 'L' },
+        { "max-sessions",            required_argument, NULL, 'M' },
+        { "perf-counters",           no_argument,       NULL, 'P' },
+        { "trace",                   required_argument, NULL, 'T' },
+        { "trace-output",            required_argument, NULL, 'O' },
+        { "trace-interval",          required_argument, NULL, 'I' },
+        { "heap-profile",            required_argument, NULL, 'h' },
+        { "heap-profile-interval",   required_argument, NULL, 'o' },
+        { "metrics",                 required_argument, NULL, 'E' },
+        { "metrics-fd",              required_argument, NULL, 'F' },
+        { "metrics-interval",        required_argument, NULL, 'W' },
+        { "source",                  no_argument,       NULL, 'u' },
+        { "info",                    no_argument,       NULL, 'i' },
+        { "force",                   no_argument,       NULL, 'f' },
+        { "help",                    no_argument,       NULL, 'H' },
+        { "version",                 no_argument,       NULL, 'V' },
         { 0, 0, 0, 0 }
     };
     options->runtime.stack_segment_size = U6A_VM_DEFAULT_STACK_SEGMENT_SIZE;
     options->runtime.pool_size = U6A_VM_DEFAULT_POOL_SIZE;
+    options->runtime.nursery_size = U6A_VM_DEFAULT_NURSERY_SIZE;
+    options->max_sessions = U6A_MUX_DEFAULT_MAX_SESSIONS;
+    options->trace_interval = U6A_TRACE_DEFAULT_INTERVAL;
+    options->metrics_interval = U6A_METRICS_DEFAULT_INTERVAL;
     options->print_info = false;
     while (true) {
-        int result = getopt_long(argc, argv, "s:p:ifHV", long_opts, NULL);
+        int result = getopt_long(argc, argv, "s:p:n:ifvHV", long_opts, NULL);
         if (result == -1) {
             break;
         }
@@ -86,19 +142,107 @@ process_options(struct arg_options* options, int argc, char** argv) {
             case 'p':
                 PARSE_UINT_OPT(options->runtime.pool_size, U6A_VM_MIN_POOL_SIZE, U6A_VM_MAX_POOL_SIZE);
                 break;
+            case 'n':
+                PARSE_UINT_OPT_MAX(options->runtime.nursery_size, U6A_VM_MIN_NURSERY_SIZE, U6A_VM_MAX_NURSERY_SIZE);
+                break;
             case 'i':
                 options->print_info = true;
                 break;
             case 'f':
                 options->runtime.force_exec = true;
                 break;
+            case 'G':
+                options->runtime.huge_pages = true;
+                break;
+            case 'N':
+                options->runtime.church_numerals = true;
+                break;
+            case 'm':
+                PARSE_UINT_OPT_MAX(options->runtime.memo_size, U6A_MEMO_MIN_SIZE, U6A_MEMO_MAX_SIZE);
+                break;
+            case 'j':
+                PARSE_UINT_OPT_MAX(options->runtime.parallel_workers, U6A_PARALLEL_MIN_WORKERS,
+                    U6A_PARALLEL_MAX_WORKERS);
+                break;
+            case 'A':
+                if (strcmp(optarg, "lifo") == 0) {
+                    options->runtime.pool_policy = u6a_vp_lifo;
+                } else if (strcmp(optarg, "ordered") == 0) {
+                    options->runtime.pool_policy = u6a_vp_ordered;
+                } else if (strcmp(optarg, "near") == 0) {
+                    options->runtime.pool_policy = u6a_vp_near;
+                } else {
+                    u6a_err_custom(err_toplevel, "pool policy should be one of \"lifo\", \"ordered\" and \"near\"");
+                    return false;
+                }
+                break;
+            case 'v':
+                u6a_logging_verbose(true);
+                break;
+            case 'D':
+                options->runtime.snapshot_file = optarg;
+                break;
+            case 'R':
+                options->runtime.from_snapshot = true;
+                options->runtime.file_name = optarg;
+                break;
+            case 'L':
+                options->listen_address = optarg;
+                options->runtime.multiplex = true;
+                break;
+            case 'M':
+                PARSE_UINT_OPT(options->max_sessions, U6A_MUX_MIN_MAX_SESSIONS, U6A_MUX_MAX_MAX_SESSIONS);
+                break;
+            case 'P':
+                options->perf_counters = true;
+                options->runtime.count_ins = true;
+                break;
+            case 'T':
+                if (strcmp(optarg, "folded") == 0) {
+                    options->trace_format = u6a_tr_folded;
+                } else if (strcmp(optarg, "chrome") == 0) {
+                    options->trace_format = u6a_tr_chrome;
+                } else {
+                    u6a_err_custom(err_toplevel, "trace format should be either \"folded\" or \"chrome\"");
+                    return false;
+                }
+                options->trace = true;
+                break;
+            case 'O':
+                options->trace_file = optarg;
+                break;
+            case 'I':
+                PARSE_UINT_OPT(options->trace_interval, U6A_TRACE_MIN_INTERVAL, U6A_TRACE_MAX_INTERVAL);
+                break;
+            case 'h':
+                options->heap_profile_file = optarg;
+                options->runtime.heap_profile = true;
+                break;
+            case 'o':
+                PARSE_UINT_OPT_MAX(options->runtime.heap_profile_interval,
+                    U6A_HEAP_PROFILE_MIN_INTERVAL, U6A_HEAP_PROFILE_MAX_INTERVAL);
+                break;
+            case 'E':
+                options->metrics_file = optarg;
+                options->runtime.metrics = true;
+                break;
+            case 'F':
+                PARSE_UINT_OPT_MAX(options->metrics_fd, 0, INT_MAX);
+                options->runtime.metrics = true;
+                break;
+            case 'W':
+                PARSE_UINT_OPT(options->metrics_interval, U6A_METRICS_MIN_INTERVAL, U6A_METRICS_MAX_INTERVAL);
+                break;
+            case 'u':
+                options->runtime.source = true;
+                break;
             case 'H':
-                printf("Usage: u6a [options] bytecode-file\n\n"
+                printf("Usage: u6a [options] bytecode-file|source-file\n\n"
                        "Runtime for the Unlambda programming language.\n"
                        "See \"man u6a\" for details.\n");
                 options->print_only = true;
                 break;
-            case 'v':
+            case 'V':
                 printf("%d.%d.%d\n", U6A_VER_MAJOR, U6A_VER_MINOR, U6A_VER_PATCH);
                 options->print_only = true;
                 break;
@@ -111,12 +255,60 @@ process_options(struct arg_options* options, int argc, char** argv) {
     if (UNLIKELY(options->print_only)) {
         return true;
     }
+    if (UNLIKELY(options->runtime.multiplex && (options->runtime.from_snapshot || options->runtime.snapshot_file))) {
+        u6a_err_custom(err_toplevel, "snapshots are not supported with --listen");
+        return false;
+    }
+    if (UNLIKELY(options->runtime.multiplex && options->perf_counters)) {
+        u6a_err_custom(err_toplevel, "--perf-counters is not supported with --listen");
+        return false;
+    }
+    if (UNLIKELY(options->runtime.multiplex && options->trace)) {
+        u6a_err_custom(err_toplevel, "--trace is not supported with --listen");
+        return false;
+    }
+    if (UNLIKELY(options->runtime.multiplex && options->runtime.heap_profile)) {
+        u6a_err_custom(err_toplevel, "--heap-profile is not supported with --listen");
+        return false;
+    }
+    if (UNLIKELY(options->runtime.multiplex && options->runtime.memo_size)) {
+        u6a_err_custom(err_toplevel, "--memo-size is not supported with --listen");
+        return false;
+    }
+    if (UNLIKELY(options->runtime.multiplex && options->runtime.metrics)) {
+        u6a_err_custom(err_toplevel, "--metrics is not supported with --listen");
+        return false;
+    }
+    // Workers hold no continuations, samples or memo tables of their own
+    if (UNLIKELY(options->runtime.parallel_workers
+                 && ( options->runtime.multiplex || options->runtime.from_snapshot || options->runtime.snapshot_file
+                      || options->trace || options->runtime.heap_profile || options->runtime.memo_size )))
+    {
+        u6a_err_custom(err_toplevel,
+            "--parallel is not supported with --listen, snapshots, --trace, --heap-profile or --memo-size");
+        return false;
+    }
+    if (options->trace) {
+        options->runtime.trace_interval = options->trace_interval;
+    }
+    if (options->runtime.from_snapshot) {
+        return true;
+    }
     if (UNLIKELY(optind == argc)) {
         u6a_err_no_input_file(err_toplevel);
         return false;
     }
     options->runtime.file_name = argv[optind];
     uint32_t file_name_size = strlen(options->runtime.file_name);
+    if (file_name_size > SOURCE_SUFFIX_LEN
+        && strcmp(options->runtime.file_name + file_name_size - SOURCE_SUFFIX_LEN, SOURCE_SUFFIX) == 0)
+    {
+        options->runtime.source = true;
+    }
+    if (UNLIKELY(options->print_info && options->runtime.source)) {
+        u6a_err_custom(err_toplevel, "--info is only supported with bytecode files");
+        return false;
+    }
     if (file_name_size == 1 && options->runtime.file_name[0] == '-') {
         options->runtime.istream = stdin;
         options->runtime.file_name = "STDIN";
@@ -135,6 +327,7 @@ process_options(struct arg_options* options, int argc, char** argv) {
 
 int main(int argc, char** argv) {
     struct arg_options options = { 0 };
+    struct u6a_perf_counters perf_counters;
     int exit_code = 0;
     u6a_logging_init(argv[0]);
     if (UNLIKELY(!process_options(&options, argc, argv))) {
@@ -154,13 +347,53 @@ int main(int argc, char** argv) {
         exit_code = EC_ERR_INIT;
         goto terminate;
     }
+    if (options.listen_address) {
+        // Only returns on failure
+        u6a_mux_serve(options.listen_address, options.max_sessions);
+        exit_code = EC_ERR_RUNTIME;
+        goto terminate;
+    }
+    if (options.trace && UNLIKELY(!u6a_trace_open(options.trace_format, options.trace_file))) {
+        exit_code = EC_ERR_INIT;
+        goto terminate;
+    }
+    if (options.heap_profile_file && UNLIKELY(!u6a_heap_profile_open(options.heap_profile_file))) {
+        exit_code = EC_ERR_INIT;
+        goto terminate;
+    }
+    if (options.runtime.metrics
+        && UNLIKELY(!u6a_metrics_open(options.metrics_file, options.metrics_fd, options.metrics_interval,
+                                       u6a_runtime_safe_point_flag())))
+    {
+        exit_code = EC_ERR_INIT;
+        goto terminate;
+    }
+    if (options.perf_counters) {
+        // When no event can be opened, the program is still executed, and only VM instructions are reported
+        u6a_perf_open(&perf_counters);
+        u6a_perf_start(&perf_counters);
+    }
     struct u6a_vm_var_fn exec_result = u6a_runtime_execute(stdin, stdout);
+    if (options.perf_counters) {
+        u6a_perf_stop(&perf_counters);
+        u6a_perf_report(&perf_counters, u6a_runtime_ins_count());
+        u6a_perf_close(&perf_counters);
+    }
+    if (options.trace && UNLIKELY(!u6a_trace_close(u6a_runtime_ins_count()))) {
+        exit_code = EC_ERR_RUNTIME;
+        goto terminate;
+    }
+    if (options.heap_profile_file && UNLIKELY(!u6a_heap_profile_close())) {
+        exit_code = EC_ERR_RUNTIME;
+        goto terminate;
+    }
     if (UNLIKELY(U6A_VM_VAR_FN_IS_EMPTY(exec_result))) {
         exit_code = EC_ERR_RUNTIME;
         goto terminate;
     }
 
     terminate:
+    u6a_metrics_close();
     u6a_runtime_destroy();
     arg_options_destroy(&options);
     return exit_code;
@@ -23,23 +23,35 @@
 #include "lexer.h"
 #include "parser.h"
 #include "codegen.h"
+#include "cache.h"
+#include "linker.h"
+#include "time_report.h"
 
 #include <unistd.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <inttypes.h>
 
 #define EC_ERR_OPTIONS  1
 #define EC_ERR_LEX      2
 #define EC_ERR_PARSE    3
 #define EC_ERR_CODEGEN  4
+#define EC_ERR_CACHE    5
+#define EC_ERR_LINK     6
 
 struct arg_options {
-    struct u6a_codegen_options codegen;
-    FILE*                      input_file;
-    char*                      input_file_name;
-    char*                      output_file_prefix;
-    bool                       print_only;
+    struct u6a_codegen_options  codegen;
+    FILE*                       input_file;
+    char*                       input_file_name;
+    char*                       output_file_prefix;
+    char*                       cache_dir;
+    char**                      module_files;
+    uint32_t                    num_module_files;
+    bool                        link;
+    bool                        print_only;
+    bool                        time_report;
+    enum u6a_time_report_format time_report_format;
 };
 
 static const char* err_toplevel = "error";
@@ -66,6 +78,11 @@ process_options(struct arg_options* options, int argc, char** argv) {
         { "add-prefix",  optional_argument, NULL, 'p' },
         { "verbose",     no_argument,       NULL, 'v' },
         { "syntax-only", no_argument,       NULL, 's' },
+        { "dense-text",  no_argument,       NULL, 'D' },
+        { "module",      no_argument,       NULL, 'c' },
+        { "link",        no_argument,       NULL, 'L' },
+        { "cache-dir",   required_argument, NULL, 'C' },
+        { "time-report", optional_argument, NULL, 'R' },
         { "help",        no_argument,       NULL, 'H' },
         { "version",     no_argument,       NULL, 'V' },
         { 0, 0, 0, 0 }
@@ -75,7 +92,7 @@ process_options(struct arg_options* options, int argc, char** argv) {
     bool verbose = false;
     char optimize_level = '1';
     while (true) {
-        int result = getopt_long(argc, argv, "o:O::SvHV", long_opts, NULL);
+        int result = getopt_long(argc, argv, "o:O::cSvHV", long_opts, NULL);
         if (result == -1) {
             break;
         }
@@ -104,8 +121,32 @@ process_options(struct arg_options* options, int argc, char** argv) {
             case 's':
                 syntax_only = true;
                 break;
+            case 'D':
+                options->codegen.dense_text = true;
+                break;
+            case 'c':
+                options->codegen.module = true;
+                break;
+            case 'L':
+                options->link = true;
+                break;
+            case 'C':
+                options->cache_dir = optarg;
+                break;
+            case 'R':
+                if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                    options->time_report_format = u6a_trf_text;
+                } else if (strcmp(optarg, "json") == 0) {
+                    options->time_report_format = u6a_trf_json;
+                } else {
+                    u6a_err_custom(err_toplevel, "time report format should be either \"text\" or \"json\"");
+                    return false;
+                }
+                options->time_report = true;
+                break;
             case 'H':
-                printf("Usage: u6ac [options] source-file\n\n"
+                printf("Usage: u6ac [options] source-file\n"
+                       "       u6ac --link [options] module-file...\n\n"
                        "Bytecode compiler for the Unlambda programming language.\n"
                        "See \"man u6ac\" for details.\n");
                 options->print_only = true;
@@ -130,7 +171,15 @@ process_options(struct arg_options* options, int argc, char** argv) {
     }
     options->input_file_name = argv[optind];
     uint32_t file_name_size = strlen(options->input_file_name);
-    if (file_name_size == 1 && options->input_file_name[0] == '-') {
+    if (options->link) {
+        // Modules are opened one at a time by u6a_link()
+        if (UNLIKELY(syntax_only)) {
+            u6a_err_custom(err_toplevel, "there is no syntax to check when linking");
+            return false;
+        }
+        options->module_files = argv + optind;
+        options->num_module_files = argc - optind;
+    } else if (file_name_size == 1 && options->input_file_name[0] == '-') {
         options->input_file = stdin;
         options->input_file_name = "STDIN";
     } else if (UNLIKELY(file_name_size > PATH_MAX - 1)) {
@@ -150,7 +199,7 @@ process_options(struct arg_options* options, int argc, char** argv) {
         }
     } else {
         if (options->codegen.file_name == NULL) {
-            if (options->input_file == stdin) {
+            if (options->input_file == stdin || options->link) {
                 goto write_to_stdout;
             } else {
                 if (UNLIKELY(file_name_size + 8 > PATH_MAX - 1)) {
@@ -182,7 +231,16 @@ process_options(struct arg_options* options, int argc, char** argv) {
     if (optimize_level > '0') {
         options->codegen.optimize_const = true;
     }
+    if (options->cache_dir == NULL) {
+        options->cache_dir = getenv(U6A_CACHE_DIR_ENV);
+    }
+    if (options->cache_dir && options->cache_dir[0] == '\0') {
+        options->cache_dir = NULL;
+    }
     u6a_logging_verbose(verbose);
+    if (options->time_report) {
+        u6a_time_report_enable();
+    }
     return true;
 }
 
@@ -191,6 +249,8 @@ main(int argc, char** argv) {
     struct arg_options options = { 0 };
     struct u6a_token* token_arr = 0;
     struct u6a_ast_node* ast_arr = 0;
+    char* source = NULL;
+    struct u6a_cache_entry cache_entry = { 0 };
     int exit_code = 0;
     u6a_logging_init(argv[0]);
     if (UNLIKELY(!process_options(&options, argc, argv))) {
@@ -200,12 +260,62 @@ main(int argc, char** argv) {
     if (UNLIKELY(options.print_only)) {
         goto terminate;
     }
+    if (options.link) {
+        u6a_info_verbose(info_toplevel, "linking %" PRIu32 " modules, writing to %s", options.num_module_files,
+            options.codegen.file_name);
+        u6a_time_report_enter(u6a_tp_write);
+        if (UNLIKELY(!u6a_write_prefix(&options.codegen, options.output_file_prefix))) {
+            exit_code = EC_ERR_CODEGEN;
+            goto terminate;
+        }
+        u6a_time_report_enter(u6a_tp_codegen);
+        if (UNLIKELY(!u6a_link(&options.codegen, options.module_files, options.num_module_files))) {
+            exit_code = EC_ERR_LINK;
+        }
+        goto terminate;
+    }
     u6a_info_verbose(info_toplevel, "reading source code from %s", options.input_file_name);
+    // Output is written to the cache first, and then copied
+    struct u6a_codegen_options codegen = options.codegen;
+    if (options.cache_dir && options.codegen.output_stream) {
+        size_t source_len;
+        if (UNLIKELY(!u6a_cache_lookup(options.cache_dir, options.input_file, &source, &source_len,
+                                       &options.codegen, options.output_file_prefix, &cache_entry))) {
+            exit_code = EC_ERR_CACHE;
+            goto terminate;
+        }
+        switch (u6a_cache_fetch(&cache_entry, options.codegen.output_stream, options.codegen.file_name)) {
+            case u6a_cs_hit:
+                u6a_info_verbose(info_toplevel, "found in cache as %s, written to %s", cache_entry.path,
+                    options.codegen.file_name);
+                goto terminate;
+            case u6a_cs_error:
+                exit_code = EC_ERR_CACHE;
+                goto terminate;
+            default:
+                break;
+        }
+        if (options.input_file != stdin) {
+            fclose(options.input_file);
+        }
+        options.input_file = u6a_cache_source_stream(source, source_len);
+        if (UNLIKELY(options.input_file == NULL)) {
+            u6a_err_custom(err_toplevel, "failed to read source code from memory");
+            exit_code = EC_ERR_CACHE;
+            goto terminate;
+        }
+        FILE* temp_stream = u6a_cache_begin(&cache_entry);
+        if (temp_stream) {
+            codegen.output_stream = temp_stream;
+        }
+    }
     uint32_t token_len;
+    u6a_time_report_enter(u6a_tp_lex);
     if (UNLIKELY(!u6a_lex(options.input_file, &token_arr, &token_len))) {
         exit_code = EC_ERR_LEX;
         goto terminate;
     }
+    u6a_time_report_enter(u6a_tp_parse);
     if (UNLIKELY(!u6a_parse(token_arr, token_len, &ast_arr))) {
         exit_code = EC_ERR_PARSE;
         goto terminate;
@@ -214,17 +324,31 @@ main(int argc, char** argv) {
         goto terminate;
     }
     u6a_info_verbose(info_toplevel, "writing to %s", options.codegen.file_name);
-    if (UNLIKELY(!u6a_write_prefix(&options.codegen, options.output_file_prefix))) {
+    u6a_time_report_enter(u6a_tp_write);
+    if (UNLIKELY(!u6a_write_prefix(&codegen, options.output_file_prefix))) {
         exit_code = EC_ERR_CODEGEN;
         goto terminate;
     }
-    if (UNLIKELY(!u6a_codegen(&options.codegen, ast_arr, token_len + 2))) {
+    // Switches to the write phase by itself, once the bytecode is generated
+    u6a_time_report_enter(u6a_tp_codegen);
+    if (UNLIKELY(!u6a_codegen(&codegen, ast_arr, token_len + 2))) {
         exit_code = EC_ERR_CODEGEN;
         goto terminate;
     }
+    if (cache_entry.temp_stream) {
+        u6a_info_verbose(info_toplevel, "added to cache as %s", cache_entry.path);
+        if (UNLIKELY(!u6a_cache_commit(&cache_entry, options.codegen.output_stream, options.codegen.file_name))) {
+            exit_code = EC_ERR_CACHE;
+        }
+    }
 
     terminate:
+    if (options.time_report && exit_code != EC_ERR_OPTIONS) {
+        u6a_time_report_print(stderr, options.time_report_format);
+    }
+    u6a_cache_abort(&cache_entry);
     arg_options_destroy(&options, exit_code);
+    free(source);
     free(token_arr);
     free(ast_arr);
     return exit_code;
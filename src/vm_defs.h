@@ -47,6 +47,7 @@ enum u6a_vm_opcode_ex {
     u6a_vo_ex_print = U6A_VM_OP_EX_LC
 };
 
+#define U6A_VM_FN_IMM        0x0c
 #define U6A_VM_FN_CHAR     ( 1 << 4 )
 #define U6A_VM_FN_REF      ( 1 << 5 )
 #define U6A_VM_FN_PROMISE  ( 1 << 6 )
@@ -57,18 +58,25 @@ enum u6a_vm_fn {
     u6a_vf_k, u6a_vf_s, u6a_vf_i, u6a_vf_v, u6a_vf_c, u6a_vf_d, u6a_vf_e,
     u6a_vf_in,                                        /* @          */
     u6a_vf_pipe,                                      /* |          */
+    u6a_vf_k1_i = U6A_VM_FN_IMM,                      /* `kX (imm)  */
+    u6a_vf_s1_i,                                      /* `sX (imm)  */
+    u6a_vf_d1_i,                                      /* `dX (imm)  */
     u6a_vf_out = U6A_VM_FN_CHAR,                      /* .X         */
     u6a_vf_cmp,                                       /* ?X         */
     u6a_vf_k1 = U6A_VM_FN_REF,                        /* `kX        */
     u6a_vf_s1,                                        /* `sX        */
     u6a_vf_s2,                                        /* ``sXY      */
     u6a_vf_c1,                                        /* `cX        */
+    u6a_vf_n1,                                        /* `NF        */
     u6a_vf_d1_s = U6A_VM_FN_PROMISE | U6A_VM_FN_REF,  /* `d`XZ      */
     u6a_vf_d1_c,                                      /* `dX        */
     u6a_vf_d1_d = U6A_VM_FN_PROMISE,                  /* `dF        */
     u6a_vf_j = U6A_VM_FN_INTERNAL,                    /* (jump)     */
     u6a_vf_f,                                         /* (finalize) */
-    u6a_vf_p                                          /* (print)    */
+    u6a_vf_p,                                         /* (print)    */
+    u6a_vf_n,                                         /* (numeral)  */
+    u6a_vf_m = U6A_VM_FN_INTERNAL | U6A_VM_FN_REF,    /* (memo)     */
+    u6a_vf_t                                          /* (task)     */
 };
 
 struct u6a_vm_ins {
@@ -84,13 +92,45 @@ struct u6a_vm_ins {
     } operand;
 };
 
+/*
+ * Dense encoding of an instruction: the opcode byte, followed by
+ *   u6a_vo_app         - two tokens, each a function byte (zero if absent), plus a character byte for .X and ?X
+ *   u6a_vo_sa, _del    - the offset, as a little-endian base-128 varint
+ *   u6a_vo_lc          - the extended opcode byte, then the offset as a varint
+ *   u6a_vo_la, _xch    - nothing
+ */
+#define U6A_VM_DENSE_INS_MAX_SIZE 7
+
+// The U6A_BC_FLAG_NO_* flag of a program which cannot apply the given function token
+static inline uint32_t
+u6a_vm_fn_feature(uint8_t fn) {
+    switch (fn) {
+        case u6a_vf_c:
+            return U6A_BC_FLAG_NO_CONT;
+        case u6a_vf_d:
+            return U6A_BC_FLAG_NO_PROMISE;
+        case u6a_vf_in:
+        case u6a_vf_cmp:
+        case u6a_vf_pipe:
+            return U6A_BC_FLAG_NO_INPUT;
+        default:
+            return 0;
+    }
+}
+
+#define U6A_VM_FN_IS_IMM(fn_)    ( ( (fn_) & ~0x03 ) == U6A_VM_FN_IMM )
+#define U6A_VM_FN_UNBOXABLE(fn_) ( !( (fn_) & U6A_VM_FN_REF ) && !U6A_VM_FN_IS_IMM(fn_) )
+
 struct u6a_vm_var_fn {
     struct u6a_token token;
-    uint16_t         reserved_;
-    uint32_t         ref;
+    struct u6a_token captured;       /* token of the value captured by an immediate closure */
+    uint32_t         ref;            /* pool offset, or ref of the value captured by an immediate closure */
 };
 
 #define U6A_VM_VAR_FN_REF(fn_, ref_) (struct u6a_vm_var_fn) { .token.fn = (fn_), .ref = (ref_) }
+#define U6A_VM_VAR_FN_IMM(fn_, var_) \
+    (struct u6a_vm_var_fn) { .token.fn = (fn_), .captured = (var_).token, .ref = (var_).ref }
+#define U6A_VM_VAR_FN_CAPTURED(var_) (struct u6a_vm_var_fn) { .token = (var_).captured, .ref = (var_).ref }
 #define U6A_VM_VAR_FN_EMPTY          (struct u6a_vm_var_fn) { 0 }
 #define U6A_VM_VAR_FN_IS_EMPTY(fn_)  ( fn_.token.fn == 0 )
 
@@ -104,7 +144,9 @@ struct u6a_vm_var_tuple {
     union u6a_vm_var v2;
 };
 
-#define U6A_VM_DEFAULT_STACK_SEGMENT_SIZE   256
+// Stack segments start at the initial size, and double up to the maximum size specified
+#define U6A_VM_INIT_STACK_SEGMENT_SIZE      256
+#define U6A_VM_DEFAULT_STACK_SEGMENT_SIZE ( 64 * 1024 )
 #define U6A_VM_MIN_STACK_SEGMENT_SIZE       64
 #define U6A_VM_MAX_STACK_SEGMENT_SIZE     ( 1024 * 1024 )
 
@@ -112,6 +154,10 @@ struct u6a_vm_var_tuple {
 #define U6A_VM_MIN_POOL_SIZE                16
 #define U6A_VM_MAX_POOL_SIZE              ( 16 * 1024 * 1024 )
 
+#define U6A_VM_DEFAULT_NURSERY_SIZE       ( 16 * 1024 )
+#define U6A_VM_MIN_NURSERY_SIZE             0
+#define U6A_VM_MAX_NURSERY_SIZE           ( 1024 * 1024 )
+
 #define U6A_VM_ERR(ctx)                     longjmp(*(ctx)->jmp_ctx, -1)
 
 #endif
@@ -0,0 +1,170 @@
+/*
+ * vm_mem.c - Unlambda VM memory mapping
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vm_mem.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+// Alignment of memory allocated with regular pages, so that pool elements never cross cache lines
+#define MEM_ALIGN 64
+
+#define ROUND_UP(size, align) ( ( (size) + (align) - 1 ) & ~(size_t)( (align) - 1 ) )
+
+#ifdef HAVE_SYS_MMAN_H
+
+static inline void*
+mem_alloc_hugetlb(size_t size) {
+#if defined(HAVE_DECL_MAP_HUGETLB) && HAVE_DECL_MAP_HUGETLB
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+#else
+    return NULL;
+#endif
+}
+
+static inline void*
+mem_alloc_thp(size_t size) {
+#if defined(HAVE_MADVISE) && defined(HAVE_DECL_MADV_HUGEPAGE) && HAVE_DECL_MADV_HUGEPAGE
+    // Over-allocate, then trim the mapping to a huge page boundary
+    const size_t map_size = size + U6A_VM_MEM_HUGE_PAGE_SIZE;
+    char* map_ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (UNLIKELY(map_ptr == MAP_FAILED)) {
+        return NULL;
+    }
+    char* ptr = (char*)ROUND_UP((uintptr_t)map_ptr, U6A_VM_MEM_HUGE_PAGE_SIZE);
+    if (ptr > map_ptr) {
+        munmap(map_ptr, ptr - map_ptr);
+    }
+    if (map_ptr + map_size > ptr + size) {
+        munmap(ptr + size, map_ptr + map_size - ptr - size);
+    }
+    if (UNLIKELY(madvise(ptr, size, MADV_HUGEPAGE))) {
+        munmap(ptr, size);
+        return NULL;
+    }
+    return ptr;
+#else
+    return NULL;
+#endif
+}
+
+#endif
+
+void*
+u6a_vm_mem_alloc(size_t size, bool huge_pages, enum u6a_vm_mem_mode* mode) {
+    void* ptr;
+#ifdef HAVE_SYS_MMAN_H
+    if (huge_pages) {
+        size = ROUND_UP(size, U6A_VM_MEM_HUGE_PAGE_SIZE);
+        if ((ptr = mem_alloc_hugetlb(size))) {
+            *mode = u6a_vm_mem_hugetlb;
+            return ptr;
+        }
+        if ((ptr = mem_alloc_thp(size))) {
+            *mode = u6a_vm_mem_thp;
+            return ptr;
+        }
+    }
+#endif
+    *mode = u6a_vm_mem_regular;
+    if (UNLIKELY(posix_memalign(&ptr, MEM_ALIGN, size))) {
+        return NULL;
+    }
+    return ptr;
+}
+
+void*
+u6a_vm_mem_map_file(int fd, size_t offset, size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+#else
+    return NULL;
+#endif
+}
+
+void
+u6a_vm_mem_free(void* ptr, size_t size, enum u6a_vm_mem_mode mode) {
+    if (ptr == NULL) {
+        return;
+    }
+#ifdef HAVE_SYS_MMAN_H
+    if (mode == u6a_vm_mem_mapped) {
+        munmap(ptr, size);
+        return;
+    }
+    if (mode != u6a_vm_mem_regular) {
+        munmap(ptr, ROUND_UP(size, U6A_VM_MEM_HUGE_PAGE_SIZE));
+        return;
+    }
+#endif
+    free(ptr);
+}
+
+void*
+u6a_vm_mem_reserve_guarded(size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+    size = ROUND_UP(size, U6A_VM_MEM_GUARD_SIZE);
+    char* ptr = mmap(NULL, size + 2 * U6A_VM_MEM_GUARD_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1, 0);
+    if (UNLIKELY(ptr == MAP_FAILED)) {
+        return NULL;
+    }
+    ptr += U6A_VM_MEM_GUARD_SIZE;
+    if (UNLIKELY(mprotect(ptr, size, PROT_READ | PROT_WRITE))) {
+        munmap(ptr - U6A_VM_MEM_GUARD_SIZE, size + 2 * U6A_VM_MEM_GUARD_SIZE);
+        return NULL;
+    }
+    return ptr;
+#else
+    return NULL;
+#endif
+}
+
+void
+u6a_vm_mem_free_guarded(void* ptr, size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+    if (ptr) {
+        munmap((char*)ptr - U6A_VM_MEM_GUARD_SIZE, ROUND_UP(size, U6A_VM_MEM_GUARD_SIZE) + 2 * U6A_VM_MEM_GUARD_SIZE);
+    }
+#endif
+}
+
+const char*
+u6a_vm_mem_mode_name(enum u6a_vm_mem_mode mode) {
+    switch (mode) {
+        case u6a_vm_mem_regular:
+            return "regular pages";
+        case u6a_vm_mem_thp:
+            return "transparent huge pages";
+        case u6a_vm_mem_hugetlb:
+            return "hugetlb pages";
+        case u6a_vm_mem_mapped:
+            return "file mapping";
+        default:
+            U6A_NOT_REACHED();
+    }
+}
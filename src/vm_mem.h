@@ -0,0 +1,62 @@
+/*
+ * vm_mem.h - Unlambda VM memory mapping definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_VM_MEM_H_
+#define U6A_VM_MEM_H_
+
+#include "common.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define U6A_VM_MEM_HUGE_PAGE_SIZE ( 2 * 1024 * 1024 )
+#define U6A_VM_MEM_GUARD_SIZE     ( 64 * 1024 )
+
+enum u6a_vm_mem_mode {
+    u6a_vm_mem_regular,
+    u6a_vm_mem_thp,                  /* transparent huge pages, via madvise() */
+    u6a_vm_mem_hugetlb,              /* pre-allocated huge pages, via MAP_HUGETLB */
+    u6a_vm_mem_mapped                /* private copy-on-write mapping of a file */
+};
+
+void*
+u6a_vm_mem_alloc(size_t size, bool huge_pages, enum u6a_vm_mem_mode* mode);
+
+void*
+u6a_vm_mem_map_file(int fd, size_t offset, size_t size);
+
+void
+u6a_vm_mem_free(void* ptr, size_t size, enum u6a_vm_mem_mode mode);
+
+/*
+ * Reserve address space for `size` bytes, committed on first touch, between two inaccessible guard regions of
+ * at least U6A_VM_MEM_GUARD_SIZE bytes. Returns NULL if not supported.
+ */
+void*
+u6a_vm_mem_reserve_guarded(size_t size);
+
+void
+u6a_vm_mem_free_guarded(void* ptr, size_t size);
+
+const char*
+u6a_vm_mem_mode_name(enum u6a_vm_mem_mode mode);
+
+#endif
@@ -20,45 +20,380 @@
  */
 
 #include "vm_pool.h"
+#include "vm_stack.h"
 #include "logging.h"
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
-bool
-u6a_vm_pool_init(struct u6a_vm_pool_ctx* ctx, uint32_t pool_len, uint32_t ins_len, jmp_buf* jmp_ctx, const char* err_stage) {
-    const uint32_t pool_size = sizeof(struct u6a_vm_pool) + pool_len * sizeof(struct u6a_vm_pool_elem);
-    ctx->active_pool = malloc(pool_size);
-    if (UNLIKELY(ctx->active_pool == NULL)) {
-        u6a_err_bad_alloc(err_stage, pool_size);
+// Every region in the pool memory block starts at a cache line boundary
+#define POOL_ALIGN  64
+#define POOL_REGION_SIZE(size) ( ( (size) + POOL_ALIGN - 1 ) & ~(size_t)( POOL_ALIGN - 1 ) )
+
+// The pool, the hole list, the free stack and the forwarding table share one memory block
+static inline size_t
+pool_layout(struct u6a_vm_pool_ctx* ctx, char* mem, uint32_t pool_len, uint32_t nursery_len, uint32_t ins_len) {
+    const size_t header_size = POOL_REGION_SIZE(sizeof(struct u6a_vm_pool));
+    const size_t values_size = POOL_REGION_SIZE(pool_len * sizeof(struct u6a_vm_var_tuple));
+    const size_t refcnts_size = POOL_REGION_SIZE(pool_len * sizeof(uint32_t));
+    const size_t holes_size = POOL_REGION_SIZE(sizeof(struct u6a_vm_pool_holes) + pool_len * sizeof(uint32_t));
+    const size_t free_stack_size = POOL_REGION_SIZE(ins_len * sizeof(uint32_t));
+    const size_t forward_size = POOL_REGION_SIZE(nursery_len * sizeof(uint32_t));
+    if (mem) {
+        ctx->active_pool = (struct u6a_vm_pool*)mem;
+        ctx->active_pool->values = (struct u6a_vm_var_tuple*)(mem += header_size);
+        ctx->active_pool->refcnts = (uint32_t*)(mem += values_size);
+        ctx->holes = (struct u6a_vm_pool_holes*)(mem += refcnts_size);
+        ctx->fstack = (uint32_t*)(mem += holes_size);
+        ctx->forward = (uint32_t*)(mem += free_stack_size);
+        ctx->pool_len = pool_len;
+        ctx->nursery_len = nursery_len;
+        ctx->fstack_len = ins_len;
+        ctx->hole_words = ( pool_len + 31 ) / 32;
+        ctx->hole_low = 0;
+    }
+    return header_size + values_size + refcnts_size + holes_size + free_stack_size + forward_size;
+}
+
+static inline void
+pool_reset(struct u6a_vm_pool_ctx* ctx) {
+    ctx->active_pool->pos = ctx->nursery_len - 1;
+    ctx->holes->pos = UINT32_MAX;
+    ctx->hole_low = 0;
+    if (ctx->policy != u6a_vp_lifo) {
+        // The bitmaps take much less space than a stack of every element in the pool
+        memset(ctx->holes->elems, 0, ( ctx->hole_words + ( ctx->hole_words + 31 ) / 32 ) * sizeof(uint32_t));
+    }
+    ctx->nursery_pos = UINT32_MAX;
+    ctx->nursery_live = 0;
+    ctx->nursery_full = false;
+    ctx->allocs = 0;
+}
+
+// Number of elements which can be allocated outside the nursery before the pool runs out of space
+static inline uint32_t
+pool_space_tenured(struct u6a_vm_pool_ctx* ctx) {
+    return ( ctx->holes->pos + 1 ) + ( ctx->pool_len - 1 - ctx->active_pool->pos );
+}
+
+static bool
+copier_grow(uint32_t** buffer, uint32_t* cap, const char* err_stage) {
+    const uint32_t new_cap = *cap ? *cap * 2 : 256;
+    uint32_t* new_buffer = realloc(*buffer, new_cap * sizeof(uint32_t));
+    if (UNLIKELY(new_buffer == NULL)) {
+        u6a_err_bad_alloc(err_stage, new_cap * sizeof(uint32_t));
         return false;
     }
-    const uint32_t holes_size = sizeof(struct u6a_vm_pool_elem_ptrs) + pool_len * sizeof(struct u6a_vm_pool_elem*);
-    ctx->holes = malloc(holes_size);
-    if (UNLIKELY(ctx->holes == NULL)) {
-        u6a_err_bad_alloc(err_stage, holes_size);
-        free(ctx->active_pool);
+    *buffer = new_buffer;
+    *cap = new_cap;
+    return true;
+}
+
+static bool
+map_prepare(struct u6a_vm_pool_map* map, uint32_t pool_len, const char* err_stage) {
+    if (LIKELY(map->pool_len == pool_len)) {
+        return true;
+    }
+    u6a_vm_pool_map_destroy(map);
+    // Pages of the map are only touched for the elements which are mapped
+    map->stamps = calloc(pool_len, sizeof(uint32_t));
+    map->offsets = malloc(pool_len * sizeof(uint32_t));
+    if (UNLIKELY(map->stamps == NULL || map->offsets == NULL)) {
+        u6a_err_bad_alloc(err_stage, pool_len * sizeof(uint32_t));
+        u6a_vm_pool_map_destroy(map);
         return false;
     }
-    const uint32_t free_stack_size = ins_len * sizeof(struct vm_pool_elem*);
-    ctx->fstack = malloc(free_stack_size);
-    if (UNLIKELY(ctx->fstack == NULL)) {
-        u6a_err_bad_alloc(err_stage, free_stack_size);
-        free(ctx->active_pool);
-        free(ctx->holes);
+    map->pool_len = pool_len;
+    map->epoch = 1;
+    return true;
+}
+
+static inline bool
+map_get(struct u6a_vm_pool_map* map, uint32_t offset, uint32_t* mapped) {
+    if (map->stamps[offset] != map->epoch) {
         return false;
     }
-    ctx->active_pool->pos = UINT32_MAX;
-    ctx->holes->pos = UINT32_MAX;
-    ctx->pool_len = pool_len;
+    *mapped = map->offsets[offset];
+    return true;
+}
+
+static inline void
+map_set(struct u6a_vm_pool_map* map, uint32_t offset, uint32_t mapped) {
+    map->stamps[offset] = map->epoch;
+    map->offsets[offset] = mapped;
+}
+
+static inline struct u6a_vm_var_fn
+copier_translate(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_pool_copier* copier, struct u6a_vm_var_fn var) {
+    if (var.token.fn & U6A_VM_FN_REF) {
+        var.ref = copier->map.offsets[var.ref];
+        u6a_vm_pool_addref(ctx->active_pool, var.ref);
+    }
+    return var;
+}
+
+static struct u6a_vm_var_fn
+pool_copy(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_pool_ctx* src, struct u6a_vm_var_fn var,
+          struct u6a_vm_pool_copier* copier, struct u6a_vm_pool_map* origins, bool back)
+{
+    if (!( var.token.fn & U6A_VM_FN_REF )) {
+        return var;
+    }
+    struct u6a_vm_pool_map* map = &copier->map;
+    if (UNLIKELY(!map_prepare(map, src->pool_len, ctx->err_stage)
+                 || ( origins && !map_prepare(origins, back ? src->pool_len : ctx->pool_len, ctx->err_stage) )
+                 || ( copier->work_cap == 0 && !copier_grow(&copier->work, &copier->work_cap, ctx->err_stage) )))
+    {
+        return U6A_VM_VAR_FN_EMPTY;
+    }
+    u6a_vm_pool_map_clear(map);
+    struct u6a_vm_pool* src_pool = src->active_pool;
+    uint32_t num_work = 0, num_copied = 0, target;
+    bool ok = true;
+    copier->work[num_work++] = var.ref;
+    // Children are copied before their parents, which is always possible as values never refer to themselves
+    while (num_work) {
+        const uint32_t offset = copier->work[num_work - 1];
+        if (map->stamps[offset] == map->epoch) {
+            --num_work;
+            continue;
+        }
+        if (back && origins && map_get(origins, offset, &target)) {
+            // Copied from `ctx` in the first place, and still there
+            --num_work;
+            map_set(map, offset, target);
+            continue;
+        }
+        const uint32_t refcnt = src_pool->refcnts[offset];
+        const struct u6a_vm_var_tuple values = src_pool->values[offset];
+        if (UNLIKELY(refcnt & U6A_VM_POOL_ELEM_HOLDS_PTR)) {
+            ok = false;
+            break;
+        }
+        const uint32_t pending = num_work;
+        const struct u6a_vm_var_fn children[2] = { values.v1.fn, values.v2.fn };
+        for (int idx = 0; idx < 2; ++idx) {
+            if (( children[idx].token.fn & U6A_VM_FN_REF ) && map->stamps[children[idx].ref] != map->epoch) {
+                if (UNLIKELY(num_work == copier->work_cap && !copier_grow(&copier->work, &copier->work_cap,
+                                                                          ctx->err_stage))) {
+                    ok = false;
+                    goto copy_done;
+                }
+                copier->work[num_work++] = children[idx].ref;
+            }
+        }
+        if (num_work != pending) {
+            continue;
+        }
+        if (UNLIKELY(pool_space_tenured(ctx) == 0 || ( num_copied == copier->copied_cap
+                     && !copier_grow(&copier->copied, &copier->copied_cap, ctx->err_stage) ))) {
+            ok = false;
+            break;
+        }
+        --num_work;
+        // Copies are never placed in the nursery, as evacuation only expects promoted elements to refer to it
+        target = u6a_vm_pool_elem_alloc_tenured_(ctx, U6A_VM_VAR_FN_EMPTY);
+        ctx->active_pool->values[target] = (struct u6a_vm_var_tuple) {
+            .v1.fn = copier_translate(ctx, copier, values.v1.fn),
+            .v2.fn = copier_translate(ctx, copier, values.v2.fn)
+        };
+        ctx->active_pool->refcnts[target] = 1 | ( refcnt & U6A_VM_POOL_ELEM_PURE );
+        map_set(map, offset, target);
+        copier->copied[num_copied++] = target;
+        if (!back && origins && offset >= src->nursery_len) {
+            // Elements in the nursery may have moved by the time the copy is copied back
+            map_set(origins, target, offset);
+        }
+    }
+
+    copy_done:
+    if (ok) {
+        var = copier_translate(ctx, copier, var);
+    }
+    // Copies are allocated with a reference held by the map, which is no longer needed
+    for (uint32_t idx = 0; idx < num_copied; ++idx) {
+        u6a_vm_pool_free(ctx, copier->copied[idx]);
+    }
+    return ok ? var : U6A_VM_VAR_FN_EMPTY;
+}
+
+bool
+u6a_vm_pool_init(struct u6a_vm_pool_ctx* ctx, uint32_t pool_len, uint32_t nursery_len, uint32_t ins_len,
+                 enum u6a_vm_pool_policy policy, bool huge_pages, jmp_buf* jmp_ctx, const char* err_stage)
+{
+    // Leave at least half of the pool for tenured elements
+    if (nursery_len > pool_len / 2) {
+        nursery_len = pool_len / 2;
+    }
+    ctx->mem_size = pool_layout(ctx, NULL, pool_len, nursery_len, ins_len);
+    char* mem = u6a_vm_mem_alloc(ctx->mem_size, huge_pages, &ctx->mem_mode);
+    if (UNLIKELY(mem == NULL)) {
+        u6a_err_bad_alloc(err_stage, ctx->mem_size);
+        return false;
+    }
+    pool_layout(ctx, mem, pool_len, nursery_len, ins_len);
+    ctx->policy = policy;
+    pool_reset(ctx);
+    ctx->tags = NULL;
     ctx->jmp_ctx = jmp_ctx;
     ctx->err_stage = err_stage;
     return true;
 }
 
+size_t
+u6a_vm_pool_mem_size(uint32_t pool_len, uint32_t nursery_len, uint32_t ins_len) {
+    return pool_layout(NULL, NULL, pool_len, nursery_len, ins_len);
+}
+
+void
+u6a_vm_pool_attach(struct u6a_vm_pool_ctx* ctx, void* mem, enum u6a_vm_mem_mode mem_mode, uint32_t pool_len,
+                   uint32_t nursery_len, uint32_t ins_len, enum u6a_vm_pool_policy policy, jmp_buf* jmp_ctx,
+                   const char* err_stage)
+{
+    ctx->mem_size = pool_layout(ctx, mem, pool_len, nursery_len, ins_len);
+    ctx->mem_mode = mem_mode;
+    ctx->policy = policy;
+    ctx->tags = NULL;
+    ctx->jmp_ctx = jmp_ctx;
+    ctx->err_stage = err_stage;
+}
+
+void
+u6a_vm_pool_evacuate(struct u6a_vm_pool_ctx* ctx) {
+    struct u6a_vm_pool* pool = ctx->active_pool;
+    // Promoted elements are not counted again as allocations
+    ctx->allocs += ctx->nursery_pos + 1 - ctx->nursery_live;
+    // Promote surviving elements out of the nursery
+    for (uint32_t offset = 0; offset < ctx->nursery_pos + 1; ++offset) {
+        const uint32_t refcnt = pool->refcnts[offset];
+        if (refcnt & U6A_VM_POOL_REFCNT_MASK) {
+            const bool holds_ptr = refcnt & U6A_VM_POOL_ELEM_HOLDS_PTR;
+            uint32_t new_offset = u6a_vm_pool_elem_alloc_tenured_(ctx,
+                holds_ptr ? U6A_VM_VAR_FN_EMPTY : pool->values[offset].v1.fn);
+            pool->values[new_offset] = pool->values[offset];
+            pool->refcnts[new_offset] = refcnt;
+            ctx->forward[offset] = new_offset;
+            if (UNLIKELY(ctx->tags)) {
+                ctx->tags[new_offset] = ctx->tags[offset];
+            }
+        }
+    }
+    // Pool elements are immutable once created, so only those just promoted may refer to the nursery
+    for (uint32_t offset = 0; offset < ctx->nursery_pos + 1; ++offset) {
+        if (pool->refcnts[offset] & U6A_VM_POOL_REFCNT_MASK) {
+            uint32_t new_offset = ctx->forward[offset];
+            if (!(pool->refcnts[new_offset] & U6A_VM_POOL_ELEM_HOLDS_PTR)) {
+                struct u6a_vm_var_tuple* values = pool->values + new_offset;
+                values->v1.fn = u6a_vm_pool_forward(ctx, values->v1.fn);
+                values->v2.fn = u6a_vm_pool_forward(ctx, values->v2.fn);
+            }
+            pool->refcnts[offset] = 0;
+        }
+    }
+    for (struct u6a_vm_stack* vs = ctx->stack_ctx->segments; vs; vs = vs->next_seg) {
+        for (uint32_t idx = vs->top; idx < UINT32_MAX; --idx) {
+            vs->elems[idx] = u6a_vm_pool_forward(ctx, vs->elems[idx]);
+        }
+    }
+    for (struct u6a_vm_var_fn* elem = ctx->stack_ctx->flat_base; elem && elem <= ctx->stack_ctx->flat_top; ++elem) {
+        *elem = u6a_vm_pool_forward(ctx, *elem);
+    }
+    ctx->nursery_pos = UINT32_MAX;
+    ctx->nursery_live = 0;
+    ctx->nursery_full = false;
+}
+
+const char*
+u6a_vm_pool_policy_name(enum u6a_vm_pool_policy policy) {
+    switch (policy) {
+        case u6a_vp_lifo:
+            return "most recently freed";
+        case u6a_vp_ordered:
+            return "lowest";
+        case u6a_vp_near:
+            return "nearest";
+        default:
+            U6A_NOT_REACHED();
+    }
+}
+
+uint32_t
+u6a_vm_pool_next_live(struct u6a_vm_pool_ctx* ctx, uint32_t offset) {
+    struct u6a_vm_pool* pool = ctx->active_pool;
+    // The nursery and the tenured elements, the latter ending one slot short of where an allocation failed
+    const uint32_t nursery_end = (uint32_t)( ctx->nursery_pos + 1 );
+    const uint32_t tenured_end = pool->pos == ctx->pool_len ? ctx->pool_len : pool->pos + 1;
+    for (++offset; ; ++offset) {
+        if (offset == nursery_end) {
+            offset = ctx->nursery_len;
+        }
+        if (offset >= tenured_end) {
+            return UINT32_MAX;
+        }
+        if (pool->refcnts[offset] & U6A_VM_POOL_REFCNT_MASK) {
+            return offset;
+        }
+    }
+}
+
+void
+u6a_vm_pool_count(struct u6a_vm_pool_ctx* ctx, uint32_t* live, uint32_t* conts) {
+    *live = *conts = 0;
+    for (uint32_t offset = u6a_vm_pool_next_live(ctx, UINT32_MAX); offset != UINT32_MAX;
+         offset = u6a_vm_pool_next_live(ctx, offset))
+    {
+        ++*live;
+        *conts += ( ctx->active_pool->refcnts[offset] & U6A_VM_POOL_ELEM_HOLDS_PTR ) != 0;
+    }
+}
+
+struct u6a_vm_var_fn
+u6a_vm_pool_copy(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_pool_ctx* src, struct u6a_vm_var_fn var,
+                 struct u6a_vm_pool_copier* copier, struct u6a_vm_pool_map* origins)
+{
+    return pool_copy(ctx, src, var, copier, origins, false);
+}
+
+struct u6a_vm_var_fn
+u6a_vm_pool_copy_back(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_pool_ctx* src, struct u6a_vm_var_fn var,
+                      struct u6a_vm_pool_copier* copier, struct u6a_vm_pool_map* origins)
+{
+    return pool_copy(ctx, src, var, copier, origins, true);
+}
+
+void
+u6a_vm_pool_map_clear(struct u6a_vm_pool_map* map) {
+    if (UNLIKELY(++map->epoch == 0)) {
+        if (map->stamps) {
+            memset(map->stamps, 0, map->pool_len * sizeof(uint32_t));
+        }
+        map->epoch = 1;
+    }
+}
+
+void
+u6a_vm_pool_map_destroy(struct u6a_vm_pool_map* map) {
+    free(map->stamps);
+    free(map->offsets);
+    *map = (struct u6a_vm_pool_map) { 0 };
+}
+
+void
+u6a_vm_pool_copier_destroy(struct u6a_vm_pool_copier* copier) {
+    u6a_vm_pool_map_destroy(&copier->map);
+    free(copier->work);
+    free(copier->copied);
+    *copier = (struct u6a_vm_pool_copier) { 0 };
+}
+
+void
+u6a_vm_pool_reset(struct u6a_vm_pool_ctx* ctx) {
+    pool_reset(ctx);
+}
+
 void
 u6a_vm_pool_destroy(struct u6a_vm_pool_ctx* ctx) {
-    free(ctx->active_pool);
-    free(ctx->holes);
-    free(ctx->fstack);
+    u6a_vm_mem_free(ctx->active_pool, ctx->mem_size, ctx->mem_mode);
+    ctx->active_pool = NULL;
 }
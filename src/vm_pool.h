@@ -24,38 +24,79 @@
 
 #include "common.h"
 #include "vm_defs.h"
+#include "vm_mem.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <setjmp.h>
 
-struct u6a_vm_pool_elem {
-    struct u6a_vm_var_tuple values;
-    uint32_t                refcnt;
-    uint32_t                flags;
+// Element values and reference counts are kept in separate arrays, so that each value tuple
+// occupies exactly 16 bytes (a quarter of a cache line) and is never split across lines.
+
+struct u6a_vm_pool {
+    struct u6a_vm_var_tuple* values;
+    uint32_t*                refcnts;
+    uint32_t                 pos;
 };
 
-#define U6A_VM_POOL_ELEM_HOLDS_PTR ( 1 << 0 )
+// The most significant bit of the refcount word marks elements holding a continuation, and the next one
+// marks closures which can be applied without side effects, as recorded when memoizing applications
+#define U6A_VM_POOL_ELEM_HOLDS_PTR ( UINT32_C(1) << 31 )
+#define U6A_VM_POOL_ELEM_PURE      ( UINT32_C(1) << 30 )
+#define U6A_VM_POOL_REFCNT_MASK    ( U6A_VM_POOL_ELEM_PURE - 1 )
 
-struct u6a_vm_pool {
-    uint32_t pos;
-    struct u6a_vm_pool_elem elems[];
+// Where an element was allocated, recorded in a separate array only when profiling the heap
+struct u6a_vm_pool_tag {
+    uint32_t site;                   /* offset of the allocating instruction in .text, including the prelude */
+    uint32_t kind;                   /* function token referring to the element, 0 if unknown */
+};
+
+enum u6a_vm_pool_policy {
+    u6a_vp_lifo,                     /* reuse the most recently freed hole */
+    u6a_vp_ordered,                  /* reuse the hole with the lowest offset */
+    u6a_vp_near,                     /* reuse the first hole after the element being referred to */
+    u6a_vp_max_
 };
 
-struct u6a_vm_pool_elem_ptrs {
+// Summary words searched for a hole near the element being referred to, before falling back to the lowest hole
+#define U6A_VM_POOL_NEAR_WINDOW    2
+
+// With the LIFO policy, `elems` is a stack of holes. Otherwise, it is a bitmap of holes, followed by
+// a summary bitmap with one bit for each non-empty word, so that holes are found in address order.
+// Either way, `pos + 1` is the number of holes.
+
+struct u6a_vm_pool_holes {
     uint32_t pos;
-    struct u6a_vm_pool_elem* elems[];
+    uint32_t elems[];
 };
 
+// Elements below `nursery_len` form the nursery, which is allocated from with a bump pointer
+// and recycled as a whole once every element in it is freed. When the nursery fills up, the
+// surviving elements are promoted to the rest of the pool at the next safe point.
+
 struct u6a_vm_pool_ctx {
-    struct u6a_vm_pool*           active_pool;
-    struct u6a_vm_pool_elem_ptrs* holes;
-    struct u6a_vm_pool_elem**     fstack;
-    struct u6a_vm_stack_ctx*      stack_ctx;
-    uint32_t                      pool_len;
-    uint32_t                      fstack_top;
-    jmp_buf*                      jmp_ctx;
-    const char*                   err_stage;
+    struct u6a_vm_pool*       active_pool;
+    struct u6a_vm_pool_holes* holes;
+    uint32_t*                 fstack;
+    uint32_t*                 forward;
+    struct u6a_vm_pool_tag*   tags;
+    struct u6a_vm_stack_ctx*  stack_ctx;
+    enum u6a_vm_pool_policy   policy;
+    uint32_t                  hole_words;
+    uint32_t                  hole_low;
+    uint32_t                  pool_len;
+    uint32_t                  fstack_top;
+    uint32_t                  fstack_len;
+    uint32_t                  nursery_len;
+    uint32_t                  nursery_pos;
+    uint32_t                  nursery_live;
+    volatile bool             nursery_full;    /* also set by signal handlers to request a safe point */
+    uint64_t                  allocs;          /* elements allocated, except those in the nursery since its reset */
+    size_t                    mem_size;
+    enum u6a_vm_mem_mode      mem_mode;
+    jmp_buf*                  jmp_ctx;
+    const char*               err_stage;
 };
 
 // Forward declarations
@@ -72,113 +113,288 @@ u6a_err_vm_pool_oom(const char* stage);
 static inline void
 u6a_free_stack_push_(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_var_fn fn) {
     if (fn.token.fn & U6A_VM_FN_REF) {
-        ctx->fstack[++ctx->fstack_top] = ctx->active_pool->elems + fn.ref;
+        ctx->fstack[++ctx->fstack_top] = fn.ref;
     }
 }
 
-static inline struct u6a_vm_pool_elem*
+static inline uint32_t
 u6a_free_stack_pop_(struct u6a_vm_pool_ctx* ctx) {
     if (ctx->fstack_top == UINT32_MAX) {
-        return NULL;
+        return UINT32_MAX;
     }
     return ctx->fstack[ctx->fstack_top--];
 }
 
-static inline struct u6a_vm_pool_elem*
-u6a_vm_pool_elem_alloc_(struct u6a_vm_pool_ctx* ctx) {
+// Find the first word of the hole bitmap from `word` on which has a hole, looking into at most
+// `max_summary_words` words of the summary bitmap, or UINT32_MAX if not found.
+static inline uint32_t
+u6a_vm_pool_hole_word_(struct u6a_vm_pool_ctx* ctx, uint32_t word, uint32_t max_summary_words) {
+    const uint32_t* summary = ctx->holes->elems + ctx->hole_words;
+    const uint32_t summary_words = ( ctx->hole_words + 31 ) / 32;
+    uint32_t summary_word = word / 32;
+    const uint32_t summary_end = max_summary_words < summary_words - summary_word
+        ? summary_word + max_summary_words : summary_words;
+    uint32_t summary_bits = summary[summary_word] & ( UINT32_MAX << word % 32 );
+    while (!summary_bits) {
+        if (++summary_word == summary_end) {
+            return UINT32_MAX;
+        }
+        summary_bits = summary[summary_word];
+    }
+    return summary_word * 32 + U6A_CTZ(summary_bits);
+}
+
+static inline uint32_t
+u6a_vm_pool_hole_take_(struct u6a_vm_pool_ctx* ctx, uint32_t word) {
+    uint32_t* bitmap = ctx->holes->elems;
+    const uint32_t offset = word * 32 + U6A_CTZ(bitmap[word]);
+    if (( bitmap[word] &= ~( UINT32_C(1) << offset % 32 ) ) == 0) {
+        bitmap[ctx->hole_words + word / 32] &= ~( UINT32_C(1) << word % 32 );
+    }
+    --ctx->holes->pos;
+    return offset;
+}
+
+static inline void
+u6a_vm_pool_hole_put_(struct u6a_vm_pool_ctx* ctx, uint32_t offset) {
+    struct u6a_vm_pool_holes* holes = ctx->holes;
+    if (LIKELY(ctx->policy == u6a_vp_lifo)) {
+        holes->elems[++holes->pos] = offset;
+    } else {
+        const uint32_t word = offset / 32;
+        holes->elems[word] |= UINT32_C(1) << offset % 32;
+        holes->elems[ctx->hole_words + word / 32] |= UINT32_C(1) << word % 32;
+        ++holes->pos;
+        if (word < ctx->hole_low) {
+            ctx->hole_low = word;
+        }
+    }
+}
+
+static inline uint32_t
+u6a_vm_pool_elem_alloc_tenured_(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_var_fn near) {
     struct u6a_vm_pool* pool = ctx->active_pool;
-    struct u6a_vm_pool_elem_ptrs* holes = ctx->holes;
-    struct u6a_vm_pool_elem* new_elem;
-    if (ctx->holes->pos == UINT32_MAX) {
+    struct u6a_vm_pool_holes* holes = ctx->holes;
+    uint32_t offset;
+    ++ctx->allocs;
+    if (holes->pos == UINT32_MAX) {
         if (UNLIKELY(++pool->pos == ctx->pool_len)) {
             u6a_err_vm_pool_oom(ctx->err_stage);
             U6A_VM_ERR(ctx);
         }
-        new_elem = pool->elems + pool->pos;
+        offset = pool->pos;
+    } else if (LIKELY(ctx->policy == u6a_vp_lifo)) {
+        offset = holes->elems[holes->pos--];
     } else {
-        new_elem = holes->elems[holes->pos--];
+        uint32_t word = UINT32_MAX;
+        if (ctx->policy == u6a_vp_near && ( near.token.fn & U6A_VM_FN_REF )) {
+            word = u6a_vm_pool_hole_word_(ctx, near.ref / 32, U6A_VM_POOL_NEAR_WINDOW);
+        }
+        if (word == UINT32_MAX) {
+            // No word below `hole_low` has a hole
+            word = ctx->hole_low = u6a_vm_pool_hole_word_(ctx, ctx->hole_low, UINT32_MAX);
+        }
+        offset = u6a_vm_pool_hole_take_(ctx, word);
     }
-    new_elem->refcnt = 1;
-    return new_elem;
+    return offset;
 }
 
-static inline struct u6a_vm_pool_elem*
-u6a_vm_pool_elem_dup_(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_pool_elem* elem) {
-    struct u6a_vm_pool_elem* new_elem = u6a_vm_pool_elem_alloc_(ctx);
-    *new_elem = *elem;
-    return new_elem;
+// Elements outside the nursery are placed with regard to `near`, an element they refer to, if any
+static inline uint32_t
+u6a_vm_pool_elem_alloc_(struct u6a_vm_pool_ctx* ctx, uint32_t flags, struct u6a_vm_var_fn near) {
+    uint32_t offset;
+    // No VM instruction allocates more than one element, so the nursery never overflows
+    // before the next safe point as long as `nursery_full` is set upon taking its last slot.
+    if (LIKELY(ctx->nursery_pos + 1 < ctx->nursery_len)) {
+        offset = ++ctx->nursery_pos;
+        ++ctx->nursery_live;
+        if (UNLIKELY(offset + 1 == ctx->nursery_len)) {
+            ctx->nursery_full = true;
+        }
+    } else {
+        offset = u6a_vm_pool_elem_alloc_tenured_(ctx, near);
+    }
+    ctx->active_pool->refcnts[offset] = 1 | flags;
+    return offset;
 }
 
 bool
-u6a_vm_pool_init(struct u6a_vm_pool_ctx* ctx, uint32_t pool_len, uint32_t ins_len, jmp_buf* jmp_ctx, const char* err_stage);
+u6a_vm_pool_init(struct u6a_vm_pool_ctx* ctx, uint32_t pool_len, uint32_t nursery_len, uint32_t ins_len,
+                 enum u6a_vm_pool_policy policy, bool huge_pages, jmp_buf* jmp_ctx, const char* err_stage);
+
+size_t
+u6a_vm_pool_mem_size(uint32_t pool_len, uint32_t nursery_len, uint32_t ins_len);
+
+void
+u6a_vm_pool_attach(struct u6a_vm_pool_ctx* ctx, void* mem, enum u6a_vm_mem_mode mem_mode, uint32_t pool_len,
+                   uint32_t nursery_len, uint32_t ins_len, enum u6a_vm_pool_policy policy, jmp_buf* jmp_ctx,
+                   const char* err_stage);
 
 static inline uint32_t
-u6a_vm_pool_alloc1(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_var_fn v1) {
-    struct u6a_vm_pool_elem* elem = u6a_vm_pool_elem_alloc_(ctx);
-    elem->values = (struct u6a_vm_var_tuple) { .v1.fn = v1, .v2.ptr = NULL };
-    elem->flags = 0;
-    return elem - ctx->active_pool->elems;
+u6a_vm_pool_alloc1(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_var_fn v1, uint32_t flags) {
+    uint32_t offset = u6a_vm_pool_elem_alloc_(ctx, flags, v1);
+    ctx->active_pool->values[offset] = (struct u6a_vm_var_tuple) { .v1.fn = v1, .v2.ptr = NULL };
+    return offset;
 }
 
 static inline uint32_t
-u6a_vm_pool_alloc2(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_var_fn v1, struct u6a_vm_var_fn v2) {
-    struct u6a_vm_pool_elem* elem = u6a_vm_pool_elem_alloc_(ctx);
-    elem->values = (struct u6a_vm_var_tuple) { .v1.fn = v1, .v2.fn = v2 };
-    elem->flags = 0;
-    return elem - ctx->active_pool->elems;
+u6a_vm_pool_alloc2(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_var_fn v1, struct u6a_vm_var_fn v2, uint32_t flags) {
+    uint32_t offset = u6a_vm_pool_elem_alloc_(ctx, flags, v1);
+    ctx->active_pool->values[offset] = (struct u6a_vm_var_tuple) { .v1.fn = v1, .v2.fn = v2 };
+    return offset;
 }
 
 static inline uint32_t
 u6a_vm_pool_alloc2_ptr(struct u6a_vm_pool_ctx* ctx, void* v1, void* v2) {
-    struct u6a_vm_pool_elem* elem = u6a_vm_pool_elem_alloc_(ctx);
-    elem->values = (struct u6a_vm_var_tuple) { .v1.ptr = v1, .v2.ptr = v2 };
-    elem->flags = U6A_VM_POOL_ELEM_HOLDS_PTR;
-    return elem - ctx->active_pool->elems;
+    uint32_t offset = u6a_vm_pool_elem_alloc_(ctx, U6A_VM_POOL_ELEM_HOLDS_PTR, U6A_VM_VAR_FN_EMPTY);
+    ctx->active_pool->values[offset] = (struct u6a_vm_var_tuple) { .v1.ptr = v1, .v2.ptr = v2 };
+    return offset;
 }
 
 static inline union u6a_vm_var
 u6a_vm_pool_get1(struct u6a_vm_pool* pool, uint32_t offset) {
-    return pool->elems[offset].values.v1;
+    return pool->values[offset].v1;
 }
 
 static inline struct u6a_vm_var_tuple
 u6a_vm_pool_get2(struct u6a_vm_pool* pool, uint32_t offset) {
-    return pool->elems[offset].values;
+    return pool->values[offset];
 }
 
 static inline struct u6a_vm_var_tuple
 u6a_vm_pool_get2_separate(struct u6a_vm_pool_ctx* ctx, uint32_t offset) {
-    struct u6a_vm_pool_elem* elem = ctx->active_pool->elems + offset;
-    struct u6a_vm_var_tuple values = elem->values;
-    if (elem->refcnt > 1) {
+    struct u6a_vm_pool* pool = ctx->active_pool;
+    struct u6a_vm_var_tuple values = pool->values[offset];
+    if ((pool->refcnts[offset] & U6A_VM_POOL_REFCNT_MASK) > 1) {
         // Continuation having more than 1 reference should be separated before reinstatement
         values.v1.ptr = u6a_vm_stack_dup(ctx->stack_ctx, values.v1.ptr);
+    } else {
+        // Otherwise the stack is taken over, and must not be discarded once the continuation is freed
+        pool->refcnts[offset] &= ~U6A_VM_POOL_ELEM_HOLDS_PTR;
+        pool->values[offset].v1.fn = U6A_VM_VAR_FN_EMPTY;
+        pool->values[offset].v2.fn = U6A_VM_VAR_FN_EMPTY;
     }
     return values;
 }
 
+static inline void
+u6a_vm_pool_prefetch(struct u6a_vm_pool* pool, struct u6a_vm_var_fn var) {
+    if (var.token.fn & U6A_VM_FN_REF) {
+        U6A_PREFETCH(pool->values + var.ref);
+    }
+}
+
 static inline void
 u6a_vm_pool_addref(struct u6a_vm_pool* pool, uint32_t offset) {
-    ++pool->elems[offset].refcnt;
+    ++pool->refcnts[offset];
 }
 
 static inline void
 u6a_vm_pool_free(struct u6a_vm_pool_ctx* ctx, uint32_t offset) {
-    struct u6a_vm_pool_elem* elem = ctx->active_pool->elems + offset;
-    struct u6a_vm_pool_elem_ptrs* holes = ctx->holes;
+    struct u6a_vm_pool* pool = ctx->active_pool;
     ctx->fstack_top = UINT32_MAX;
     do {
-        if (--elem->refcnt == 0) {
-            holes->elems[++holes->pos] = elem;
-            if (elem->flags & U6A_VM_POOL_ELEM_HOLDS_PTR) {
+        uint32_t refcnt = --pool->refcnts[offset];
+        if ((refcnt & U6A_VM_POOL_REFCNT_MASK) == 0) {
+            if (offset < ctx->nursery_len) {
+                if (--ctx->nursery_live == 0) {
+                    // Every element in the nursery is dead, recycle it as a whole
+                    ctx->allocs += ctx->nursery_pos + 1;
+                    ctx->nursery_pos = UINT32_MAX;
+                    ctx->nursery_full = false;
+                }
+            } else {
+                u6a_vm_pool_hole_put_(ctx, offset);
+            }
+            struct u6a_vm_var_tuple* values = pool->values + offset;
+            if (refcnt & U6A_VM_POOL_ELEM_HOLDS_PTR) {
                 // Continuation destroyed before used
-                u6a_vm_stack_discard(ctx->stack_ctx, elem->values.v1.ptr);
+                u6a_vm_stack_discard(ctx->stack_ctx, values->v1.ptr);
             } else {
-                u6a_free_stack_push_(ctx, elem->values.v2.fn);
-                u6a_free_stack_push_(ctx, elem->values.v1.fn);
+                u6a_free_stack_push_(ctx, values->v2.fn);
+                u6a_free_stack_push_(ctx, values->v1.fn);
             }
         }
-    } while ((elem = u6a_free_stack_pop_(ctx)));
+    } while ((offset = u6a_free_stack_pop_(ctx)) != UINT32_MAX);
+}
+
+void
+u6a_vm_pool_evacuate(struct u6a_vm_pool_ctx* ctx);
+
+// Number of elements allocated so far, including those promoted out of the nursery only once
+static inline uint64_t
+u6a_vm_pool_allocs(struct u6a_vm_pool_ctx* ctx) {
+    return ctx->allocs + (uint32_t)( ctx->nursery_pos + 1 );
+}
+
+// Offset of the first live element after `offset`, in no particular order, or UINT32_MAX if there is none.
+// Pass UINT32_MAX to get the first one.
+uint32_t
+u6a_vm_pool_next_live(struct u6a_vm_pool_ctx* ctx, uint32_t offset);
+
+// Which holes are reused first under the policy, for diagnostics
+const char*
+u6a_vm_pool_policy_name(enum u6a_vm_pool_policy policy);
+
+// Count the live elements, and the continuations among them
+void
+u6a_vm_pool_count(struct u6a_vm_pool_ctx* ctx, uint32_t* live, uint32_t* conts);
+
+// Offsets of elements of a pool mapped to those of another pool
+struct u6a_vm_pool_map {
+    uint32_t* stamps;                /* `epoch` in which each element was mapped */
+    uint32_t* offsets;
+    uint32_t  epoch;
+    uint32_t  pool_len;
+};
+
+// Scratch space for copying values between pools
+struct u6a_vm_pool_copier {
+    struct u6a_vm_pool_map map;      /* elements of the source pool to their copies */
+    uint32_t* work;                  /* elements waiting for their children to be copied */
+    uint32_t* copied;
+    uint32_t  work_cap;
+    uint32_t  copied_cap;
+};
+
+/*
+ * Copy `var`, and every element it refers to in the pool of `src`, to the pool of `ctx`, preserving sharing.
+ * Neither pool may be used by another thread meanwhile. Continuations cannot be copied. Returns an empty
+ * value, having copied nothing, if `ctx` runs out of space, or if the copy cannot be made.
+ * Unless NULL, `origins` records the elements outside the nursery of `src` which the copies are made from.
+ */
+struct u6a_vm_var_fn
+u6a_vm_pool_copy(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_pool_ctx* src, struct u6a_vm_var_fn var,
+                 struct u6a_vm_pool_copier* copier, struct u6a_vm_pool_map* origins);
+
+/*
+ * Like u6a_vm_pool_copy(), but elements of `src` recorded in `origins` by copying from `ctx` are not copied,
+ * and the elements they were made from are referred to instead. Those must be kept alive in both pools meanwhile.
+ */
+struct u6a_vm_var_fn
+u6a_vm_pool_copy_back(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_pool_ctx* src, struct u6a_vm_var_fn var,
+                      struct u6a_vm_pool_copier* copier, struct u6a_vm_pool_map* origins);
+
+// Forget every element mapped so far
+void
+u6a_vm_pool_map_clear(struct u6a_vm_pool_map* map);
+
+void
+u6a_vm_pool_map_destroy(struct u6a_vm_pool_map* map);
+
+void
+u6a_vm_pool_copier_destroy(struct u6a_vm_pool_copier* copier);
+
+// Make every element of the pool free, as if it was just initialized
+void
+u6a_vm_pool_reset(struct u6a_vm_pool_ctx* ctx);
+
+static inline struct u6a_vm_var_fn
+u6a_vm_pool_forward(struct u6a_vm_pool_ctx* ctx, struct u6a_vm_var_fn var) {
+    if ((var.token.fn & U6A_VM_FN_REF) && var.ref < ctx->nursery_len) {
+        var.ref = ctx->forward[var.ref];
+    }
+    return var;
 }
 
 void
@@ -0,0 +1,308 @@
+/*
+ * vm_snapshot.c - Unlambda VM heap snapshot
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vm_snapshot.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Offset of the pool image in the snapshot file, which is mapped into memory upon loading
+#define SNAPSHOT_POOL_ALIGN ( 64 * 1024 )
+
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+// Snapshots are stored in host byte order, and are only meant to be loaded by the same build of u6a
+struct snapshot_header {
+    uint8_t                     magic;
+    uint8_t                     ver_major;
+    uint8_t                     ver_minor;
+    uint8_t                     ptr_size;
+    uint32_t                    byte_order;
+    uint32_t                    text_len;
+    uint32_t                    rodata_len;
+    uint32_t                    pool_len;
+    uint32_t                    nursery_len;
+    uint32_t                    nursery_pos;
+    uint32_t                    nursery_live;
+    uint32_t                    fstack_len;
+    uint32_t                    pool_policy;
+    uint32_t                    seg_len_max;
+    uint32_t                    seg_count;
+    uint32_t                    active_seg;
+    uint64_t                    pool_offset;
+    uint64_t                    pool_size;
+    struct u6a_vm_snapshot_regs regs;
+};
+
+struct snapshot_seg_header {
+    uint32_t prev;                   /* index of previous segment, UINT32_MAX if none */
+    uint32_t top;
+    uint32_t cap;
+    uint32_t refcnt;
+};
+
+struct seg_index {
+    struct u6a_vm_stack* vs;
+    uint32_t             idx;
+};
+
+static int
+seg_index_cmp(const void* lhs, const void* rhs) {
+    const struct u6a_vm_stack* l = ((const struct seg_index*)lhs)->vs;
+    const struct u6a_vm_stack* r = ((const struct seg_index*)rhs)->vs;
+    return l < r ? -1 : l > r;
+}
+
+static inline uint32_t
+seg_index_find(const struct seg_index* index, uint32_t count, const struct u6a_vm_stack* vs) {
+    if (vs == NULL) {
+        return UINT32_MAX;
+    }
+    const struct seg_index key = { .vs = (struct u6a_vm_stack*)vs };
+    const struct seg_index* found = bsearch(&key, index, count, sizeof(struct seg_index), seg_index_cmp);
+    return found->idx;
+}
+
+// Continuations hold pointers to stack segments and instructions, which are stored as indices and offsets
+static inline void
+pool_swizzle(struct u6a_vm_pool_ctx* pool_ctx, const struct seg_index* index, struct u6a_vm_stack** segs,
+             uint32_t seg_count, struct u6a_vm_ins* text, bool to_file)
+{
+    struct u6a_vm_pool* pool = pool_ctx->active_pool;
+    for (uint32_t offset = 0; offset < pool->pos + 1; ++offset) {
+        uint32_t refcnt = pool->refcnts[offset];
+        if ((refcnt & U6A_VM_POOL_ELEM_HOLDS_PTR) && (refcnt & U6A_VM_POOL_REFCNT_MASK)) {
+            struct u6a_vm_var_tuple* values = pool->values + offset;
+            if (to_file) {
+                values->v1.ptr = (void*)(uintptr_t)seg_index_find(index, seg_count, values->v1.ptr);
+                values->v2.ptr = (void*)(uintptr_t)((struct u6a_vm_ins*)values->v2.ptr - text);
+            } else {
+                values->v1.ptr = segs[(uintptr_t)values->v1.ptr];
+                values->v2.ptr = text + (uintptr_t)values->v2.ptr;
+            }
+        }
+    }
+}
+
+bool
+u6a_vm_snapshot_save(const char* file_name, const struct u6a_vm_snapshot* snapshot,
+                     struct u6a_vm_stack_ctx* stack_ctx, struct u6a_vm_pool_ctx* pool_ctx, const char* err_stage)
+{
+    uint32_t seg_count = 0;
+    for (struct u6a_vm_stack* vs = stack_ctx->segments; vs; vs = vs->next_seg) {
+        ++seg_count;
+    }
+    const size_t index_size = seg_count * ( sizeof(struct seg_index) + sizeof(struct u6a_vm_stack*) );
+    struct seg_index* index = malloc(index_size);
+    if (UNLIKELY(index == NULL && index_size > 0)) {
+        u6a_err_bad_alloc(err_stage, index_size);
+        return false;
+    }
+    struct u6a_vm_stack** segs = (struct u6a_vm_stack**)(index + seg_count);
+    uint32_t idx = 0;
+    for (struct u6a_vm_stack* vs = stack_ctx->segments; vs; vs = vs->next_seg) {
+        index[idx] = (struct seg_index) { .vs = vs, .idx = idx };
+        segs[idx++] = vs;
+    }
+    qsort(index, seg_count, sizeof(struct seg_index), seg_index_cmp);
+    FILE* stream = fopen(file_name, "w");
+    if (UNLIKELY(stream == NULL)) {
+        u6a_err_cannot_open_file(err_stage, file_name);
+        free(index);
+        return false;
+    }
+    size_t segs_size = 0;
+    for (struct u6a_vm_stack* vs = stack_ctx->segments; vs; vs = vs->next_seg) {
+        segs_size += sizeof(struct snapshot_seg_header) + (vs->top + 1) * sizeof(struct u6a_vm_var_fn);
+    }
+    const size_t pool_offset = sizeof(struct snapshot_header) + snapshot->text_len * sizeof(struct u6a_vm_ins)
+        + snapshot->rodata_len + segs_size;
+    struct snapshot_header header = {
+        .magic         = U6A_MAGIC,
+        .ver_major     = U6A_VER_MAJOR,
+        .ver_minor     = U6A_VER_MINOR,
+        .ptr_size      = sizeof(void*),
+        .byte_order    = SNAPSHOT_BYTE_ORDER,
+        .text_len      = snapshot->text_len,
+        .rodata_len    = snapshot->rodata_len,
+        .pool_len      = pool_ctx->pool_len,
+        .nursery_len   = pool_ctx->nursery_len,
+        .nursery_pos   = pool_ctx->nursery_pos,
+        .nursery_live  = pool_ctx->nursery_live,
+        .fstack_len    = pool_ctx->fstack_len,
+        .pool_policy   = pool_ctx->policy,
+        .seg_len_max   = stack_ctx->seg_len_max,
+        .seg_count     = seg_count,
+        .active_seg    = seg_index_find(index, seg_count, stack_ctx->active_stack),
+        .pool_offset   = (pool_offset + SNAPSHOT_POOL_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_POOL_ALIGN - 1),
+        .pool_size     = pool_ctx->mem_size,
+        .regs          = snapshot->regs
+    };
+    bool result = 1 == fwrite(&header, sizeof(struct snapshot_header), 1, stream)
+        && snapshot->text_len == fwrite(snapshot->text, sizeof(struct u6a_vm_ins), snapshot->text_len, stream)
+        && snapshot->rodata_len == fwrite(snapshot->rodata, sizeof(char), snapshot->rodata_len, stream);
+    for (struct u6a_vm_stack* vs = stack_ctx->segments; result && vs; vs = vs->next_seg) {
+        struct snapshot_seg_header seg_header = {
+            .prev   = seg_index_find(index, seg_count, vs->prev),
+            .top    = vs->top,
+            .cap    = vs->cap,
+            .refcnt = vs->refcnt
+        };
+        result = 1 == fwrite(&seg_header, sizeof(struct snapshot_seg_header), 1, stream)
+            && vs->top + 1 == fwrite(vs->elems, sizeof(struct u6a_vm_var_fn), vs->top + 1, stream);
+    }
+    if (result) {
+        result = 0 == fseek(stream, header.pool_offset, SEEK_SET);
+    }
+    if (result) {
+        pool_swizzle(pool_ctx, index, segs, seg_count, snapshot->text, true);
+        result = 1 == fwrite(pool_ctx->active_pool, pool_ctx->mem_size, 1, stream);
+        pool_swizzle(pool_ctx, index, segs, seg_count, snapshot->text, false);
+    }
+    free(index);
+    if (UNLIKELY(fclose(stream) || !result)) {
+        u6a_err_write_failed(err_stage, 0, file_name);
+        return false;
+    }
+    return true;
+}
+
+static inline bool
+check_header(const struct snapshot_header* header) {
+    return header->magic == U6A_MAGIC && header->ver_major == U6A_VER_MAJOR && header->ver_minor == U6A_VER_MINOR
+        && header->ptr_size == sizeof(void*) && header->byte_order == SNAPSHOT_BYTE_ORDER
+        && header->nursery_len <= header->pool_len / 2
+        && header->pool_policy < u6a_vp_max_
+        && header->seg_len_max >= U6A_VM_MIN_STACK_SEGMENT_SIZE
+        && header->seg_len_max <= U6A_VM_MAX_STACK_SEGMENT_SIZE
+        && header->active_seg < header->seg_count
+        && header->pool_size == u6a_vm_pool_mem_size(header->pool_len, header->nursery_len, header->fstack_len);
+}
+
+bool
+u6a_vm_snapshot_load(const char* file_name, struct u6a_vm_snapshot* snapshot, struct u6a_vm_stack_ctx* stack_ctx,
+                     struct u6a_vm_pool_ctx* pool_ctx, bool huge_pages, jmp_buf* jmp_ctx, const char* err_stage)
+{
+    FILE* stream = fopen(file_name, "r");
+    if (UNLIKELY(stream == NULL)) {
+        u6a_err_cannot_open_file(err_stage, file_name);
+        return false;
+    }
+    struct snapshot_header header;
+    struct u6a_vm_stack** segs = NULL;
+    snapshot->text = NULL;
+    snapshot->rodata = NULL;
+    if (UNLIKELY(1 != fread(&header, sizeof(struct snapshot_header), 1, stream) || !check_header(&header))) {
+        goto bad_snapshot;
+    }
+    snapshot->text_len = header.text_len;
+    snapshot->rodata_len = header.rodata_len;
+    snapshot->regs = header.regs;
+    snapshot->text = malloc(header.text_len * sizeof(struct u6a_vm_ins));
+    snapshot->rodata = malloc(header.rodata_len);
+    segs = malloc(header.seg_count * sizeof(struct u6a_vm_stack*));
+    if (UNLIKELY(snapshot->text == NULL || (snapshot->rodata == NULL && header.rodata_len) || segs == NULL)) {
+        u6a_err_bad_alloc(err_stage, header.text_len * sizeof(struct u6a_vm_ins) + header.rodata_len);
+        goto load_failed;
+    }
+    if (UNLIKELY(header.text_len != fread(snapshot->text, sizeof(struct u6a_vm_ins), header.text_len, stream))) {
+        goto bad_snapshot;
+    }
+    if (UNLIKELY(header.rodata_len != fread(snapshot->rodata, sizeof(char), header.rodata_len, stream))) {
+        goto bad_snapshot;
+    }
+    // Stack segments
+    if (UNLIKELY(!u6a_vm_stack_init(stack_ctx, header.seg_len_max, huge_pages, jmp_ctx, err_stage))) {
+        goto load_failed;
+    }
+    u6a_vm_stack_destroy(stack_ctx);
+    for (uint32_t idx = 0; idx < header.seg_count; ++idx) {
+        struct snapshot_seg_header seg_header;
+        if (UNLIKELY(1 != fread(&seg_header, sizeof(struct snapshot_seg_header), 1, stream))) {
+            goto bad_snapshot;
+        }
+        if (UNLIKELY(seg_header.cap == 0 || seg_header.cap > header.seg_len_max
+                     || (seg_header.top != UINT32_MAX && seg_header.top >= seg_header.cap)))
+        {
+            goto bad_snapshot;
+        }
+        segs[idx] = u6a_vm_stack_create(stack_ctx, (void*)(uintptr_t)seg_header.prev, seg_header.top,
+                                        seg_header.cap);
+        if (UNLIKELY(segs[idx] == NULL)) {
+            goto load_failed;
+        }
+        segs[idx]->refcnt = seg_header.refcnt;
+        if (UNLIKELY(seg_header.top + 1 != fread(segs[idx]->elems, sizeof(struct u6a_vm_var_fn), seg_header.top + 1,
+                                                 stream)))
+        {
+            goto bad_snapshot;
+        }
+    }
+    for (uint32_t idx = 0; idx < header.seg_count; ++idx) {
+        uint32_t prev = (uintptr_t)segs[idx]->prev;
+        if (UNLIKELY(prev != UINT32_MAX && prev >= header.seg_count)) {
+            goto bad_snapshot;
+        }
+        segs[idx]->prev = prev == UINT32_MAX ? NULL : segs[prev];
+    }
+    stack_ctx->active_stack = segs[header.active_seg];
+    // Object pool, mapped from the file when possible
+    void* pool_mem = u6a_vm_mem_map_file(fileno(stream), header.pool_offset, header.pool_size);
+    enum u6a_vm_mem_mode mem_mode = u6a_vm_mem_mapped;
+    if (pool_mem == NULL) {
+        pool_mem = u6a_vm_mem_alloc(header.pool_size, huge_pages, &mem_mode);
+        if (UNLIKELY(pool_mem == NULL)) {
+            u6a_err_bad_alloc(err_stage, header.pool_size);
+            goto load_failed;
+        }
+        if (UNLIKELY(fseek(stream, header.pool_offset, SEEK_SET)
+                     || 1 != fread(pool_mem, header.pool_size, 1, stream)))
+        {
+            u6a_vm_mem_free(pool_mem, header.pool_size, mem_mode);
+            goto bad_snapshot;
+        }
+    }
+    u6a_vm_pool_attach(pool_ctx, pool_mem, mem_mode, header.pool_len, header.nursery_len, header.fstack_len,
+                       header.pool_policy, jmp_ctx, err_stage);
+    pool_ctx->nursery_pos = header.nursery_pos;
+    pool_ctx->nursery_live = header.nursery_live;
+    pool_ctx->nursery_full = header.nursery_pos + 1 == header.nursery_len && header.nursery_len > 0;
+    pool_swizzle(pool_ctx, NULL, segs, header.seg_count, snapshot->text, false);
+    stack_ctx->pool_ctx = pool_ctx;
+    pool_ctx->stack_ctx = stack_ctx;
+    free(segs);
+    fclose(stream);
+    return true;
+
+    bad_snapshot:
+    u6a_err_invalid_snapshot(err_stage, file_name);
+    load_failed:
+    free(segs);
+    free(snapshot->text);
+    free(snapshot->rodata);
+    snapshot->text = NULL;
+    snapshot->rodata = NULL;
+    fclose(stream);
+    return false;
+}
@@ -0,0 +1,59 @@
+/*
+ * vm_snapshot.h - Unlambda VM heap snapshot definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_VM_SNAPSHOT_H_
+#define U6A_VM_SNAPSHOT_H_
+
+#include "common.h"
+#include "vm_defs.h"
+#include "vm_stack.h"
+#include "vm_pool.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+struct u6a_vm_snapshot_regs {
+    uint32_t             ins;        /* offset of the instruction being executed */
+    int32_t              current_char;
+    struct u6a_vm_var_fn acc;
+    struct u6a_vm_var_fn top;
+    struct u6a_vm_var_fn func;       /* function being applied */
+    struct u6a_vm_var_fn arg;
+};
+
+struct u6a_vm_snapshot {
+    struct u6a_vm_ins*          text;
+    uint32_t                    text_len;
+    char*                       rodata;
+    uint32_t                    rodata_len;
+    struct u6a_vm_snapshot_regs regs;
+};
+
+bool
+u6a_vm_snapshot_save(const char* file_name, const struct u6a_vm_snapshot* snapshot,
+                     struct u6a_vm_stack_ctx* stack_ctx, struct u6a_vm_pool_ctx* pool_ctx, const char* err_stage);
+
+bool
+u6a_vm_snapshot_load(const char* file_name, struct u6a_vm_snapshot* snapshot, struct u6a_vm_stack_ctx* stack_ctx,
+                     struct u6a_vm_pool_ctx* pool_ctx, bool huge_pages, jmp_buf* jmp_ctx, const char* err_stage);
+
+#endif
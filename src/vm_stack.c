@@ -27,30 +27,119 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef U6A_VM_STACK_FLAT_SUPPORTED
+// The flat stack whose guard regions are being watched, there can only be one at a time
+static struct u6a_vm_stack_ctx* flat_ctx;
+static sigjmp_buf*              flat_fault_ctx;
+static volatile sig_atomic_t    flat_fault;
+static struct sigaction         prev_segv_action;
+#endif
+
+static inline uint32_t
+vm_stack_class(uint32_t cap) {
+    uint32_t cls = 0;
+    while (( UINT32_C(1) << cls ) < cap) {
+        ++cls;
+    }
+    return cls;
+}
+
+static inline struct u6a_vm_stack*
+vm_stack_alloc(struct u6a_vm_stack_ctx* ctx, uint32_t cap) {
+    // Released segments of the same class are reused, whether they come from the slab or from malloc()
+    const uint32_t cls = vm_stack_class(cap);
+    struct u6a_vm_stack* vs = ctx->free_segs[cls];
+    if (vs) {
+        ctx->free_segs[cls] = vs->prev;
+        vs->cap = cap;
+        return vs;
+    }
+    const size_t align = _Alignof(struct u6a_vm_stack);
+    const size_t size = ( sizeof(struct u6a_vm_stack) + ( (size_t)1 << cls ) * sizeof(struct u6a_vm_var_fn)
+        + align - 1 ) & ~( align - 1 );
+    if (ctx->slab_pos + size <= ctx->slab_size) {
+        vs = (struct u6a_vm_stack*)(ctx->slab + ctx->slab_pos);
+        ctx->slab_pos += size;
+    } else {
+        vs = malloc(size);
+        if (UNLIKELY(vs == NULL)) {
+            u6a_err_bad_alloc(ctx->err_stage, size);
+            return NULL;
+        }
+    }
+    vs->cap = cap;
+    return vs;
+}
+
+static inline uint32_t
+vm_stack_init_cap(struct u6a_vm_stack_ctx* ctx) {
+    return ctx->seg_len_max < U6A_VM_INIT_STACK_SEGMENT_SIZE ? ctx->seg_len_max : U6A_VM_INIT_STACK_SEGMENT_SIZE;
+}
+
+// Segments double in size as the chain deepens
+static inline uint32_t
+vm_stack_next_cap(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
+    const uint32_t cap = vs->cap < ctx->seg_len_max / 2 ? vs->cap * 2 : ctx->seg_len_max;
+    const uint32_t init_cap = vm_stack_init_cap(ctx);
+    return cap < init_cap ? init_cap : cap;
+}
+
+// Copies are sized to the elements they hold, rounded up to their size class
+static inline uint32_t
+vm_stack_dup_cap(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
+    const uint32_t cap = UINT32_C(1) << vm_stack_class(vs->top + 1);
+    return cap < ctx->seg_len_max ? cap : ctx->seg_len_max;
+}
+
+static inline void
+vm_stack_link(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
+    vs->prev_seg = NULL;
+    vs->next_seg = ctx->segments;
+    if (ctx->segments) {
+        ctx->segments->prev_seg = vs;
+    }
+    ctx->segments = vs;
+}
+
+static inline void
+vm_stack_release(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
+    if (vs->prev_seg) {
+        vs->prev_seg->next_seg = vs->next_seg;
+    } else {
+        ctx->segments = vs->next_seg;
+    }
+    if (vs->next_seg) {
+        vs->next_seg->prev_seg = vs->prev_seg;
+    }
+    const uint32_t cls = vm_stack_class(vs->cap);
+    vs->prev = ctx->free_segs[cls];
+    ctx->free_segs[cls] = vs;
+}
+
 static inline struct u6a_vm_stack*
-vm_stack_create(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* prev, uint32_t top) {
-    const uint32_t size = sizeof(struct u6a_vm_stack) + ctx->stack_seg_len * sizeof(struct u6a_vm_var_fn);
-    struct u6a_vm_stack* vs = malloc(size);
+vm_stack_create(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* prev, uint32_t top, uint32_t cap) {
+    struct u6a_vm_stack* vs = vm_stack_alloc(ctx, cap);
     if (UNLIKELY(vs == NULL)) {
-        u6a_err_bad_alloc(ctx->err_stage, size);
         return NULL;
     }
     vs->prev = prev;
     vs->top = top;
     vs->refcnt = 0;
+    vm_stack_link(ctx, vs);
     return vs;
 }
 
 static inline struct u6a_vm_stack*
 vm_stack_dup(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
-    const uint32_t size = sizeof(struct u6a_vm_stack) + ctx->stack_seg_len * sizeof(struct u6a_vm_var_fn);
-    struct u6a_vm_stack* dup_stack = malloc(size);
+    const uint32_t cap = vm_stack_dup_cap(ctx, vs);
+    struct u6a_vm_stack* dup_stack = vm_stack_alloc(ctx, cap);
     if (UNLIKELY(dup_stack == NULL)) {
-        u6a_err_bad_alloc(ctx->err_stage, size);
         U6A_VM_ERR(ctx);
     }
     memcpy(dup_stack, vs, sizeof(struct u6a_vm_stack) + (vs->top + 1) * sizeof(struct u6a_vm_var_fn));
+    dup_stack->cap = cap;
     dup_stack->refcnt = 0;
+    vm_stack_link(ctx, dup_stack);
     for (uint32_t idx = vs->top; idx < UINT32_MAX; --idx) {
         struct u6a_vm_var_fn elem = vs->elems[idx];
         if (elem.token.fn & U6A_VM_FN_REF) {
@@ -63,6 +152,84 @@ vm_stack_dup(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
     return dup_stack;
 }
 
+/*
+ * A segment shared with a continuation is copied once the stack unwinds into it. Before a large segment gets
+ * captured, it is broken into segments of the minimum size, so that neither the capture nor the copies made upon
+ * return are proportional to the depth of the stack.
+ */
+static inline void
+vm_stack_chop(struct u6a_vm_stack_ctx* ctx) {
+    struct u6a_vm_stack* vs = ctx->active_stack;
+    struct u6a_vm_stack* prev = vs->prev;
+    const uint32_t len = vs->top + 1;
+    if (UNLIKELY(len == 0)) {
+        // Nothing to break, and the previous segment, which may be shared, must not become the active one
+        return;
+    }
+    for (uint32_t pos = 0; pos < len; pos += U6A_VM_MIN_STACK_SEGMENT_SIZE) {
+        const uint32_t chunk_len = len - pos < U6A_VM_MIN_STACK_SEGMENT_SIZE ? len - pos
+            : U6A_VM_MIN_STACK_SEGMENT_SIZE;
+        struct u6a_vm_stack* chunk = vm_stack_create(ctx, prev, chunk_len - 1, U6A_VM_MIN_STACK_SEGMENT_SIZE);
+        if (UNLIKELY(chunk == NULL)) {
+            while (prev != vs->prev) {
+                struct u6a_vm_stack* chunk_prev = prev->prev;
+                vm_stack_release(ctx, prev);
+                prev = chunk_prev;
+            }
+            U6A_VM_ERR(ctx);
+        }
+        memcpy(chunk->elems, vs->elems + pos, chunk_len * sizeof(struct u6a_vm_var_fn));
+        if (pos) {
+            // The first one takes over the reference to the previous segment
+            ++prev->refcnt;
+        }
+        prev = chunk;
+    }
+    vm_stack_release(ctx, vs);
+    ctx->active_stack = prev;
+}
+
+/*
+ * Leave the emptied active segment for the previous one, which is copied if it is shared with a continuation.
+ * Segments other than the active one are never empty, so the new active segment has an element on top.
+ */
+static inline struct u6a_vm_stack*
+vm_stack_leave(struct u6a_vm_stack_ctx* ctx) {
+    struct u6a_vm_stack* vs = ctx->active_stack;
+    struct u6a_vm_stack* prev = vs->prev;
+    if (UNLIKELY(prev == NULL)) {
+        return NULL;
+    }
+    if (--prev->refcnt > 0) {
+        prev = vm_stack_dup(ctx, prev);
+    }
+    vm_stack_release(ctx, vs);
+    ctx->active_stack = prev;
+    return prev;
+}
+
+/*
+ * Make room for `top + 1` elements to be pushed onto a new segment. An empty active segment, such as the copy of
+ * one captured while empty, is replaced instead of being left in the chain.
+ */
+static inline struct u6a_vm_stack*
+vm_stack_extend(struct u6a_vm_stack_ctx* ctx, uint32_t top) {
+    struct u6a_vm_stack* vs = ctx->active_stack;
+    const bool empty = vs->top == UINT32_MAX;
+    struct u6a_vm_stack* next = vm_stack_create(ctx, empty ? vs->prev : vs, top, vm_stack_next_cap(ctx, vs));
+    if (UNLIKELY(next == NULL)) {
+        U6A_VM_ERR(ctx);
+    }
+    if (empty) {
+        // The new segment takes over the reference to the previous one
+        vm_stack_release(ctx, vs);
+    } else {
+        ++vs->refcnt;
+    }
+    ctx->active_stack = next;
+    return next;
+}
+
 static inline void
 vm_stack_free(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
     struct u6a_vm_stack* prev;
@@ -76,7 +243,7 @@ vm_stack_free(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
                     u6a_vm_pool_free(ctx->pool_ctx, elem.ref);
                 }
             }
-            free(vs);
+            vm_stack_release(ctx, vs);
             vs = prev;
         } else {
             break;
@@ -84,93 +251,150 @@ vm_stack_free(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
     } while (vs);
 }
 
+#ifdef U6A_VM_STACK_FLAT_SUPPORTED
+
+static void
+flat_stack_on_segv(int sig, siginfo_t* info, void* ucontext) {
+    (void)sig;
+    (void)ucontext;
+    const char* addr = info->si_addr;
+    const char* begin = (const char*)flat_ctx->flat_base;
+    const char* end = begin + U6A_VM_STACK_FLAT_SIZE;
+    if (addr >= begin - U6A_VM_MEM_GUARD_SIZE && addr < begin) {
+        flat_fault = u6a_vsf_underflow;
+    } else if (addr >= end && addr < end + U6A_VM_MEM_GUARD_SIZE) {
+        flat_fault = u6a_vsf_overflow;
+    } else {
+        // Not a fault of the VM, which is retried with the previous action
+        sigaction(SIGSEGV, &prev_segv_action, NULL);
+        return;
+    }
+    // The fault can only be raised by a push or pop in the interpreter loop, which is safe to abandon.
+    // It is reported after the jump, which also unblocks SIGSEGV, as the handler itself may only do so much.
+    siglongjmp(*flat_fault_ctx, -1);
+}
+
+enum u6a_vm_stack_fault
+u6a_vm_stack_flat_fault() {
+    return flat_fault;
+}
+
+#endif
+
 bool
-u6a_vm_stack_init(struct u6a_vm_stack_ctx* ctx, uint32_t stack_seg_len, jmp_buf* jmp_ctx, const char* err_stage) {
-    ctx->stack_seg_len = stack_seg_len;
+u6a_vm_stack_init(struct u6a_vm_stack_ctx* ctx, uint32_t seg_len_max, bool huge_pages, jmp_buf* jmp_ctx,
+                  const char* err_stage)
+{
+    ctx->flat_base = NULL;
+    ctx->flat_top = NULL;
+    ctx->seg_len_max = seg_len_max;
+    ctx->segments = NULL;
+    ctx->slab = NULL;
+    ctx->slab_size = 0;
+    ctx->slab_pos = 0;
+    memset(ctx->free_segs, 0, sizeof(ctx->free_segs));
+    if (huge_pages) {
+        // Segments are carved from a slab of huge pages, and fall back to malloc() once it is used up
+        ctx->slab = u6a_vm_mem_alloc(U6A_VM_MEM_HUGE_PAGE_SIZE, true, &ctx->slab_mode);
+        if (UNLIKELY(ctx->slab == NULL)) {
+            u6a_err_bad_alloc(err_stage, U6A_VM_MEM_HUGE_PAGE_SIZE);
+            return false;
+        }
+        ctx->slab_size = U6A_VM_MEM_HUGE_PAGE_SIZE;
+    }
     ctx->jmp_ctx = jmp_ctx;
     ctx->err_stage = err_stage;
-    ctx->active_stack = vm_stack_create(ctx, NULL, UINT32_MAX);
+    ctx->active_stack = vm_stack_create(ctx, NULL, UINT32_MAX, vm_stack_init_cap(ctx));
     return ctx->active_stack != NULL;
 }
 
+#ifdef U6A_VM_STACK_FLAT_SUPPORTED
+bool
+u6a_vm_stack_init_flat(struct u6a_vm_stack_ctx* ctx, jmp_buf* jmp_ctx, sigjmp_buf* fault_ctx,
+                       const char* err_stage)
+{
+    if (flat_ctx) {
+        return false;
+    }
+    struct u6a_vm_var_fn* base = u6a_vm_mem_reserve_guarded(U6A_VM_STACK_FLAT_SIZE);
+    if (base == NULL) {
+        return false;
+    }
+    struct sigaction action = {
+        .sa_sigaction = flat_stack_on_segv,
+        .sa_flags     = SA_SIGINFO
+    };
+    sigemptyset(&action.sa_mask);
+    if (UNLIKELY(sigaction(SIGSEGV, &action, &prev_segv_action))) {
+        u6a_vm_mem_free_guarded(base, U6A_VM_STACK_FLAT_SIZE);
+        return false;
+    }
+    memset(ctx, 0, sizeof(struct u6a_vm_stack_ctx));
+    ctx->flat_base = base;
+    ctx->flat_top = base - 1;
+    ctx->jmp_ctx = jmp_ctx;
+    ctx->err_stage = err_stage;
+    flat_ctx = ctx;
+    flat_fault_ctx = fault_ctx;
+    flat_fault = u6a_vsf_none;
+    return true;
+}
+#endif
+
 // Boilerplates below. If only we have C++ templates here... (macros just make things nastier)
 
-U6A_HOT void
-u6a_vm_stack_push1_split_(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0) {
-    struct u6a_vm_stack* vs = ctx->active_stack;
-    ctx->active_stack = vm_stack_create(ctx, vs, 0);
-    if (UNLIKELY(ctx->active_stack == NULL)) {
-        ctx->active_stack = vs;
+U6A_HOT struct u6a_vm_var_fn
+u6a_vm_stack_top_split_(struct u6a_vm_stack_ctx* ctx) {
+    struct u6a_vm_stack* vs = vm_stack_leave(ctx);
+    if (UNLIKELY(vs == NULL)) {
         U6A_VM_ERR(ctx);
     }
-    ++vs->refcnt;
-    ctx->active_stack->elems[0] = v0;
+    return vs->elems[vs->top];
+}
+
+U6A_HOT void
+u6a_vm_stack_push1_split_(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0) {
+    struct u6a_vm_stack* vs = vm_stack_extend(ctx, 0);
+    vs->elems[0] = v0;
 }
 
 U6A_HOT void
 u6a_vm_stack_push2_split_(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0, struct u6a_vm_var_fn v1) {
-    struct u6a_vm_stack* vs = ctx->active_stack;
-    ctx->active_stack = vm_stack_create(ctx, vs, 1);
-    if (UNLIKELY(ctx->active_stack == NULL)) {
-        ctx->active_stack = vs;
-        U6A_VM_ERR(ctx);
-    }
-    ++vs->refcnt;
-    ctx->active_stack->elems[0] = v0;
-    ctx->active_stack->elems[1] = v1;
+    struct u6a_vm_stack* vs = vm_stack_extend(ctx, 1);
+    vs->elems[0] = v0;
+    vs->elems[1] = v1;
 }
 
 U6A_HOT void
 u6a_vm_stack_push3_split_(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0, struct u6a_vm_var_fn v1,
                           struct u6a_vm_var_fn v2)
 {
-    struct u6a_vm_stack* vs = ctx->active_stack;
-    ctx->active_stack = vm_stack_create(ctx, vs, 2);
-    if (UNLIKELY(ctx->active_stack == NULL)) {
-        ctx->active_stack = vs;
-        U6A_VM_ERR(ctx);
-    }
-    ++vs->refcnt;
-    ctx->active_stack->elems[0] = v0;
-    ctx->active_stack->elems[1] = v1;
-    ctx->active_stack->elems[2] = v2;
+    struct u6a_vm_stack* vs = vm_stack_extend(ctx, 2);
+    vs->elems[0] = v0;
+    vs->elems[1] = v1;
+    vs->elems[2] = v2;
 }
 
 U6A_HOT void
 u6a_vm_stack_push4_split_(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0, struct u6a_vm_var_fn v1,
                           struct u6a_vm_var_fn v2, struct u6a_vm_var_fn v3)
 {
-    struct u6a_vm_stack* vs = ctx->active_stack;
-    ctx->active_stack = vm_stack_create(ctx, vs, 3);
-    if (UNLIKELY(ctx->active_stack == NULL)) {
-        ctx->active_stack = vs;
-        U6A_VM_ERR(ctx);
-    }
-    ++vs->refcnt;
-    ctx->active_stack->elems[0] = v0;
-    ctx->active_stack->elems[1] = v1;
-    ctx->active_stack->elems[2] = v2;
-    ctx->active_stack->elems[3] = v3;
+    struct u6a_vm_stack* vs = vm_stack_extend(ctx, 3);
+    vs->elems[0] = v0;
+    vs->elems[1] = v1;
+    vs->elems[2] = v2;
+    vs->elems[3] = v3;
 }
 
 U6A_HOT void
 u6a_vm_stack_pop_split_(struct u6a_vm_stack_ctx* ctx) {
-    struct u6a_vm_stack* vs = ctx->active_stack;
-    ctx->active_stack = vs->prev;
-    if (UNLIKELY(ctx->active_stack == NULL)) {
+    struct u6a_vm_stack* vs = vm_stack_leave(ctx);
+    if (UNLIKELY(vs == NULL)) {
+        ++ctx->active_stack->top;
         u6a_err_stack_underflow(ctx->err_stage);
-        ctx->active_stack = vs;
-        U6A_VM_ERR(ctx);
-    }
-    if (--ctx->active_stack->refcnt > 0) {
-        ctx->active_stack = vm_stack_dup(ctx, ctx->active_stack);
-    }
-    if (UNLIKELY(ctx->active_stack == NULL)) {
-        ctx->active_stack = vs;
         U6A_VM_ERR(ctx);
     }
-    free(vs);
-    --ctx->active_stack->top;
+    --vs->top;
 }
 
 U6A_HOT struct u6a_vm_var_fn
@@ -178,6 +402,19 @@ u6a_vm_stack_xch_split_(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0) {
     struct u6a_vm_stack* vs = ctx->active_stack;
     struct u6a_vm_var_fn elem;
     // XCH on segmented stacks is inefficient, perhaps there's a better solution?
+    if (vs->top == UINT32_MAX) {
+        vs = vm_stack_leave(ctx);
+        if (UNLIKELY(vs == NULL)) {
+            u6a_err_stack_underflow(ctx->err_stage);
+            U6A_VM_ERR(ctx);
+        }
+        if (vs->top != 0) {
+            elem = vs->elems[vs->top - 1];
+            vs->elems[vs->top - 1] = v0;
+            return elem;
+        }
+    }
+    // The element below the top one is on top of the previous segment
     struct u6a_vm_stack* prev = vs->prev;
     if (UNLIKELY(prev == NULL)) {
         u6a_err_stack_underflow(ctx->err_stage);
@@ -185,35 +422,79 @@ u6a_vm_stack_xch_split_(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0) {
     }
     if (--prev->refcnt > 0) {
         prev = vm_stack_dup(ctx, prev);
-        if (UNLIKELY(prev == NULL)) {
-            U6A_VM_ERR(ctx);
-        }
-    }
-    if (vs->top == 0) {
-        ++prev->refcnt;
-        vs->prev = prev;
-        elem = prev->elems[prev->top];
-        prev->elems[prev->top] = v0;
-    } else {
-        free(vs);
-        ctx->active_stack = prev;
-        elem = prev->elems[prev->top - 1];
-        prev->elems[prev->top - 1] = v0;
     }
+    ++prev->refcnt;
+    vs->prev = prev;
+    elem = prev->elems[prev->top];
+    prev->elems[prev->top] = v0;
     return elem;
 }
 
+struct u6a_vm_stack*
+u6a_vm_stack_create(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* prev, uint32_t top, uint32_t cap) {
+    return vm_stack_create(ctx, prev, top, cap);
+}
+
 struct u6a_vm_stack*
 u6a_vm_stack_dup(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
     return vm_stack_dup(ctx, vs);
 }
 
+struct u6a_vm_stack*
+u6a_vm_stack_save(struct u6a_vm_stack_ctx* ctx) {
+    if (ctx->active_stack->top + 1 > U6A_VM_MIN_STACK_SEGMENT_SIZE) {
+        vm_stack_chop(ctx);
+    }
+    return vm_stack_dup(ctx, ctx->active_stack);
+}
+
 void
 u6a_vm_stack_discard(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
     vm_stack_free(ctx, vs);
 }
 
+uint32_t
+u6a_vm_stack_num_segments(struct u6a_vm_stack_ctx* ctx) {
+    uint32_t num_segments = 0;
+    for (struct u6a_vm_stack* vs = ctx->segments; vs; vs = vs->next_seg) {
+        ++num_segments;
+    }
+    return num_segments;
+}
+
 void
 u6a_vm_stack_destroy(struct u6a_vm_stack_ctx* ctx) {
     vm_stack_free(ctx, ctx->active_stack);
 }
+
+void
+u6a_vm_stack_free_all(struct u6a_vm_stack_ctx* ctx) {
+    // Reference counts are not maintained, as the object pool is expected to be destroyed as well
+    while (ctx->segments) {
+        vm_stack_release(ctx, ctx->segments);
+    }
+    for (uint32_t cls = 0; cls < U6A_VM_STACK_SEG_CLASSES; ++cls) {
+        struct u6a_vm_stack* vs = ctx->free_segs[cls];
+        while (vs) {
+            struct u6a_vm_stack* prev = vs->prev;
+            if ((char*)vs < ctx->slab || (char*)vs >= ctx->slab + ctx->slab_size) {
+                free(vs);
+            }
+            vs = prev;
+        }
+        ctx->free_segs[cls] = NULL;
+    }
+    if (ctx->slab) {
+        u6a_vm_mem_free(ctx->slab, ctx->slab_size, ctx->slab_mode);
+        ctx->slab = NULL;
+    }
+#ifdef U6A_VM_STACK_FLAT_SUPPORTED
+    if (ctx->flat_base) {
+        sigaction(SIGSEGV, &prev_segv_action, NULL);
+        u6a_vm_mem_free_guarded(ctx->flat_base, U6A_VM_STACK_FLAT_SIZE);
+        ctx->flat_base = ctx->flat_top = NULL;
+        flat_ctx = NULL;
+    }
+#endif
+    ctx->active_stack = NULL;
+}
@@ -24,38 +24,85 @@
 
 #include "common.h"
 #include "vm_defs.h"
+#include "vm_mem.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <setjmp.h>
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_SIGACTION)
+#define U6A_VM_STACK_FLAT_SUPPORTED
+#include <signal.h>
+#endif
+
+// Segments are allocated in power-of-two size classes, up to U6A_VM_MAX_STACK_SEGMENT_SIZE elements
+#define U6A_VM_STACK_SEG_CLASSES 21
+
+// Address space reserved for a flat stack, of which only the pages in use are committed
+#define U6A_VM_STACK_FLAT_SIZE   ( sizeof(void*) > 4 ? (size_t)1 << 30 : (size_t)64 << 20 )
+
+enum u6a_vm_stack_fault {
+    u6a_vsf_none,
+    u6a_vsf_underflow,
+    u6a_vsf_overflow
+};
+
 struct u6a_vm_stack {
     struct u6a_vm_stack* prev;
+    struct u6a_vm_stack* prev_seg;   /* neighbours in the list of all allocated segments */
+    struct u6a_vm_stack* next_seg;
     uint32_t             top;
+    uint32_t             cap;        /* number of elements this segment holds */
     uint32_t             refcnt;
     struct u6a_vm_var_fn elems[];
 };
 
 struct u6a_vm_stack_ctx {
     struct u6a_vm_stack*    active_stack;
-    uint32_t                stack_seg_len;
+    struct u6a_vm_stack*    segments;
+    char*                   slab;
+    size_t                  slab_size;
+    size_t                  slab_pos;
+    enum u6a_vm_mem_mode    slab_mode;
+    struct u6a_vm_stack*    free_segs[U6A_VM_STACK_SEG_CLASSES];
+    uint32_t                seg_len_max;
+    struct u6a_vm_var_fn*   flat_base;       /* bottom of the flat stack, NULL if the stack is segmented */
+    struct u6a_vm_var_fn*   flat_top;
     struct u6a_vm_pool_ctx* pool_ctx;
     jmp_buf*                jmp_ctx;
     const char*             err_stage;
 };
 
 bool
-u6a_vm_stack_init(struct u6a_vm_stack_ctx* ctx, uint32_t stack_seg_len, jmp_buf* jmp_ctx, const char* err_stage);
+u6a_vm_stack_init(struct u6a_vm_stack_ctx* ctx, uint32_t seg_len_max, bool huge_pages, jmp_buf* jmp_ctx,
+                  const char* err_stage);
+
+#ifdef U6A_VM_STACK_FLAT_SUPPORTED
+/*
+ * Initialize a flat stack, a contiguous one which can only be used when no continuation is ever captured,
+ * with the u6a_vm_stack_flat_*() functions below. Returns false if it cannot be set up.
+ *
+ * Overflow and underflow fault on the guard pages around it, upon which the SIGSEGV handler records the fault and
+ * jumps to `fault_ctx`, where it is to be reported after calling u6a_vm_stack_flat_fault().
+ */
+bool
+u6a_vm_stack_init_flat(struct u6a_vm_stack_ctx* ctx, jmp_buf* jmp_ctx, sigjmp_buf* fault_ctx,
+                       const char* err_stage);
+
+// The fault which last jumped to `fault_ctx`
+enum u6a_vm_stack_fault
+u6a_vm_stack_flat_fault();
+#endif
+
+struct u6a_vm_var_fn
+u6a_vm_stack_top_split_(struct u6a_vm_stack_ctx* ctx);
 
 static inline struct u6a_vm_var_fn
 u6a_vm_stack_top(struct u6a_vm_stack_ctx* ctx) {
     struct u6a_vm_stack* vs = ctx->active_stack;
     if (UNLIKELY(vs->top == UINT32_MAX)) {
-        vs = vs->prev;
-        if (UNLIKELY(vs == NULL)) {
-            U6A_VM_ERR(ctx);
-        }
-        ctx->active_stack = vs;
+        return u6a_vm_stack_top_split_(ctx);
     }
     return vs->elems[vs->top];
 }
@@ -66,7 +113,7 @@ u6a_vm_stack_push1_split_(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0)
 static inline void
 u6a_vm_stack_push1(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0) {
     struct u6a_vm_stack* vs = ctx->active_stack;
-    if (LIKELY(vs->top + 1 < ctx->stack_seg_len)) {
+    if (LIKELY(vs->top + 1 < vs->cap)) {
         vs->elems[++vs->top] = v0;
     } else {
         u6a_vm_stack_push1_split_(ctx, v0);
@@ -79,7 +126,7 @@ u6a_vm_stack_push2_split_(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0,
 static inline void
 u6a_vm_stack_push2(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0, struct u6a_vm_var_fn v1) {
     struct u6a_vm_stack* vs = ctx->active_stack;
-    if (LIKELY(vs->top + 2 < ctx->stack_seg_len)) {
+    if (LIKELY(vs->top + 2 < vs->cap)) {
         vs->elems[++vs->top] = v0;
         vs->elems[++vs->top] = v1;
     } else {
@@ -96,7 +143,7 @@ u6a_vm_stack_push3(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0, struct
                    struct u6a_vm_var_fn v2)
 {
     struct u6a_vm_stack* vs = ctx->active_stack;
-    if (LIKELY(vs->top + 3 < ctx->stack_seg_len)) {
+    if (LIKELY(vs->top + 3 < vs->cap)) {
         vs->elems[++vs->top] = v0;
         vs->elems[++vs->top] = v1;
         vs->elems[++vs->top] = v2;
@@ -114,7 +161,7 @@ u6a_vm_stack_push4(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0, struct
                    struct u6a_vm_var_fn v2, struct u6a_vm_var_fn v3)
 {
     struct u6a_vm_stack* vs = ctx->active_stack;
-    if (LIKELY(vs->top + 4 < ctx->stack_seg_len)) {
+    if (LIKELY(vs->top + 4 < vs->cap)) {
         vs->elems[++vs->top] = v0;
         vs->elems[++vs->top] = v1;
         vs->elems[++vs->top] = v2;
@@ -152,20 +199,83 @@ u6a_vm_stack_xch(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0) {
     return elem;
 }
 
+// Without segment boundaries to check for, overflow and underflow are caught by guard regions
+
+static inline struct u6a_vm_var_fn
+u6a_vm_stack_flat_top(struct u6a_vm_stack_ctx* ctx) {
+    return *ctx->flat_top;
+}
+
+static inline void
+u6a_vm_stack_flat_push1(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0) {
+    *++ctx->flat_top = v0;
+}
+
+static inline void
+u6a_vm_stack_flat_push2(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0, struct u6a_vm_var_fn v1) {
+    struct u6a_vm_var_fn* top = ctx->flat_top;
+    top[1] = v0;
+    top[2] = v1;
+    ctx->flat_top = top + 2;
+}
+
+static inline void
+u6a_vm_stack_flat_push3(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0, struct u6a_vm_var_fn v1,
+                        struct u6a_vm_var_fn v2)
+{
+    struct u6a_vm_var_fn* top = ctx->flat_top;
+    top[1] = v0;
+    top[2] = v1;
+    top[3] = v2;
+    ctx->flat_top = top + 3;
+}
+
+static inline void
+u6a_vm_stack_flat_push4(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0, struct u6a_vm_var_fn v1,
+                        struct u6a_vm_var_fn v2, struct u6a_vm_var_fn v3)
+{
+    struct u6a_vm_var_fn* top = ctx->flat_top;
+    top[1] = v0;
+    top[2] = v1;
+    top[3] = v2;
+    top[4] = v3;
+    ctx->flat_top = top + 4;
+}
+
+static inline void
+u6a_vm_stack_flat_pop(struct u6a_vm_stack_ctx* ctx) {
+    --ctx->flat_top;
+}
+
+static inline struct u6a_vm_var_fn
+u6a_vm_stack_flat_xch(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_var_fn v0) {
+    struct u6a_vm_var_fn elem = ctx->flat_top[-1];
+    ctx->flat_top[-1] = v0;
+    return elem;
+}
+
+struct u6a_vm_stack*
+u6a_vm_stack_create(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* prev, uint32_t top, uint32_t cap);
+
 struct u6a_vm_stack*
 u6a_vm_stack_dup(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs);
 
-static inline struct u6a_vm_stack*
-u6a_vm_stack_save(struct u6a_vm_stack_ctx* ctx) {
-    return u6a_vm_stack_dup(ctx, ctx->active_stack);
-}
+struct u6a_vm_stack*
+u6a_vm_stack_save(struct u6a_vm_stack_ctx* ctx);
 
 void
 u6a_vm_stack_discard(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs);
 
+// Number of segments in use, by the active stack and captured continuations, 0 for a flat stack
+uint32_t
+u6a_vm_stack_num_segments(struct u6a_vm_stack_ctx* ctx);
+
 void
 u6a_vm_stack_destroy(struct u6a_vm_stack_ctx* ctx);
 
+void
+u6a_vm_stack_free_all(struct u6a_vm_stack_ctx* ctx);
+
 static inline void
 u6a_vm_stack_resume(struct u6a_vm_stack_ctx* ctx, struct u6a_vm_stack* vs) {
     u6a_vm_stack_destroy(ctx);
@@ -0,0 +1,144 @@
+/*
+ * vm_verify.c - Unlambda bytecode verifier
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vm_verify.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline bool
+verify_fn(uint8_t fn) {
+    switch (fn) {
+        case u6a_vf_k:
+        case u6a_vf_s:
+        case u6a_vf_i:
+        case u6a_vf_v:
+        case u6a_vf_c:
+        case u6a_vf_d:
+        case u6a_vf_e:
+        case u6a_vf_in:
+        case u6a_vf_pipe:
+        case u6a_vf_out:
+        case u6a_vf_cmp:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline const char*
+verify_app(const struct u6a_vm_ins* ins, uint32_t unused, bool acc_defined) {
+    const uint8_t first = ins->operand.fn.first.fn;
+    const uint8_t second = ins->operand.fn.second.fn;
+    // An absent operand is taken from the accumulator, which only one of them can be
+    if (first ? !verify_fn(first) || ( second && !verify_fn(second) ) : !verify_fn(second)) {
+        return "invalid function token";
+    }
+    if (!acc_defined && !( first && second )) {
+        return "accumulator read before defined";
+    }
+    if (( u6a_vm_fn_feature(first) | u6a_vm_fn_feature(second) ) & unused) {
+        return "function flagged as unused";
+    }
+    return NULL;
+}
+
+bool
+u6a_vm_verify(const struct u6a_vm_ins* text, uint32_t text_len, const char* rodata, uint32_t rodata_len,
+              uint32_t unused, const char* err_stage)
+{
+    if (UNLIKELY(text_len == 0)) {
+        u6a_err_bad_bytecode(err_stage, 0, "empty .text section");
+        return false;
+    }
+    // Offsets of the `la` instructions closing each enclosing `sa` or `del`, innermost last
+    uint32_t* closers = malloc(text_len * sizeof(uint32_t));
+    if (UNLIKELY(closers == NULL)) {
+        u6a_err_bad_alloc(err_stage, text_len * sizeof(uint32_t));
+        return false;
+    }
+    uint32_t depth = 0;
+    // The accumulator holds no value until an APP, LC or DEL gives it one, and keeps one from then on. Jumps only
+    // go forwards, and code skipped by a DEL runs after the DEL, so checking in order of offsets suffices.
+    bool acc_defined = false;
+    const char* reason = NULL;
+    uint32_t offset;
+    for (offset = 0; offset < text_len && reason == NULL; ++offset) {
+        const struct u6a_vm_ins* ins = text + offset;
+        const uint32_t operand = ins->operand.offset;
+        switch (ins->opcode) {
+            case u6a_vo_app:
+                reason = verify_app(ins, unused, acc_defined);
+                acc_defined = true;
+                break;
+            case u6a_vo_sa:
+            case u6a_vo_del:
+                // Jumps to the instruction right after the closing `la`
+                if (UNLIKELY(ins->opcode == u6a_vo_del && ( unused & U6A_BC_FLAG_NO_PROMISE ))) {
+                    reason = "DEL flagged as unused";
+                } else if (UNLIKELY(operand <= offset + 1 || operand > text_len)) {
+                    reason = "jump target out of range";
+                } else if (UNLIKELY(text[operand - 1].opcode != u6a_vo_la)) {
+                    reason = "jump target not preceded by LA";
+                } else if (UNLIKELY(depth && operand - 1 >= closers[depth - 1])) {
+                    reason = "jump target crosses an enclosing LA";
+                } else if (UNLIKELY(ins->opcode == u6a_vo_sa && !acc_defined)) {
+                    reason = "accumulator read before defined";
+                } else {
+                    closers[depth++] = operand - 1;
+                }
+                acc_defined = true;
+                break;
+            case u6a_vo_la:
+                if (UNLIKELY(depth == 0 || closers[depth - 1] != offset)) {
+                    reason = "unbalanced stack";
+                } else if (UNLIKELY(!acc_defined)) {
+                    reason = "accumulator read before defined";
+                } else {
+                    --depth;
+                }
+                break;
+            case u6a_vo_lc:
+                if (UNLIKELY(ins->opcode_ex != u6a_vo_ex_print)) {
+                    reason = "invalid extended opcode";
+                } else if (UNLIKELY(operand >= rodata_len || !memchr(rodata + operand, '\0', rodata_len - operand))) {
+                    reason = "string out of range of .rodata";
+                }
+                acc_defined = true;
+                break;
+            default:
+                // XCH is only used by the prelude
+                reason = "invalid opcode";
+        }
+    }
+    free(closers);
+    if (LIKELY(reason == NULL)) {
+        const struct u6a_vm_ins* last = text + text_len - 1;
+        if (LIKELY(last->opcode == u6a_vo_app && last->operand.fn.first.fn == u6a_vf_e)) {
+            return true;
+        }
+        offset = text_len;
+        reason = "program does not end with E";
+    }
+    u6a_err_bad_bytecode(err_stage, offset - 1, reason);
+    return false;
+}
@@ -0,0 +1,45 @@
+/*
+ * vm_verify.h - Unlambda bytecode verifier definitions
+ * 
+ * Copyright (C) 2020  CismonX <admin@cismon.net>
+ *
+ * This file is part of U6a.
+ *
+ * U6a is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * U6a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with U6a.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef U6A_VM_VERIFY_H_
+#define U6A_VM_VERIFY_H_
+
+#include "common.h"
+#include "vm_defs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Check that a program (excluding the prelude) can be executed without run-time checks:
+ *  - every opcode, extended opcode and function token is valid,
+ *  - every `sa` and `del` is closed by a `la` right before its offset, and these pairs are properly nested,
+ *    which implies that user code never pops more than it pushes,
+ *  - every `lc` refers to a NUL-terminated string within .rodata,
+ *  - the accumulator is never read before an instruction gives it a value,
+ *  - the program ends with the application of `e`, so that execution never runs off the end of .text,
+ *  - no function token or `del` uses a feature in `unused`, the U6A_BC_FLAG_NO_* flags of the program.
+ */
+bool
+u6a_vm_verify(const struct u6a_vm_ins* text, uint32_t text_len, const char* rodata, uint32_t rodata_len,
+              uint32_t unused, const char* err_stage);
+
+#endif